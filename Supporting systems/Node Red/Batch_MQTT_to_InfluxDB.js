@@ -0,0 +1,119 @@
+// === Node Red Function Node for batched samples ===
+// Subscribe an MQTT-in node to <BMS Topic>/batch/# with output set to "a Buffer" and wire it here.
+// Handles all batch forms the gateway publishes:
+//   <BMS Topic>/batch      JSON or binary batch
+//   <BMS Topic>/batch/hs   the same, heatshrink-compressed (window 8, lookahead 4)
+// and writes every sample of the batch to InfluxDB in a single request.
+
+// === InfluxDB Auth Token ===
+const token = "YOUR_INFLUXDB_TOKEN";  // Replace this with your actual token
+
+const measurement = "battery";
+
+// === Heatshrink decoder (window 8 bits, lookahead 4 bits) ===
+function heatshrinkDecode(input) {
+    const out = [];
+    let byte = 0, bitsLeft = 0, pos = 0;
+    const totalBits = input.length * 8;
+    let bitsRead = 0;
+    function bits(count) {
+        let value = 0;
+        for (let i = 0; i < count; i++) {
+            if (bitsLeft === 0) {
+                byte = input[pos++];
+                bitsLeft = 8;
+            }
+            bitsLeft--;
+            value = (value << 1) | ((byte >> bitsLeft) & 1);
+        }
+        bitsRead += count;
+        return value;
+    }
+    // The last byte is zero-padded: stop when what is left cannot hold a whole token
+    while (totalBits - bitsRead >= 9) {
+        if (bits(1)) {
+            out.push(bits(8));
+        } else {
+            if (totalBits - bitsRead < 12) break;
+            const distance = bits(8) + 1;
+            const count = bits(4) + 1;
+            for (let i = 0; i < count; i++) {
+                out.push(out[out.length - distance]);
+            }
+        }
+    }
+    return Buffer.from(out);
+}
+
+// === Binary batch decoder (see "Sample Batching" in the main README) ===
+function decodeBinary(buf) {
+    const count = buf[3], cellCount = buf[4];
+    const t0 = buf.readUInt32LE(8);
+    const sentMs = buf.readUInt32LE(12);
+    const utcOffsetMs = Number(buf.readBigInt64LE(16));
+    const samples = [];
+    let p = 24;
+    for (let s = 0; s < count; s++) {
+        const sample = {
+            t: (t0 + buf.readUInt32LE(p)) >>> 0,
+            packV: buf.readUInt16LE(p + 4) / 100,
+            packA: buf.readInt32LE(p + 6) / 1000,
+            packSOC: buf[p + 10],
+            mos: buf[p + 11],
+            mosTemp: buf.readInt16LE(p + 12) / 10,
+            probe1Temp: buf.readInt16LE(p + 14) / 10,
+            probe2Temp: buf.readInt16LE(p + 16) / 10,
+            cellsMv: []
+        };
+        p += 18;
+        for (let c = 0; c < cellCount; c++, p += 2) {
+            sample.cellsMv.push(buf.readUInt16LE(p));
+        }
+        samples.push(sample);
+    }
+    // Binary batches carry no pack name; tag them with the BMS Topic instead
+    return { packName: msg.topic.split("/batch")[0], sentMs: sentMs, utcOffsetMs: utcOffsetMs || undefined, samples: samples };
+}
+
+let buf = Buffer.isBuffer(msg.payload) ? msg.payload : Buffer.from(String(msg.payload));
+if (msg.topic && msg.topic.endsWith("/hs")) {
+    buf = heatshrinkDecode(buf);
+}
+const batch = (buf[0] === 0x4A && buf[1] === 0x42) ? decodeBinary(buf) : JSON.parse(buf.toString());
+
+// Samples carry gateway uptime in 32-bit ms, which wraps after ~49.7 days; the age relative to
+// sentMs is taken modulo 2^32 so a wrap inside the batch does not matter. Use the gateway's SNTP
+// offset when it has one, otherwise place samples on this machine's clock relative to arrival.
+const arrivalMs = Date.now();
+const lines = batch.samples.map(s => {
+    const fields = {
+        packV: s.packV,
+        packA: s.packA,
+        packSOC: s.packSOC,
+        mosTemp: s.mosTemp,
+        probe1Temp: s.probe1Temp,
+        probe2Temp: s.probe2Temp,
+        chargeMosfet: s.mos & 1,
+        dischargeMosfet: (s.mos >> 1) & 1,
+        balancing: (s.mos >> 2) & 1
+    };
+    s.cellsMv.forEach((mv, i) => {
+        fields[`cell${i}V`] = mv / 1000;
+    });
+    const fieldString = Object.entries(fields).map(([k, v]) => `${k}=${v}`).join(',');
+    const ageMs = (batch.sentMs - s.t) >>> 0;
+    const utcMs = batch.utcOffsetMs ? batch.utcOffsetMs + batch.sentMs - ageMs : arrivalMs - ageMs;
+    const timestamp = utcMs * 1_000_000; // nanoseconds
+    return `${measurement},packName=${batch.packName.replace(/ /g, "\\ ")} ${fieldString} ${timestamp}`;
+});
+msg.payload = lines.join("\n");
+
+// === HTTP Request Setup ===
+msg.headers = {
+    "Authorization": "Token " + token,
+    "Content-Type": "text/plain"
+};
+msg.method = "POST";
+msg.url = "http://influxdb2:8086/api/v2/write?org=solarblue&bucket=BMS&precision=ns";
+
+return msg;
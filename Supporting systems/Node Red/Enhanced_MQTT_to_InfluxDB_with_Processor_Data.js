@@ -17,6 +17,7 @@ const pack = msg.payload.pack;
 const temps = pack.tempSensorValues || {};
 const cells = msg.payload.cells || {};
 const processor = msg.payload.processor || {};
+const resources = processor.resources || {};
 
 const fields = {
     // === PROCESSOR DATA ===
@@ -25,6 +26,9 @@ const fields = {
     cpuTemperature: processor.CPUTemperature,
     softwareVersion: processor.SoftwareVersion ? `"${processor.SoftwareVersion}"` : undefined,
     wdtRestartCount: processor.WDTRestartCount,
+    heapFree: resources.heapFree,
+    heapMinFree: resources.heapMinFree,
+    heapLargestBlock: resources.heapLargestBlock,
     
     // === BATTERY PACK DATA ===
     packV: pack.packV,
@@ -73,7 +77,10 @@ const fieldString = Object.entries(fields)
     })
     .join(',');
 
-const timestamp = Date.now() * 1_000_000; // nanoseconds
+// Sample time from the gateway (SNTP-synced, taken when the BMS frame completed); arrival time
+// only while the gateway has not synced yet
+const sampleMs = (typeof msg.payload.timestamp === "number") ? msg.payload.timestamp : Date.now();
+const timestamp = sampleMs * 1_000_000; // nanoseconds
 msg.payload = `${measurement},${tagString} ${fieldString} ${timestamp}`;
 
 // === HTTP Request Setup ===
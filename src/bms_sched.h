@@ -0,0 +1,122 @@
+// BMS bus transaction queue.
+// Kept free of ESP-IDF dependencies so it can be built on the host by tools/test_bms_sched.c.
+#ifndef BMS_SCHED_H
+#define BMS_SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Priority of a bus transaction, highest first
+typedef enum {
+    BMS_PRIO_SAFETY = 0,    // MOS switch writes and their read-back
+    BMS_PRIO_FAST,          // Single-ID telemetry reads
+    BMS_PRIO_FULL,          // Read-all polls and their retries
+    BMS_PRIO_DIAG,          // Baud probing and other diagnostics
+    BMS_PRIO_COUNT
+} bms_prio_t;
+
+// Enough for a full fast set, its fallback and every queued MQTT command
+#define BMS_SCHED_MAX_JOBS 16
+
+typedef struct {
+    uint8_t prio;           // bms_prio_t
+    uint8_t kind;           // Job type, defined by the caller
+    uint16_t arg;           // Register ID, command slot, ... defined by the caller
+    uint32_t seq;           // Push order, so a class runs first in, first out
+} bms_job_t;
+
+typedef struct {
+    bms_job_t jobs[BMS_SCHED_MAX_JOBS];
+    uint8_t count;
+    uint32_t next_seq;
+    uint32_t evicted[BMS_PRIO_COUNT];   // Jobs dropped to make room for a higher-priority one
+    uint32_t rejected[BMS_PRIO_COUNT];  // Jobs refused because the queue held nothing lower
+} bms_sched_t;
+
+static void bms_sched_init(bms_sched_t *s) {
+    s->count = 0;
+    s->next_seq = 0;
+    for (int p = 0; p < BMS_PRIO_COUNT; ++p) {
+        s->evicted[p] = 0;
+        s->rejected[p] = 0;
+    }
+}
+
+// True if a should run before b: higher priority first, then push order (wrap-safe)
+static bool bms_job_before(const bms_job_t *a, const bms_job_t *b) {
+    if (a->prio != b->prio) {
+        return a->prio < b->prio;
+    }
+    return (int32_t)(a->seq - b->seq) < 0;
+}
+
+static void bms_sched_remove(bms_sched_t *s, int i) {
+    s->jobs[i] = s->jobs[--s->count];   // Order comes from prio/seq, not position
+}
+
+// Queues a job. When the queue is full, the newest job of the lowest priority below this one
+// makes room; if there is none, the job is refused.
+static bool bms_sched_push(bms_sched_t *s, bms_prio_t prio, uint8_t kind, uint16_t arg) {
+    if (s->count == BMS_SCHED_MAX_JOBS) {
+        int victim = -1;
+        for (int i = 0; i < s->count; ++i) {
+            if (s->jobs[i].prio > prio && (victim < 0 || !bms_job_before(&s->jobs[i], &s->jobs[victim]))) {
+                victim = i;
+            }
+        }
+        if (victim < 0) {
+            s->rejected[prio]++;
+            return false;
+        }
+        s->evicted[s->jobs[victim].prio]++;
+        bms_sched_remove(s, victim);
+    }
+    bms_job_t *job = &s->jobs[s->count++];
+    job->prio = (uint8_t)prio;
+    job->kind = kind;
+    job->arg = arg;
+    job->seq = s->next_seq++;
+    return true;
+}
+
+// Takes the job that should run next into out. Returns false when the queue is empty.
+static bool bms_sched_pop(bms_sched_t *s, bms_job_t *out) {
+    if (s->count == 0) {
+        return false;
+    }
+    int next = 0;
+    for (int i = 1; i < s->count; ++i) {
+        if (bms_job_before(&s->jobs[i], &s->jobs[next])) {
+            next = i;
+        }
+    }
+    *out = s->jobs[next];
+    bms_sched_remove(s, next);
+    return true;
+}
+
+// Number of queued jobs of one priority
+static int bms_sched_pending(const bms_sched_t *s, bms_prio_t prio) {
+    int n = 0;
+    for (int i = 0; i < s->count; ++i) {
+        n += s->jobs[i].prio == prio;
+    }
+    return n;
+}
+
+// Removes every queued job of one kind, e.g. the rest of a fast set after a failed read.
+// Returns how many were removed.
+static int bms_sched_cancel(bms_sched_t *s, uint8_t kind) {
+    int removed = 0;
+    for (int i = 0; i < s->count;) {
+        if (s->jobs[i].kind == kind) {
+            bms_sched_remove(s, i);
+            removed++;
+        } else {
+            ++i;
+        }
+    }
+    return removed;
+}
+
+#endif // BMS_SCHED_H
@@ -0,0 +1,96 @@
+// Cell voltage statistics kernel.
+// Kept free of ESP-IDF dependencies so it can be built on the host by tools/bench_cell_stats.c.
+#ifndef CELL_STATS_H
+#define CELL_STATS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+// Maximum number of series cells the JK BMS can report (0xA9 allows 13 - 32 strings)
+#define BMS_MAX_CELLS 32
+
+// Result of compute_cell_stats()
+typedef struct {
+    uint16_t min_mv;
+    uint16_t max_mv;
+    uint8_t min_idx;
+    uint8_t max_idx;
+    float mean_mv;
+    float stddev_mv;
+    uint16_t median_mv;
+    uint16_t delta_mv;
+    uint8_t above_threshold;   // Cells more than threshold_mv above min_mv
+    uint8_t valid_cells;       // Cells reporting a non-zero voltage
+} cell_stats_t;
+
+// Single-pass statistics kernel over the packed cell voltage array.
+// mv: cell voltages in mV, n: number of cells (<= BMS_MAX_CELLS).
+// Sums are kept in integers so the mean and standard deviation are exact. Cells reporting 0 mV
+// (unpopulated/faulty taps) are excluded.
+// The same pass insertion-sorts the values so the median and the balance count come from the
+// sorted copy without a second walk over the input.
+static void compute_cell_stats(const uint16_t *mv, int n, uint16_t threshold_mv, cell_stats_t *out) {
+    uint16_t sorted[BMS_MAX_CELLS];
+    uint16_t min_mv = 0xFFFF, max_mv = 0;
+    uint8_t min_idx = 0, max_idx = 0;
+    uint32_t sum = 0, valid = 0;
+    uint64_t sum_sq = 0;
+
+    if (n > BMS_MAX_CELLS) n = BMS_MAX_CELLS;
+
+    for (int i = 0; i < n; i++) {
+        uint16_t v = mv[i];
+        // A 0 mV cell can never become the minimum
+        uint16_t v_min = v ? v : 0xFFFF;
+        int lt = v_min < min_mv;
+        int gt = v > max_mv;
+        min_mv = lt ? v_min : min_mv;
+        min_idx = lt ? (uint8_t)i : min_idx;
+        max_mv = gt ? v : max_mv;
+        max_idx = gt ? (uint8_t)i : max_idx;
+        sum += v;
+        sum_sq += (uint32_t)v * v;
+        valid += (v != 0);
+
+        // Insertion into the sorted copy (n <= 32, so this stays cheap)
+        int j = i;
+        while (j > 0 && sorted[j - 1] > v) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = v;
+    }
+
+    memset(out, 0, sizeof(*out));
+    if (valid == 0) {
+        return;
+    }
+
+    out->min_mv = min_mv;
+    out->max_mv = max_mv;
+    out->min_idx = min_idx;
+    out->max_idx = max_idx;
+    out->delta_mv = max_mv - min_mv;
+    out->valid_cells = (uint8_t)valid;
+    out->mean_mv = (float)sum / (float)valid;
+    // Var * valid^2 = valid * sum(v^2) - sum(v)^2, exact in 64-bit integers
+    uint64_t var_scaled = (uint64_t)valid * sum_sq - (uint64_t)sum * sum;
+    out->stddev_mv = sqrtf((float)var_scaled) / (float)valid;
+
+    // Zero cells sort to the front; the valid values occupy sorted[n - valid .. n - 1]
+    const uint16_t *vals = &sorted[n - valid];
+    out->median_mv = (valid & 1) ? vals[valid / 2]
+                                 : (uint16_t)(((uint32_t)vals[valid / 2 - 1] + vals[valid / 2]) / 2);
+
+    // Count of cells above min + threshold: binary search for the first value past the limit
+    uint32_t limit = (uint32_t)min_mv + threshold_mv;
+    int lo = 0, hi = (int)valid;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (vals[mid] > limit) hi = mid; else lo = mid + 1;
+    }
+    out->above_threshold = (uint8_t)(valid - lo);
+}
+
+#endif // CELL_STATS_H
@@ -25,6 +25,8 @@
 #include "freertos/FreeRTOS.h"
 // FreeRTOS task management
 #include "freertos/task.h"
+// FreeRTOS queues (MQTT command hand-off to the BMS loop)
+#include "freertos/queue.h"
 // ESP32 UART driver
 #include "driver/uart.h"
 // ESP32 GPIO driver
@@ -33,6 +35,12 @@
 #include "esp_log.h"
 // Standard C string manipulation library (for memcmp)
 #include <string.h> 
+// Standard C math library (sqrtf for cell statistics)
+#include <math.h>
+// Cell voltage statistics kernel (compute_cell_stats(), BMS_MAX_CELLS)
+#include "cell_stats.h"
+// BMS bus transaction queue (bms_sched_push(), bms_sched_pop(), bms_prio_t)
+#include "bms_sched.h"
 
 // Added for Wi-Fi and MQTT
 #include "esp_wifi.h"
@@ -59,14 +67,36 @@
 // Watchdog timer includes
 #include "esp_task_wdt.h"
 
+// Monotonic microsecond timer used to timestamp samples
+#include "esp_timer.h"
+// Jitter for the Wi-Fi reconnect backoff
+#include "esp_random.h"
+
+// Power management (DFS and automatic light sleep when CONFIG_PM_ENABLE is set)
+#include "esp_pm.h"
+#include "esp_sleep.h"
+// CRC32 in ROM (RTC snapshot validation)
+#include "esp_rom_crc.h"
+// Heap statistics and the on-die temperature sensor (chips other than the original ESP32)
+#include "esp_heap_caps.h"
+#include "soc/soc_caps.h"
+#if SOC_TEMP_SENSOR_SUPPORTED
+#include "driver/temperature_sensor.h"
+#endif
+#include <math.h>
+#include <stddef.h>
+
 // System monitoring includes
 #include "esp_netif.h"
+#include "esp_sntp.h"
+#include <sys/time.h>
 
 // Software watchdog variables
 static uint32_t watchdog_timeout_ms = 0;  // Watchdog timeout (10× sample interval)
 static TickType_t last_successful_publish = 0;  // Last successful MQTT publish time
 static bool watchdog_enabled = false;  // Whether watchdog is enabled
 static bool mqtt_publish_success = false;  // Flag for successful MQTT publish
+static bool publish_unconfirmed = false;  // A publish was queued after the last confirmed one
 
 // Debug logging flag - set to false to reduce log output (except watchdog logs)
 static bool debug_logging = false;
@@ -74,24 +104,64 @@ static bool debug_logging = false;
 #define WIFI_NVS_NAMESPACE "wifi_cfg"
 #define WIFI_NVS_KEY_SSID "ssid"
 #define WIFI_NVS_KEY_PASS "pass"
+#define WIFI_NVS_KEY_SSID2 "ssid2"
+#define WIFI_NVS_KEY_PASS2 "pass2"
+#define WIFI_NVS_KEY_HINT "ap_hint"      // BSSID and channel of the last association
 #define MQTT_NVS_KEY_URL "broker_url"
 #define NVS_KEY_SAMPLE_INTERVAL "sample_interval"
 #define NVS_KEY_BMS_TOPIC "BMS_Topic"
 #define NVS_KEY_WATCHDOG_COUNTER "watchdog_cnt"
 #define NVS_KEY_PACK_NAME "pack_name"
+#define NVS_KEY_ENERGY "energy_acc"
+#define NVS_KEY_LATENCY_FMT "lat_%08lX"   // Per-terminal learned response latency
+#define NVS_KEY_LATENCY_TERMINAL "lat_term" // Terminal number seen last, to pick the key at boot
+#define NVS_KEY_BMS_BAUD "bms_baud"
+#define NVS_KEY_FULL_READ_MIN "full_read_min"
+#define NVS_KEY_MQTT_CMD "mqtt_cmd_en"
+#define NVS_KEY_MQTT_OUTBOX "mqtt_outbox_kb"
+#define NVS_KEY_BATCH_SIZE "batch_size"
+#define NVS_KEY_BATCH_MS "batch_ms"
+#define NVS_KEY_BATCH_ZIP "batch_zip"
+#define NVS_KEY_NTP_SERVER "ntp_server"
+#define NVS_KEY_POWER_SAVE "power_save"
+#define NVS_KEY_DOUBLE_RESET "dbl_reset"
 #define DEFAULT_WIFI_SSID "yourSSID"
 #define DEFAULT_WIFI_PASS "yourpassword"
 #define DEFAULT_MQTT_BROKER_URL "mqtt://192.168.1.100"
 #define DEFAULT_SAMPLE_INTERVAL 5000L
 #define DEFAULT_PACK_NAME "Set in Parameters"
+#define DEFAULT_BMS_BAUD 115200UL
+#define DEFAULT_FULL_READ_MIN 10
+#define DEFAULT_MQTT_OUTBOX_KB 32
+#define MQTT_OUTBOX_KB_MIN 16           // Two in-flight telemetry documents of MQTT_PUB_BUF_SIZE
+#define MQTT_OUTBOX_KB_MAX 96           // Leaves heap for Wi-Fi and TLS; esp-mqtt treats 0 as unlimited
+#define DEFAULT_BATCH_SIZE 10
+#define DEFAULT_BATCH_MS 60000
+#define BATCH_MAX_SAMPLES 50
+#define DEFAULT_NTP_SERVER "pool.ntp.org"
 
 static char wifi_ssid[33] = DEFAULT_WIFI_SSID;
 static char wifi_pass[65] = DEFAULT_WIFI_PASS;
+static char wifi_ssid2[33] = "";  // Fallback network, empty = none
+static char wifi_pass2[65] = "";
 static char mqtt_broker_url[128] = DEFAULT_MQTT_BROKER_URL;
 char bms_topic[41] = "BMS/JKBMS";  // Remove static to make it globally accessible
 static long sample_interval_ms = DEFAULT_SAMPLE_INTERVAL;
 static uint32_t watchdog_reset_counter = 0;  // Watchdog timer reset counter
 static char pack_name[64] = DEFAULT_PACK_NAME;  // Pack name field
+static uint32_t bms_baud_config = DEFAULT_BMS_BAUD; // Configured BMS UART baud rate, 0 = auto-probe at boot
+static uint32_t bms_baud_active = DEFAULT_BMS_BAUD; // Rate the UART is actually running at
+static bool bms_baud_probing = false;  // Exchanges at candidate rates must not teach latency or echo
+static uint32_t full_read_interval_min = DEFAULT_FULL_READ_MIN; // Minutes between read-all polls, 0 = read-all every cycle
+static bool mqtt_cmd_enabled = false;  // Accept MOS switch commands on <bms_topic>/cmd (off unless enabled in parameters)
+static QueueHandle_t bms_cmd_queue = NULL; // MQTT commands waiting for the bus, created when commands are enabled
+static uint32_t mqtt_outbox_kb = DEFAULT_MQTT_OUTBOX_KB; // esp-mqtt outbox limit (MQTT_OUTBOX_KB_MIN - MQTT_OUTBOX_KB_MAX)
+static uint32_t batch_size = DEFAULT_BATCH_SIZE; // Samples per message on the batch stream (1 - BATCH_MAX_SAMPLES)
+static uint32_t batch_max_age_ms = DEFAULT_BATCH_MS; // A batch goes out once its oldest sample is this old, 0 = only when full
+static bool batch_compress = false; // Heatshrink-compress batch messages and publish them on <batch topic>/hs
+static char ntp_server[64] = DEFAULT_NTP_SERVER; // SNTP server for sample timestamps, empty = no time sync
+static bool power_save_enabled = false; // DFS, automatic light sleep and modem sleep between samples
+static volatile bool mqtt_connected = false;  // Between MQTT_EVENT_CONNECTED and MQTT_EVENT_DISCONNECTED
 
 // Define the UART peripheral number to be used (UART2 in this case)
 #define UART_NUM UART_NUM_2
@@ -106,9 +176,6 @@ static char pack_name[64] = DEFAULT_PACK_NAME;  // Pack name field
 // Tag used for logging messages from this module
 static const char *TAG = "BMS_READER";
 
-// Wi-Fi Configuration
-#define EXAMPLE_ESP_MAXIMUM_RETRY  5
-
 // MQTT Configuration
 #define MQTT_BROKER_URL "mqtt://192.168.1.5"
 #define MQTT_TOPIC_PACK "NodeJKBMS2/pack"
@@ -116,7 +183,10 @@ static const char *TAG = "BMS_READER";
 
 // Global variable for MQTT client
 static esp_mqtt_client_handle_t mqtt_client;
-static int wifi_retry_num = 0;
+static bool wifi_has_ip = false;
+
+// Cells more than this many mV above the lowest cell are counted as candidates for balancing
+#define CELL_BALANCE_THRESHOLD_MV 10
 
 // Placeholder structures for BMS data
 // This will be populated with more fields later
@@ -125,11 +195,20 @@ typedef struct {
     float pack_current;
     uint8_t soc_percent;
     // Cell voltages will be handled separately or in an array here
-    float cell_voltages[24]; // Assuming max 24 cells for now
+    float cell_voltages[BMS_MAX_CELLS];
+    uint16_t cell_mv[BMS_MAX_CELLS]; // Packed raw cell voltages (mV) fed to compute_cell_stats()
     int num_cells;
     float min_cell_voltage;
     float max_cell_voltage;
     float cell_voltage_delta;
+    // Extended cell statistics (see compute_cell_stats())
+    uint8_t min_cell_idx;              // 0-based index of the lowest cell
+    uint8_t max_cell_idx;              // 0-based index of the highest cell
+    float cell_mean_mv;
+    float cell_stddev_mv;
+    uint16_t cell_median_mv;
+    uint16_t cell_delta_mv;
+    uint8_t cells_above_balance_threshold;
     float mosfet_temp;
     float probe1_temp;
     float probe2_temp;
@@ -142,6 +221,11 @@ typedef struct {
     uint8_t num_temp_sensors;
     uint8_t battery_type;
     uint8_t low_capacity_alarm;
+    uint16_t cycle_count;              // 0x87
+    uint16_t warning_flags;            // 0x8B, see bms_warning_flags[]
+    uint16_t status_flags;             // 0x8C, see bms_status_flags[]
+    bool flags_valid;                  // Both 0x8B and 0x8C were present in this frame
+    int64_t sample_time_us;            // esp_timer_get_time() when the response frame was read
     // Add other fields from your target JSON here as they are parsed
     // e.g., uint16_t pack_rate_cap;
     // ...
@@ -150,6 +234,49 @@ typedef struct {
 // Global instance of BMS data
 static bms_data_t current_bms_data;
 
+// --- Coulomb counting / energy accumulator ---
+// Current and power are integrated on-device at the acquisition rate using the monotonic
+// sample timestamps, so downstream consumers get cumulative counters instead of having to
+// integrate packA x packV themselves. Positive pack current is treated as charging.
+//
+// Persisting to NVS is coalesced: the counters are written every ENERGY_SAVE_INTERVAL_MS, or
+// sooner once ENERGY_SAVE_DELTA_AH of throughput has accumulated since the last write, but never
+// more often than ENERGY_SAVE_MIN_INTERVAL_MS so high currents cannot drive up flash wear.
+// A reboot therefore loses at most the unsaved portion, which is published as
+// unsavedAh/unsavedWh so the cost of a reset is visible rather than silent.
+#define ENERGY_SAVE_INTERVAL_MS (10 * 60 * 1000)
+#define ENERGY_SAVE_DELTA_AH 1.0
+#define ENERGY_SAVE_MIN_INTERVAL_MS (60 * 1000)
+// Samples further apart than this many sample intervals are not integrated (missed polls, boot)
+#define ENERGY_MAX_GAP_INTERVALS 3
+#define ENERGY_NVS_VERSION 1
+
+// Layout stored in NVS under NVS_KEY_ENERGY
+typedef struct {
+    uint32_t version;
+    uint32_t restore_count;     // Number of boots that resumed from these counters
+    double charge_ah;
+    double discharge_ah;
+    double charge_wh;
+    double discharge_wh;
+    double gap_seconds;         // Time not integrated because samples were missing
+} energy_nvs_t;
+
+typedef struct {
+    energy_nvs_t totals;
+    bool loaded;                // Counters were initialised from NVS (safe to write back)
+    bool have_last;
+    int64_t last_sample_us;
+    float last_current_a;
+    float last_power_w;
+    double saved_throughput_ah; // charge_ah + discharge_ah at the last NVS write
+    double saved_throughput_wh;
+    int64_t last_save_us;
+    uint32_t nvs_writes;        // NVS writes since boot
+} energy_acc_t;
+
+static energy_acc_t energy_acc;
+
 
 // --- Data Identification Code Table (auto-generated from CSV) ---
 typedef struct {
@@ -161,9 +288,29 @@ typedef struct {
 } bms_idcode_t;
 
 static const bms_idcode_t bms_idcodes[] = {
+    {0x86, "Number of battery temperature sensors", 1, "HEX", "2 sensors"},
+    {0x87, "Battery cycle count", 2, "HEX", "Times"},
+    {0x89, "Total battery cycle capacity", 4, "HEX", "AH"},
+    {0x8a, "Total number of battery strings", 2, "HEX", "Strings"},
+    {0x8b, "Battery warning message", 2, "HEX", "Bitfield, see bms_warning_flags[]"},
+    {0x8c, "Battery status information", 2, "HEX", "Bitfield, see bms_status_flags[]"},
+    {0x8e, "Total voltage overvoltage protection", 2, "HEX", "0.01 V"},
+    {0x8f, "Total voltage undervoltage protection", 2, "HEX", "0.01 V"},
+    {0x90, "Single overvoltage protection voltage", 2, "HEX", "MV"},
+    {0x91, "Cell overvoltage recovery voltage", 2, "HEX", "MV"},
+    {0x92, "Single overvoltage protection delay", 2, "HEX", "Seconds"},
+    {0x93, "Single undervoltage protection voltage", 2, "HEX", "MV"},
+    {0x94, "Cell undervoltage recovery voltage", 2, "HEX", "MV"},
+    {0x95, "Single undervoltage protection delay", 2, "HEX", "Seconds"},
+    {0x96, "Cell pressure difference protection value", 2, "HEX", "MV"},
+    {0x97, "Discharge overcurrent protection value", 2, "HEX", "A"},
+    {0x98, "Discharge overcurrent delay", 2, "HEX", "Seconds"},
     {0x99, "Equalizing opening differential", 2, "HEX", "10 - 1000 MV"},
-    {0x9a, "Active equalization switch", 1, "HEX", "0 off or 1 on"},
+    {0x9a, "Active equalization switch", 2, "HEX", "0 off or 1 on"},
     {0x9b, "Power tube temperature protection value", 2, "HEX", "0 - 100 °C"},
+    {0x9c, "Balance parameter 0x9C", 2, "HEX", "Length taken from captured frames"},
+    {0x9d, "Active balance switch", 1, "HEX", "0 off or 1 on"},
+    {0x9e, "Temperature parameter 0x9E", 2, "HEX", "Length taken from captured frames"},
     {0x9f, "Temperature protection value in battery box", 2, "HEX", "0 - 100 °C"},
     {0xa0, "Recovery value 2 of battery in box", 2, "HEX", "40 - 100 °C"},
     {0xa1, "Battery temperature difference", 2, "HEX", "40 -- 100 °C"},
@@ -192,9 +339,69 @@ static const bms_idcode_t bms_idcodes[] = {
     {0xb8, "Start Current Calibration", 1, "HEX", "1: Start Calibration 0: Turn off calibration"},
     {0xb9, "Actual battery capacity", 4, "HEX", "Code AH"},
     {0xba, "Naming of factory ID", 24, "Column", "BT 3072020120000200521001 ..."},
+    {0xbb, "Restart system", 1, "HEX", "1: restart"},
+    {0xbc, "Restore factory settings", 1, "HEX", "1: reset"},
+    {0xbd, "Remote upgrade identification", 1, "HEX", "1: upgrade"},
+    {0xbe, "Battery low voltage turn off GPS", 2, "HEX", "0.01 V"},
+    {0xbf, "Battery low voltage turn on GPS", 2, "HEX", "0.01 V"},
+    {0xc0, "Protocol version number", 1, "HEX", "0 - 255"},
 };
 #define BMS_IDCODES_COUNT (sizeof(bms_idcodes)/sizeof(bms_idcodes[0]))
 
+// ID -> bms_idcodes[] index (BMS_ID_UNKNOWN if the ID is not defined). Built once from the
+// table above so the decoder does one array load per field instead of a table scan.
+#define BMS_ID_UNKNOWN 0xFF
+static uint8_t bms_id_index[256];
+static bool bms_id_index_ready = false;
+
+static void bms_id_index_init(void) {
+    memset(bms_id_index, BMS_ID_UNKNOWN, sizeof(bms_id_index));
+    for (size_t i = 0; i < BMS_IDCODES_COUNT; ++i) {
+        bms_id_index[bms_idcodes[i].id] = (uint8_t)i;
+    }
+    bms_id_index_ready = true;
+}
+
+static const bms_idcode_t *bms_idcode_lookup(uint8_t id) {
+    if (!bms_id_index_ready) {
+        bms_id_index_init();
+    }
+    uint8_t idx = bms_id_index[id];
+    return idx == BMS_ID_UNKNOWN ? NULL : &bms_idcodes[idx];
+}
+
+// --- Named bits of the warning (0x8B) and status (0x8C) words ---
+typedef struct {
+    uint8_t bit;
+    const char *name;
+} bms_flag_def_t;
+
+static const bms_flag_def_t bms_warning_flags[] = {
+    {0,  "lowCapacity"},
+    {1,  "mosfetOverTemp"},
+    {2,  "chargeOverVoltage"},
+    {3,  "dischargeUnderVoltage"},
+    {4,  "batteryOverTemp"},
+    {5,  "chargeOverCurrent"},
+    {6,  "dischargeOverCurrent"},
+    {7,  "cellVoltageDifference"},
+    {8,  "boxOverTemp"},
+    {9,  "batteryLowTemp"},
+    {10, "cellOverVoltage"},
+    {11, "cellUnderVoltage"},
+    {12, "protection309A"},
+    {13, "protection309B"},
+};
+
+static const bms_flag_def_t bms_status_flags[] = {
+    {0, "chargeMosfetOn"},
+    {1, "dischargeMosfetOn"},
+    {2, "balancerOn"},
+    {3, "batteryDisconnected"},
+};
+#define BMS_WARNING_FLAGS_COUNT (sizeof(bms_warning_flags)/sizeof(bms_warning_flags[0]))
+#define BMS_STATUS_FLAGS_COUNT (sizeof(bms_status_flags)/sizeof(bms_status_flags[0]))
+
 // --- Store decoded extra fields for MQTT output ---
 typedef struct {
     uint8_t id;
@@ -202,16 +409,198 @@ typedef struct {
     char strval[48]; // For ASCII fields
     int is_ascii;
 } bms_extra_field_t;
-#define MAX_EXTRA_FIELDS 32
+#define MAX_EXTRA_FIELDS 64 // A full read-all frame carries ~55 fields after 0x85
 static bms_extra_field_t extra_fields[MAX_EXTRA_FIELDS];
 static int extra_fields_count = 0;
 
+// --- Decode quality ---
+// Why the extra-field walk of a frame stopped. Anything other than DECODE_OK flags the frame.
+typedef enum {
+    DECODE_OK = 0,          // Walked to the end of the payload
+    DECODE_UNKNOWN_ID,      // Hit an ID with no known length; the rest of the frame is untrusted
+    DECODE_TRUNCATED,       // Field length runs past the end of the payload
+    DECODE_FIELD_OVERFLOW,  // More fields than MAX_EXTRA_FIELDS
+} decode_status_t;
+
+static const char *decode_status_names[] = { "ok", "unknownId", "truncated", "fieldOverflow" };
+
+typedef struct {
+    // Last frame
+    decode_status_t status;
+    uint16_t fields;
+    uint16_t duplicates;
+    uint16_t bytes_decoded;     // Extra-field bytes consumed before the walk stopped
+    uint16_t payload_bytes;     // Extra-field bytes available
+    uint8_t stop_id;
+    uint16_t stop_offset;
+    // Since boot
+    uint32_t frames;
+    uint32_t frames_clean;
+    uint32_t frames_flagged[4]; // Indexed by decode_status_t
+} decode_quality_t;
+
+static decode_quality_t decode_quality;
+
+// --- Corrupt frame policy ---
+// A response with a bad checksum (or a malformed frame) is never published. Instead the
+// command is re-sent immediately, up to BMS_CORRUPT_RETRY_BUDGET times, so the sample slot is
+// still filled without waiting a whole sample_interval_ms.
+#define BMS_CORRUPT_RETRY_BUDGET 2
+#define BMS_RETRY_GAP_MS 50
+
+typedef struct {
+    uint32_t frames;            // Exchanges attempted, including retries
+    uint32_t crc_errors;
+    uint32_t malformed;
+    uint32_t retries;
+    uint32_t recovered;         // Slots filled by a retry
+    uint32_t slots_lost;        // Slots still corrupt after the retry budget
+    uint32_t last_retry_ms;
+    uint32_t max_retry_ms;
+    uint64_t retry_ms_total;
+} bms_link_stats_t;
+
+static bms_link_stats_t bms_link;
+static int64_t bms_last_sample_us = 0;  // esp_timer time of the last poll cycle that produced a sample
+
+// --- Adaptive response deadline ---
+// Instead of a fixed wait, the response is read as it streams in and the reader returns as
+// soon as the declared frame length has arrived. Command-to-first-byte and command-to-complete
+// times are tracked per BMS terminal (EWMA plus a ring of recent completion times for a P95),
+// and the read deadline is the P95 plus a margin. A timeout doubles the deadline for the next
+// exchange so a slower BMS is learned instead of timing out forever.
+#define BMS_DEADLINE_DEFAULT_MS 300     // Used until enough samples have been observed
+#define BMS_DEADLINE_MIN_MS 50
+#define BMS_DEADLINE_MAX_MS 1500
+#define BMS_DEADLINE_MARGIN_MS 30       // Minimum headroom over the P95
+#define BMS_READ_SLICE_MS 10            // Granularity of the streaming read (one tick at 100 Hz)
+#define LATENCY_RING_SIZE 32
+#define LATENCY_MIN_SAMPLES 8
+#define LATENCY_SAVE_EVERY 100          // Persist after this many new samples
+#define LATENCY_NVS_VERSION 1
+
+// Layout stored in NVS under NVS_KEY_LATENCY_FMT
+typedef struct {
+    uint8_t version;
+    uint8_t count;                      // Valid entries in ring_ms (saturates at LATENCY_RING_SIZE)
+    uint8_t head;
+    uint8_t reserved;
+    float ewma_first_ms;
+    float ewma_complete_ms;
+    uint16_t ring_ms[LATENCY_RING_SIZE];
+} bms_latency_nvs_t;
+
+typedef struct {
+    bms_latency_nvs_t est;
+    uint32_t terminal;
+    bool terminal_known;
+    uint32_t deadline_ms;
+    uint32_t p95_ms;
+    uint32_t last_first_ms;
+    uint32_t last_complete_ms;
+    uint32_t timeouts;
+    uint32_t samples_since_save;
+} bms_latency_t;
+
+static bms_latency_t bms_latency = { .deadline_ms = BMS_DEADLINE_DEFAULT_MS };
+static int64_t bms_last_cmd_us = 0;    // esp_timer_get_time() right after the last command write
+
+// --- Inline echo cancellation ---
+// Transceivers that do not disable their receiver while transmitting hand our own command
+// back on RX. The reader compares complete frames against the bytes last written and skips a
+// match wherever it appears, so no separate echo read is needed. Whether the transceiver
+// echoes is learned over the first exchanges and re-learned if the behaviour changes.
+#define BMS_TX_MAX 64
+#define BMS_ECHO_PROBE_EXCHANGES 3      // Consistent exchanges needed to decide present/absent
+
+typedef enum { ECHO_UNKNOWN = 0, ECHO_PRESENT, ECHO_ABSENT } bms_echo_state_t;
+static const char *bms_echo_state_names[] = { "unknown", "present", "absent" };
+
+static uint8_t bms_last_tx[BMS_TX_MAX];
+static size_t bms_last_tx_len = 0;
+
+static struct {
+    bms_echo_state_t state;
+    uint8_t streak;                     // Consecutive exchanges agreeing with the current guess
+    bool last_seen;                     // Echo seen on the previous exchange
+    uint32_t skipped;                   // Echo frames skipped since boot
+    uint32_t unexpected;                // Exchanges contradicting a decided state
+} bms_echo;
+
+// --- Wire-time budget ---
+// Bytes on the wire for one poll cycle (all exchanges, retries included) converted to time at
+// the active baud rate, against the wall time of the whole cycle including decode and publish.
+// wire/cycle close to 1 means the bus is the bottleneck; close to 0 means CPU/network.
+#define UART_BITS_PER_BYTE 10           // 8N1: start + 8 data + stop
+// Candidate rates for auto-probe, fastest first
+static const uint32_t bms_baud_candidates[] = { 230400, 115200, 57600, 38400, 19200, 9600 };
+#define BMS_BAUD_CANDIDATES_COUNT (sizeof(bms_baud_candidates)/sizeof(bms_baud_candidates[0]))
+
+// A configured rate is either 0 (auto-probe) or one of the candidates; anything else would be
+// handed to the UART driver as is
+static bool bms_baud_valid(uint32_t baud) {
+    if (baud == 0) {
+        return true;
+    }
+    for (size_t i = 0; i < BMS_BAUD_CANDIDATES_COUNT; ++i) {
+        if (bms_baud_candidates[i] == baud) {
+            return true;
+        }
+    }
+    return false;
+}
+#define BMS_BAUD_PROBE_DEADLINE_MS 500
+
+static struct {
+    uint32_t cycle_tx_bytes;            // Accumulated over the current cycle
+    uint32_t cycle_rx_bytes;
+    uint32_t last_tx_bytes;             // Last completed cycle
+    uint32_t last_rx_bytes;
+    uint32_t last_wire_us;
+    uint32_t last_cycle_us;
+    uint32_t last_exchange_us;          // Command write to frame complete (last exchange)
+    uint32_t cycle_bus_us;              // Sum of exchange times over the current cycle
+    bool probed;                        // bms_baud_active came from auto-probe
+} bms_wire;
+
+static inline uint32_t uart_wire_time_us(uint32_t bytes, uint32_t baud) {
+    return baud ? (uint32_t)((uint64_t)bytes * UART_BITS_PER_BYTE * 1000000ULL / baud) : 0;
+}
+
 // Forward declarations for functions defined later in this file
 
 // Forward declarations for NVS functions
 static void load_watchdog_counter_from_nvs(void);
 static void save_watchdog_counter_to_nvs(void);
 static void load_pack_name_from_nvs(void);
+static void load_energy_counters_from_nvs(void);
+static void save_energy_counters_to_nvs(void);
+static void energy_accumulate(const bms_data_t *sample);
+static void anomaly_evaluate(const bms_data_t *sample);
+void load_latency_terminal_from_nvs(void);
+void save_latency_to_nvs(void);
+static void latency_update_deadline(void);
+static void latency_record(uint32_t terminal, uint32_t first_ms, uint32_t complete_ms);
+static void latency_timeout(void);
+void load_bms_baud_from_nvs(void);
+static void bms_baud_autoprobe(void);
+void load_full_read_interval_from_nvs(void);
+void load_mqtt_cmd_from_nvs(void);
+void load_mqtt_outbox_from_nvs(void);
+void load_batch_from_nvs(void);
+void load_ntp_server_from_nvs(void);
+void load_power_save_from_nvs(void);
+static void power_init(void);
+static void time_sync_start(void);
+static int64_t time_utc_ms(int64_t mono_us);
+void load_output_streams_from_nvs(void);
+static void bms_cmd_submit(const char *data, int data_len);
+static void bms_idle_wait(uint32_t wait_ms);
+static bool find_extra_field(uint8_t id, uint32_t *value);
+static void bms_flags_track(const bms_data_t *sample);
+static void rtc_snapshot_save(void);
+static void rtc_snapshot_restore(void);
+static void resources_tick(void);
 
 // Forward declaration for DNS hijack task
 void dns_hijack_task(void *pvParameter);
@@ -231,10 +620,24 @@ static esp_err_t ota_filesystem_handler(httpd_req_t *req);
 void init_uart();
 // Sends a command to the BMS via UART.
 void send_bms_command(const uint8_t* cmd, size_t len);
+// Outcome of one command/response exchange with the BMS
+typedef enum {
+    BMS_FRAME_OK = 0,       // Checksum OK and cell data decoded
+    BMS_FRAME_NO_DATA,      // Nothing received before the deadline
+    BMS_FRAME_MALFORMED,    // Bad start bytes, short or incomplete frame
+    BMS_FRAME_CRC_ERROR,    // Complete frame with a bad checksum
+    BMS_FRAME_NO_CELLS,     // Valid frame without usable cell data
+} bms_frame_status_t;
+
 // Reads data from the BMS via UART. This function is static, meaning it's only visible within this file.
-static void read_bms_data(); 
+// request is 0 for read-all, an ID for a single-ID read, or BMS_REQUEST_WRITE_ACK after a write.
+static bms_frame_status_t read_bms_data(uint16_t request); 
+// Runs one command/response exchange; the only way onto the RS485 bus.
+static bms_frame_status_t bms_transact(bms_prio_t prio, const uint8_t *frame, size_t frame_len, uint16_t request);
 // Parses the raw data received from the BMS and prints it in a human-readable format.
-void parse_and_print_bms_data(const uint8_t *data, int len);
+bms_frame_status_t parse_and_print_bms_data(const uint8_t *data, int len);
+// Parses the response to a single-ID read (command 0x03) and merges it into the last sample.
+static bms_frame_status_t parse_single_id_response(const uint8_t *data, int len, uint8_t id);
 
 // New forward declarations for Wi-Fi and MQTT
 static void wifi_event_handler(void* arg, esp_event_base_t event_base,
@@ -242,8 +645,11 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
 static void mqtt_event_handler(void* arg, esp_event_base_t event_base,
                                int32_t event_id, void* event_data);
 void wifi_init_sta(void);
+static void mqtt_app_init(void);
 static void mqtt_app_start(void);
 void publish_bms_data_mqtt(const bms_data_t *bms_data_ptr); // Combined publish function for now
+static void publish_fanout_mqtt(const bms_data_t *d); // Optional one-scalar-per-topic output
+static void publish_batch_mqtt(const bms_data_t *d); // Optional several-samples-per-message output
 
 // Forward declaration for DNS hijack task
 void dns_hijack_task(void *pvParameter);
@@ -289,7 +695,7 @@ uint8_t unpack_u8(const uint8_t *buffer, int offset) {
 void init_uart() {
     // UART configuration structure
     uart_config_t uart_config = {
-        .baud_rate = 115200,                // Baud rate for serial communication
+        .baud_rate = bms_baud_active,       // Baud rate for serial communication (see load_bms_baud_from_nvs())
         .data_bits = UART_DATA_8_BITS,      // 8 data bits per frame
         .parity    = UART_PARITY_DISABLE,   // No parity bit
         .stop_bits = UART_STOP_BITS_1,      // 1 stop bit
@@ -321,13 +727,121 @@ void send_bms_command(const uint8_t* cmd, size_t len) {
     // Write data to UART.
     // (const char*)cmd: Cast command buffer to char pointer as expected by the function.
     int txBytes = uart_write_bytes(UART_NUM, (const char*)cmd, len);
+    bms_last_cmd_us = esp_timer_get_time();
+    // Remember what went out so the reader can recognise it if the transceiver echoes it
+    bms_last_tx_len = len <= BMS_TX_MAX ? len : 0;
+    bms_wire.cycle_tx_bytes += txBytes > 0 ? txBytes : 0;
+    if (bms_last_tx_len) {
+        memcpy(bms_last_tx, cmd, bms_last_tx_len);
+    }
     ESP_LOGI(TAG, "Wrote %d bytes", txBytes); // Log the number of bytes written.
 }
 
-// Parses the raw data received from the BMS and prints it.
-// data: Pointer to the buffer containing the raw data from BMS.
-// len: Length of the data in bytes.
-void parse_and_print_bms_data(const uint8_t *data, int len) {
+// Temperature conversion: If raw > 100, it's negative: -(raw - 100). Otherwise, it's raw. (As per Python example)
+static float bms_temp_from_raw(uint16_t raw) {
+    return (raw > 100) ? -(float)(raw - 100) : (float)raw;
+}
+
+// Which current encoding the BMS uses. The read-all parser infers it from the frame length (see
+// data_bms_full.py); single-ID responses are too short to tell, so they reuse the last inference.
+static bool bms_current_offset_encoding = false;
+
+// Converts raw 0x84 current to amps (0.01 A units)
+static float bms_current_from_raw(uint16_t current_raw, bool offset_encoding) {
+    if (!offset_encoding) {
+        // Method 2 (frame_len_field < 260): MSB indicates sign.
+        // Python: if (value & 0x8000) == 0x8000 : current = (value & 0x7FFF)/100
+        //         else : current = ((value & 0x7FFF)/100) * -1
+        // This means if MSB is set, it's positive current (value & 0x7FFF).
+        // If MSB is clear, it's negative current -(value & 0x7FFF).
+        // Note: This is different from standard two's complement.
+        if ((current_raw & 0x8000) == 0x8000) {
+            return (float)(current_raw & 0x7FFF) / 100.0f;
+        }
+        return -((float)(current_raw & 0x7FFF) / 100.0f);
+    }
+    // Method 1 (frame_len_field >= 260): (10000 - raw_value) * 0.01. This implies 10000 is zero current.
+    // e.g. raw=10000 -> 0A. raw=9900 -> 1A. raw=10100 -> -1A.
+    return (float)(10000 - (int32_t)current_raw) * 0.01f;
+}
+
+// Decodes a 0x79 cell voltage block at the start of payload into current_bms_data, including
+// the cell statistics. Returns the bytes consumed (ID + ByteCount + data) or -1 if truncated.
+static int decode_cell_block(const uint8_t *payload, int payload_len) {
+    if (payload_len < 2) { // Need at least ID (already checked) and ByteCount.
+        ESP_LOGW(TAG, "Payload too short for cell voltage byte count (needs at least 2 bytes).");
+        return -1;
+    }
+    uint8_t cell_voltage_bytecount = payload[1]; // Number of bytes used for all cell voltage data.
+    int num_cells = cell_voltage_bytecount / 3;  // Each cell's data is 3 bytes long.
+    ESP_LOGI(TAG, "Cell voltage data byte count from payload: %d, Calculated number of cells: %d", cell_voltage_bytecount, num_cells);
+
+    // Check if payload is long enough for all declared cell voltages.
+    // Expected length = 2 (ID + ByteCount) + cell_voltage_bytecount.
+    if (payload_len < (2 + cell_voltage_bytecount)) {
+        ESP_LOGW(TAG, "Payload too short for all cell voltages. Expected %d bytes for cell data part, got %d bytes in payload.", 
+                 (2 + cell_voltage_bytecount), payload_len);
+        // We might still try to parse what's available if num_cells > 0 and data seems partially there.
+        // For now, return if data is clearly insufficient.
+        return -1;
+    }
+
+    if (debug_logging) printf("Cell Voltages (V):\n");
+    if (num_cells > BMS_MAX_CELLS) {
+        ESP_LOGW(TAG, "BMS reports %d cells, only the first %d are kept.", num_cells, BMS_MAX_CELLS);
+    }
+
+    int cells_read = 0;
+    for (int i = 0; i < num_cells; i++) {
+        // Offset for current cell's data within payload: 2 (ID+ByteCount) + i * 3 (3 bytes per cell).
+        // Voltage is in bytes 2 and 3 of these 3 bytes (i.e., skip the first byte of the 3-byte group).
+        // So, offset for mV value is payload_start + 2 + i*3 + 1.
+        int cell_data_start_offset = 2 + i * 3;
+        if ( (cell_data_start_offset + 2) < payload_len) { // Check bounds: need 3 bytes for cell i, last is at offset+2
+             uint16_t voltage_mv = unpack_u16_be(payload, cell_data_start_offset + 1); 
+             if (debug_logging) printf("  Cell %2d: %.3f V\n", i + 1, voltage_mv / 1000.0f);
+             // Store individual cell voltage
+             if (i < BMS_MAX_CELLS) { // Ensure we don't write out of bounds of our array
+                 current_bms_data.cell_mv[i] = voltage_mv;
+                 current_bms_data.cell_voltages[i] = voltage_mv / 1000.0f; // Convert mV to V.
+                 cells_read = i + 1;
+             }
+        } else {
+            ESP_LOGW(TAG, "Not enough data in payload for cell %d voltage. Stopping cell voltage parsing.", i + 1);
+            break; // Stop if data runs out.
+        }
+    }
+    // Derive min/max/delta and the extended statistics in one pass over the mV array.
+    if (cells_read > 0) {
+        cell_stats_t stats;
+        compute_cell_stats(current_bms_data.cell_mv, cells_read, CELL_BALANCE_THRESHOLD_MV, &stats);
+        if (debug_logging) {
+            printf("Min Cell Voltage: %.3f V (cell %d)\n", stats.min_mv / 1000.0f, stats.min_idx + 1);
+            printf("Max Cell Voltage: %.3f V (cell %d)\n", stats.max_mv / 1000.0f, stats.max_idx + 1);
+            printf("Cell Voltage Delta: %.3f V\n", stats.delta_mv / 1000.0f);
+            printf("Cell Mean/Median/StdDev: %.1f / %u / %.2f mV, %u above balance threshold\n",
+                   stats.mean_mv, stats.median_mv, stats.stddev_mv, stats.above_threshold);
+        }
+        // Store in global struct
+        current_bms_data.num_cells = cells_read;
+        current_bms_data.min_cell_voltage = stats.min_mv / 1000.0f;
+        current_bms_data.max_cell_voltage = stats.max_mv / 1000.0f;
+        current_bms_data.cell_voltage_delta = stats.delta_mv / 1000.0f;
+        current_bms_data.min_cell_idx = stats.min_idx;
+        current_bms_data.max_cell_idx = stats.max_idx;
+        current_bms_data.cell_mean_mv = stats.mean_mv;
+        current_bms_data.cell_stddev_mv = stats.stddev_mv;
+        current_bms_data.cell_median_mv = stats.median_mv;
+        current_bms_data.cell_delta_mv = stats.delta_mv;
+        current_bms_data.cells_above_balance_threshold = stats.above_threshold;
+    }
+    return 2 + cell_voltage_bytecount;
+}
+
+// Checks framing and checksum of a response and locates its payload. Shared by the read-all
+// and single-ID parsers. Returns BMS_FRAME_OK with payload/payload_len/frame_len_field set.
+static bms_frame_status_t bms_frame_payload(const uint8_t *data, int len, const uint8_t **payload_out,
+                                            int *payload_len_out, uint16_t *frame_len_field_out) {
     // Detailed frame format based on JK BMS RS485 Protocol documentation and Python examples:
     // Offset | Length | Description
     // -------|--------|----------------------------------------------------
@@ -354,19 +868,20 @@ void parse_and_print_bms_data(const uint8_t *data, int len) {
     // If frame_len_field is minimal (e.g. for header + trailer only, no payload), it would be 4+1+1+1+4+1+4 = 15.
     if (len < 15) { 
         ESP_LOGW(TAG, "Frame too short for basic structure: %d bytes", len);
-        return;
+        return BMS_FRAME_MALFORMED;
     }
 
     // 1. Check Start Frame (must be 0x4E, 0x57)
     if (data[0] != 0x4E || data[1] != 0x57) {
         ESP_LOGW(TAG, "Invalid start frame: %02X %02X", data[0], data[1]);
-        return;
+        return BMS_FRAME_MALFORMED;
     }
     ESP_LOGI(TAG, "Start frame OK");
 
     // 2. Get Length field from the frame.
     // This length is from the length field itself to the end of the checksum.
     uint16_t frame_len_field = unpack_u16_be(data, 2); 
+    *frame_len_field_out = frame_len_field;
     ESP_LOGI(TAG, "Frame length field value: %d", frame_len_field);
 
     // Validate if the received data length (`len`) is sufficient for the declared frame length.
@@ -374,7 +889,7 @@ void parse_and_print_bms_data(const uint8_t *data, int len) {
     if (len < (frame_len_field + 2)) { 
         ESP_LOGW(TAG, "Incomplete frame. Expected header(2) + frame_len_field(%d) = %d bytes, but got %d bytes in total.", 
                  frame_len_field, frame_len_field + 2, len);
-        return;
+        return BMS_FRAME_MALFORMED;
     }
     // Determine the length of the frame to process.
     // This is either the declared total length or the received length, whichever is smaller (to prevent overruns).
@@ -395,7 +910,7 @@ void parse_and_print_bms_data(const uint8_t *data, int len) {
     // If process_len is less than 4, we can't even read the CRC.
     if (process_len < 4) {
         ESP_LOGW(TAG, "Frame too short to contain CRC: %d bytes", process_len);
-        return;
+        return BMS_FRAME_MALFORMED;
     }
     // The python script sums `data[0:-4]`, meaning all bytes except the last four.
     // So, we sum `process_len - 4` bytes.
@@ -413,9 +928,9 @@ void parse_and_print_bms_data(const uint8_t *data, int len) {
 
     // Compare calculated CRC with received CRC.
     if ((uint16_t)crc_calc != crc_received) {
-        ESP_LOGE(TAG, "CRC mismatch! Calculated: 0x%04X, Received: 0x%04X. Frame might be corrupt.", 
+        ESP_LOGE(TAG, "CRC mismatch! Calculated: 0x%04X, Received: 0x%04X. Frame rejected.", 
                  (uint16_t)crc_calc, crc_received);
-        // return; // Optionally, uncomment to discard frames with bad CRC. For debugging, we might proceed.
+        return BMS_FRAME_CRC_ERROR;
     } else {
         ESP_LOGI(TAG, "CRC OK");
     }
@@ -431,29 +946,49 @@ void parse_and_print_bms_data(const uint8_t *data, int len) {
     // Check if frame is long enough to contain any payload.
     if (process_len < 20) { // 11 (header) + 9 (trailer) = 20. If less, no payload.
         ESP_LOGW(TAG, "Frame too short for data payload (less than 20 bytes): %d", process_len);
-        return;
+        return BMS_FRAME_MALFORMED;
     }
     // Pointer to the start of the payload.
     const uint8_t *payload = &data[11];
+    *payload_out = payload;
     // Calculate the length of the payload.
     int payload_len = process_len - 20; 
+    *payload_len_out = payload_len;
     
     ESP_LOGI(TAG, "Payload length: %d bytes", payload_len);
     if (payload_len <= 0) {
         ESP_LOGW(TAG, "No actual payload data (payload_len <= 0).");
         // If CRC was OK, this might be an ack or a frame with no data content.
         // Depending on the command sent, this might be expected.
-        return; 
+        return BMS_FRAME_NO_CELLS; 
     }
     // Log the hexadecimal representation of the payload for debugging.
     ESP_LOGI(TAG, "Payload HEX:");
     ESP_LOG_BUFFER_HEX(TAG, payload, payload_len);
+    return BMS_FRAME_OK;
+}
+
+// Parses the raw data received from the BMS and prints it.
+// data: Pointer to the buffer containing the raw data from BMS.
+// len: Length of the data in bytes.
+// Returns BMS_FRAME_OK only when the frame passed its checksum and yielded cell data; a frame
+// with a bad checksum is rejected before current_bms_data is touched.
+bms_frame_status_t parse_and_print_bms_data(const uint8_t *data, int len) {
+    const uint8_t *payload = NULL;
+    int payload_len = 0;
+    uint16_t frame_len_field = 0;
+    bms_frame_status_t frame_status = bms_frame_payload(data, len, &payload, &payload_len, &frame_len_field);
+    if (frame_status != BMS_FRAME_OK) {
+        return frame_status;
+    }
+    // Remember which current encoding this BMS uses (inferred from the read-all frame size)
+    bms_current_offset_encoding = frame_len_field >= 260;
 
     // Initialize current_bms_data fields to default/invalid values
     current_bms_data.num_cells = 0;
     current_bms_data.min_cell_voltage = 5.0f;
     current_bms_data.max_cell_voltage = 0.0f;
-
+    current_bms_data.flags_valid = false;
 
     // 5. Parse specific data fields from the payload.
     // This parsing is based on the "Read All Data" (0x06) command response structure.
@@ -462,7 +997,7 @@ void parse_and_print_bms_data(const uint8_t *data, int len) {
     // Guard against empty payload before accessing payload[0].
     if (payload_len == 0) { 
         ESP_LOGW(TAG, "Payload is empty, cannot parse specific fields.");
-        return;
+        return BMS_FRAME_NO_CELLS;
     }
     // Check if payload starts with the expected Cell Voltages ID (0x79).
     if (payload[0] != 0x79) {
@@ -479,67 +1014,14 @@ void parse_and_print_bms_data(const uint8_t *data, int len) {
     // Python: Voltages start at payload[2], each voltage uses 3 bytes.
     //         The actual mV value is in the last 2 bytes of these 3 (skip 1, read 2 as u16_be).
 
-    if (payload_len < 2) { // Need at least ID (already checked) and ByteCount.
-        ESP_LOGW(TAG, "Payload too short for cell voltage byte count (needs at least 2 bytes).");
-        return;
-    }
-    uint8_t cell_voltage_bytecount = payload[1]; // Number of bytes used for all cell voltage data.
-    int num_cells = cell_voltage_bytecount / 3;  // Each cell's data is 3 bytes long.
-    ESP_LOGI(TAG, "Cell voltage data byte count from payload: %d, Calculated number of cells: %d", cell_voltage_bytecount, num_cells);
-
-    // Check if payload is long enough for all declared cell voltages.
-    // Expected length = 2 (ID + ByteCount) + cell_voltage_bytecount.
-    if (payload_len < (2 + cell_voltage_bytecount)) {
-        ESP_LOGW(TAG, "Payload too short for all cell voltages. Expected %d bytes for cell data part, got %d bytes in payload.", 
-                 (2 + cell_voltage_bytecount), payload_len);
-        // We might still try to parse what's available if num_cells > 0 and data seems partially there.
-        // For now, return if data is clearly insufficient.
-        return;
+    int cell_block_len = decode_cell_block(payload, payload_len);
+    if (cell_block_len < 0) {
+        return BMS_FRAME_NO_CELLS;
     }
 
-    if (debug_logging) printf("Cell Voltages (V):\n");
-    float min_cell_voltage = 5.0f; // Initialize with a high value to find the minimum.
-    float max_cell_voltage = 0.0f; // Initialize with a low value to find the maximum.
-
-    for (int i = 0; i < num_cells; i++) {
-        // Offset for current cell's data within payload: 2 (ID+ByteCount) + i * 3 (3 bytes per cell).
-        // Voltage is in bytes 2 and 3 of these 3 bytes (i.e., skip the first byte of the 3-byte group).
-        // So, offset for mV value is payload_start + 2 + i*3 + 1.
-        int cell_data_start_offset = 2 + i * 3;
-        if ( (cell_data_start_offset + 2) < payload_len) { // Check bounds: need 3 bytes for cell i, last is at offset+2
-             uint16_t voltage_mv = unpack_u16_be(payload, cell_data_start_offset + 1); 
-             float voltage_v = voltage_mv / 1000.0f; // Convert mV to V.
-             if (debug_logging) printf("  Cell %2d: %.3f V\n", i + 1, voltage_v);
-             // Store individual cell voltage
-             if (i < 24) { // Ensure we don't write out of bounds of our array
-                 current_bms_data.cell_voltages[i] = voltage_v;
-             }
-             // Update min/max cell voltages, ensuring voltage_mv > 0 to avoid uninitialized cells if BMS reports them as 0.
-             if (voltage_mv > 0 && voltage_v < min_cell_voltage) min_cell_voltage = voltage_v;
-             if (voltage_v > max_cell_voltage) max_cell_voltage = voltage_v;
-        } else {
-            ESP_LOGW(TAG, "Not enough data in payload for cell %d voltage. Stopping cell voltage parsing.", i + 1);
-            break; // Stop if data runs out.
-        }
-    }
-    // Print Min, Max, and Delta cell voltages if cells were processed.
-    if (num_cells > 0) {
-        if (min_cell_voltage > 4.9f) min_cell_voltage = 0.0f; // If min_cell_voltage wasn't updated, set to 0.
-        if (debug_logging) {
-            printf("Min Cell Voltage: %.3f V\n", min_cell_voltage);
-            printf("Max Cell Voltage: %.3f V\n", max_cell_voltage);
-            printf("Cell Voltage Delta: %.3f V\n", max_cell_voltage - min_cell_voltage);
-        }
-        // Store in global struct
-        current_bms_data.num_cells = num_cells;
-        current_bms_data.min_cell_voltage = min_cell_voltage;
-        current_bms_data.max_cell_voltage = max_cell_voltage;
-        current_bms_data.cell_voltage_delta = max_cell_voltage - min_cell_voltage;
-    }
-    
     // current_offset tracks the position in the payload after the last parsed field.
     // Initialized to after the cell voltage block: ID (1) + ByteCount (1) + cell_voltage_bytecount.
-    int current_offset = 2 + cell_voltage_bytecount;
+    int current_offset = cell_block_len;
 
     // 5.2 Parse Temperatures (IDs 0x80, 0x81, 0x82)
     // Each temperature field: ID (1 byte) + Temperature Data (2 bytes, u16_be).
@@ -550,7 +1032,7 @@ void parse_and_print_bms_data(const uint8_t *data, int len) {
     // MOSFET Temperature (ID 0x80)
     if (payload_len > current_offset + 2 && payload[current_offset] == 0x80) { // Check ID and enough data (ID + 2 bytes)
         uint16_t temp_fet_raw = unpack_u16_be(payload, current_offset + 1);
-        float temp_fet = (temp_fet_raw > 100) ? -(float)(temp_fet_raw - 100) : (float)temp_fet_raw;
+        float temp_fet = bms_temp_from_raw(temp_fet_raw);
         if (debug_logging) printf("MOSFET Temperature: %.1f C (raw: %u)\n", temp_fet, temp_fet_raw);
         current_bms_data.mosfet_temp = temp_fet; // Store data
         current_offset += 3; // Advance offset by ID (1) + Data (2).
@@ -562,7 +1044,7 @@ void parse_and_print_bms_data(const uint8_t *data, int len) {
     // Probe 1 Temperature (ID 0x81)
     if (payload_len > current_offset + 2 && payload[current_offset] == 0x81) {
         uint16_t temp_1_raw = unpack_u16_be(payload, current_offset + 1);
-        float temp_1 = (temp_1_raw > 100) ? -(float)(temp_1_raw - 100) : (float)temp_1_raw;
+        float temp_1 = bms_temp_from_raw(temp_1_raw);
         if (debug_logging) printf("Probe 1 Temperature: %.1f C (raw: %u)\n", temp_1, temp_1_raw);
         current_bms_data.probe1_temp = temp_1; // Store data
         current_offset += 3;
@@ -574,7 +1056,7 @@ void parse_and_print_bms_data(const uint8_t *data, int len) {
     // Probe 2 Temperature (ID 0x82)
     if (payload_len > current_offset + 2 && payload[current_offset] == 0x82) {
         uint16_t temp_2_raw = unpack_u16_be(payload, current_offset + 1);
-        float temp_2 = (temp_2_raw > 100) ? -(float)(temp_2_raw - 100) : (float)temp_2_raw;
+        float temp_2 = bms_temp_from_raw(temp_2_raw);
         if (debug_logging) printf("Probe 2 Temperature: %.1f C (raw: %u)\n", temp_2, temp_2_raw);
         current_bms_data.probe2_temp = temp_2; // Store data
         current_offset += 3;
@@ -602,32 +1084,12 @@ void parse_and_print_bms_data(const uint8_t *data, int len) {
     // Value is in 0.01A.
     if (payload_len > current_offset + 2 && payload[current_offset] == 0x84) {
         uint16_t current_raw = unpack_u16_be(payload, current_offset + 1);
-        float current_a;
-
         ESP_LOGI(TAG, "Current parsing: frame_len_field=%u, current_raw=0x%04X (%u)", 
                  frame_len_field, current_raw, current_raw);
 
-        // Logic from data_bms_full.py, swapped for alternative interpretation:
-        // `frame_len_field` is the length from the BMS packet (from length field itself to end of CRC).
-        if (frame_len_field < 260) {
-            // Method 2 (Previously for frame_len_field >= 260): MSB indicates sign.
-            // Python: if (value & 0x8000) == 0x8000 : current = (value & 0x7FFF)/100
-            //         else : current = ((value & 0x7FFF)/100) * -1
-            // This means if MSB is set, it's positive current (value & 0x7FFF).
-            // If MSB is clear, it's negative current -(value & 0x7FFF).
-            // Note: This is different from standard two\'s complement.
-            if ((current_raw & 0x8000) == 0x8000) {
-                current_a = (float)(current_raw & 0x7FFF) / 100.0f;
-            } else {
-                current_a = -((float)(current_raw & 0x7FFF) / 100.0f);
-            }
-            ESP_LOGI(TAG, "Current (method 2, frame_len_field < 260): %.2f A", current_a);
-        } else {
-            // Method 1 (Previously for frame_len_field < 260): (10000 - raw_value) * 0.01. This implies 10000 is zero current.
-            // e.g. raw=10000 -> 0A. raw=9900 -> 1A. raw=10100 -> -1A.
-            current_a = (float)(10000 - (int32_t)current_raw) * 0.01f;
-            ESP_LOGI(TAG, "Current (method 1, frame_len_field >= 260): %.2f A", current_a);
-        }
+        float current_a = bms_current_from_raw(current_raw, bms_current_offset_encoding);
+        ESP_LOGI(TAG, "Current (method %d, frame_len_field %s 260): %.2f A",
+                 bms_current_offset_encoding ? 1 : 2, bms_current_offset_encoding ? ">=" : "<", current_a);
 
         if (debug_logging) printf("Current: %.2f A (raw: %u)\n", current_a, current_raw);
         current_bms_data.pack_current = current_a; // Store data
@@ -663,263 +1125,1668 @@ void parse_and_print_bms_data(const uint8_t *data, int len) {
         printf("\n");
     }
     
+    // Walk the TLV fields. Every iteration either advances by 1 + field length (>= 2 bytes,
+    // since every defined ID has a non-zero length) or ends the walk, and each step is an O(1)
+    // table lookup plus an O(1) duplicate test, so decode time is linear in payload length.
+    // An unknown ID is a hard stop: without its length there is no safe way to resync.
+    uint32_t seen_ids[256 / 32] = {0};
+    decode_status_t decode_status = DECODE_OK;
     extra_fields_count = 0;
+    decode_quality.duplicates = 0;
     int extra_offset = current_offset;
-    while (extra_offset < payload_len && extra_fields_count < MAX_EXTRA_FIELDS) {
+    while (extra_offset < payload_len) {
         uint8_t id = payload[extra_offset];
-        if (debug_logging) ESP_LOGI(TAG, "Found field ID 0x%02X at offset %d", id, extra_offset);
-        
-        // Check if this field ID has already been processed
-        bool already_exists = false;
-        for (int j = 0; j < extra_fields_count; j++) {
-            if (extra_fields[j].id == id) {
-                already_exists = true;
-                if (debug_logging) ESP_LOGW(TAG, "DUPLICATE DETECTED: Field ID 0x%02X already exists at index %d", id, j);
-                break;
-            }
+        const bms_idcode_t *code = bms_idcode_lookup(id);
+        if (!code) {
+            decode_status = DECODE_UNKNOWN_ID;
+            break;
         }
-        
-        if (!already_exists) {
-            int found = 0;
-            for (size_t i = 0; i < BMS_IDCODES_COUNT; ++i) {
-                if (bms_idcodes[i].id == id) {
-                    // Special debug for 0xB4
-                    if (id == 0xB4) {
-                        ESP_LOGI(TAG, "=== PROCESSING 0xB4 SPECIFICALLY ===");
-                        ESP_LOGI(TAG, "Field bytes: %d, Type: %s", bms_idcodes[i].byte_len, bms_idcodes[i].type);
-                        ESP_LOGI(TAG, "Available data: offset %d, payload_len %d", extra_offset, payload_len);
-                    }
-                    
-                    uint32_t value = 0;
-                    int bytes = bms_idcodes[i].byte_len;
-                    const char *type = bms_idcodes[i].type;
-                    int is_ascii = (type && (strcmp(type, "Code") == 0 || strcmp(type, "Column") == 0));
-                    char strval[48] = {0};
-                    if (bytes > 0 && (extra_offset + bytes) < payload_len) {
-                        // Always calculate numeric value (needed for fallback hex string)
-                        for (int b = 0; b < bytes; ++b) {
-                            value = (value << 8) | payload[extra_offset + 1 + b];
-                        }
-                        
-                        if (is_ascii) {
-                            int copylen = (bytes < 47) ? bytes : 47;
-                            memcpy(strval, &payload[extra_offset + 1], copylen);
-                            strval[copylen] = '\0';
-                            // Remove non-printable chars
-                            for (int s = 0; s < copylen; ++s) {
-                                if (strval[s] < 32 || strval[s] > 126) strval[s] = '\0';
-                            }
-                            
-                            // Special debug for 0xB4
-                            if (id == 0xB4) {
-                                ESP_LOGI(TAG, "0xB4 raw bytes: %02X %02X %02X %02X %02X %02X %02X %02X", 
-                                         payload[extra_offset + 1], payload[extra_offset + 2], payload[extra_offset + 3], payload[extra_offset + 4],
-                                         payload[extra_offset + 5], payload[extra_offset + 6], payload[extra_offset + 7], payload[extra_offset + 8]);
-                                ESP_LOGI(TAG, "0xB4 parsed string: '%s'", strval);
-                            }
-                            
-                            // Force Device ID Code to be string even if parsing results in empty string
-                            if (id == 0xB4 && strval[0] == '\0') {
-                                snprintf(strval, sizeof(strval), "%08X", (unsigned int)value);
-                                ESP_LOGI(TAG, "0xB4 forced to hex string: '%s'", strval);
-                            }
-                        }
-                    } else {
-                        if (id == 0xB4) {
-                            ESP_LOGW(TAG, "0xB4 SKIPPED: insufficient data. Need %d bytes, have %d", bytes, payload_len - extra_offset - 1);
-                        }
-                    }
-                    extra_fields[extra_fields_count].id = id;
-                    extra_fields[extra_fields_count].value = value;
-                    extra_fields[extra_fields_count].is_ascii = is_ascii;
-                    if (is_ascii) {
-                        strncpy(extra_fields[extra_fields_count].strval, strval, sizeof(extra_fields[extra_fields_count].strval)-1);
-                    } else {
-                        extra_fields[extra_fields_count].strval[0] = '\0';
-                    }
-                    extra_fields_count++;
-                    ESP_LOGI(TAG, "PARSED: %s (0x%02X): %s%lu (offset %d -> %d)", 
-                             bms_idcodes[i].name, id, is_ascii ? strval : "", 
-                             is_ascii ? 0 : (unsigned long)value, extra_offset, extra_offset + 1 + bytes);
-                    extra_offset += 1 + bytes;
-                    found = 1;
-                    break;
-                }
-            }
-            if (!found) {
-                if (debug_logging) ESP_LOGW(TAG, "UNKNOWN field ID 0x%02X at offset %d, skipping", id, extra_offset);
-                extra_offset++;
-            }
-        } else {
-            // Skip this duplicate field
-            if (debug_logging) ESP_LOGW(TAG, "SKIPPING duplicate field ID 0x%02X", id);
-            int found = 0;
-            for (size_t i = 0; i < BMS_IDCODES_COUNT; ++i) {
-                if (bms_idcodes[i].id == id) {
-                    if (debug_logging) ESP_LOGI(TAG, "Skipping %d bytes for duplicate 0x%02X", bms_idcodes[i].byte_len, id);
-                    extra_offset += 1 + bms_idcodes[i].byte_len;
-                    found = 1;
-                    break;
-                }
+        int bytes = code->byte_len;
+        if (extra_offset + bytes >= payload_len) {
+            decode_status = DECODE_TRUNCATED;
+            break;
+        }
+        if (seen_ids[id >> 5] & (1u << (id & 31))) {
+            if (debug_logging) ESP_LOGW(TAG, "SKIPPING duplicate field ID 0x%02X at offset %d", id, extra_offset);
+            decode_quality.duplicates++;
+            extra_offset += 1 + bytes;
+            continue;
+        }
+        if (extra_fields_count >= MAX_EXTRA_FIELDS) {
+            decode_status = DECODE_FIELD_OVERFLOW;
+            break;
+        }
+        seen_ids[id >> 5] |= 1u << (id & 31);
+
+        const uint8_t *field = &payload[extra_offset + 1];
+        bms_extra_field_t *out = &extra_fields[extra_fields_count];
+        uint32_t value = 0;
+        // Always calculate numeric value (needed for fallback hex string)
+        for (int b = 0; b < bytes; ++b) {
+            value = (value << 8) | field[b];
+        }
+        int is_ascii = (code->type && (strcmp(code->type, "Code") == 0 || strcmp(code->type, "Column") == 0));
+        out->id = id;
+        out->value = value;
+        out->is_ascii = is_ascii;
+        out->strval[0] = '\0';
+        if (is_ascii) {
+            int copylen = (bytes < (int)sizeof(out->strval) - 1) ? bytes : (int)sizeof(out->strval) - 1;
+            memcpy(out->strval, field, copylen);
+            out->strval[copylen] = '\0';
+            // Remove non-printable chars
+            for (int c = 0; c < copylen; ++c) {
+                if (out->strval[c] < 32 || out->strval[c] > 126) out->strval[c] = '\0';
             }
-            if (!found) {
-                ESP_LOGW(TAG, "Unknown duplicate field 0x%02X, advancing by 1 byte", id);
-                extra_offset++;
+            // Force Device ID Code to be string even if parsing results in empty string
+            if (id == 0xB4 && out->strval[0] == '\0') {
+                snprintf(out->strval, sizeof(out->strval), "%08X", (unsigned int)value);
             }
         }
+        extra_fields_count++;
+        if (debug_logging) {
+            ESP_LOGI(TAG, "PARSED: %s (0x%02X): %s%lu (offset %d -> %d)",
+                     code->name, id, is_ascii ? out->strval : "",
+                     is_ascii ? 0 : (unsigned long)value, extra_offset, extra_offset + 1 + bytes);
+        }
+        extra_offset += 1 + bytes;
     }
-    
-    ESP_LOGI(TAG, "=== EXTRA FIELDS PARSING COMPLETE ===");
-    ESP_LOGI(TAG, "Parsed %d unique extra fields", extra_fields_count);
-
-    if (debug_logging) printf("----------------------------------------\n"); // Separator for console output.
 
-    // After parsing all data and populating current_bms_data
-    // Call function to publish data via MQTT
-    // This check ensures we only try to publish if we have some valid cell data
-    if (debug_logging) printf("[DEBUG] Checking publish condition: num_cells=%d\n", current_bms_data.num_cells);
-    if (current_bms_data.num_cells > 0) {
-        if (debug_logging) printf("[DEBUG] Calling publish_bms_data_mqtt...\n");
-        publish_bms_data_mqtt(&current_bms_data);
-        if (debug_logging) printf("[DEBUG] publish_bms_data_mqtt returned\n");
+    decode_quality.status = decode_status;
+    decode_quality.fields = extra_fields_count;
+    decode_quality.bytes_decoded = extra_offset - current_offset;
+    decode_quality.payload_bytes = payload_len > current_offset ? payload_len - current_offset : 0;
+    decode_quality.stop_id = extra_offset < payload_len ? payload[extra_offset] : 0;
+    decode_quality.stop_offset = extra_offset;
+    decode_quality.frames++;
+    if (decode_status == DECODE_OK) {
+        decode_quality.frames_clean++;
     } else {
-        if (debug_logging) printf("[DEBUG] Not publishing - no valid cell data\n");
+        decode_quality.frames_flagged[decode_status]++;
+        ESP_LOGW(TAG, "Frame flagged: %s at payload offset %d (ID 0x%02X), %d/%d extra-field bytes decoded",
+                 decode_status_names[decode_status], extra_offset, decode_quality.stop_id,
+                 decode_quality.bytes_decoded, decode_quality.payload_bytes);
     }
-}
 
+    ESP_LOGI(TAG, "=== EXTRA FIELDS PARSING COMPLETE ===");
+    ESP_LOGI(TAG, "Parsed %d unique extra fields", extra_fields_count);
 
-// Reads data from the BMS. This function handles potential UART echo and then parses the response.
-static void read_bms_data() {
-    uint8_t data_buf[UART_BUF_SIZE]; // Buffer to store raw data from UART.
-    int length = 0; // Variable to store the length of data available in UART RX buffer.
+    // Lift the bitfield words and cycle count into the sample for event tracking
+    uint32_t warn_raw = 0, status_raw = 0, cycles_raw = 0;
+    bool have_warn = find_extra_field(0x8B, &warn_raw);
+    bool have_status = find_extra_field(0x8C, &status_raw);
+    current_bms_data.warning_flags = (uint16_t)warn_raw;
+    current_bms_data.status_flags = (uint16_t)status_raw;
+    current_bms_data.flags_valid = have_warn && have_status;
+    if (find_extra_field(0x87, &cycles_raw)) {
+        current_bms_data.cycle_count = (uint16_t)cycles_raw;
+    }
+    if (current_bms_data.flags_valid) {
+        current_bms_data.charge_mosfet_status = (status_raw >> 0) & 1;
+        current_bms_data.discharge_mosfet_status = (status_raw >> 1) & 1;
+        current_bms_data.balancing_active = (status_raw >> 2) & 1;
+    }
 
-    ESP_LOGI(TAG, "Attempting to read BMS data...");
-    // Wait for a period to allow the BMS to respond.
-    // JK BMS response time is typically <100ms for "Read All Data".
-    // A 300ms delay provides a safety margin.
-    vTaskDelay(pdMS_TO_TICKS(300)); 
-    
-    // Feed TWDT after the delay to prevent timeout during BMS communication
-    esp_task_wdt_reset(); 
+    if (debug_logging) printf("----------------------------------------\n"); // Separator for console output.
 
-    // Get the number of bytes available in the UART RX buffer.
-    ESP_ERROR_CHECK(uart_get_buffered_data_len(UART_NUM, (size_t*)&length));
-    
-    if (length > 0) { // If data is available
-        ESP_LOGI(TAG, "%d bytes available in UART buffer.", length);
-        if (length > UART_BUF_SIZE) {
-            ESP_LOGW(TAG, "Incoming data (%d bytes) larger than local buffer (%d bytes). Truncating.", length, UART_BUF_SIZE);
-            length = UART_BUF_SIZE; // Limit read to buffer size to prevent overflow.
-        }
-        
-        // Read the data from UART RX buffer into data_buf.
-        // pdMS_TO_TICKS(200): Timeout for the read operation.
-        int read_len = uart_read_bytes(UART_NUM, data_buf, length, pdMS_TO_TICKS(200)); 
-        
-        // Feed TWDT after UART read operation
-        esp_task_wdt_reset(); 
-        
-        if (read_len > 0) {
-            ESP_LOGI(TAG, "Successfully read %d bytes from UART:", read_len);
-            ESP_LOG_BUFFER_HEX(TAG, data_buf, read_len); // Log the raw received data in hex.
-
-            uint8_t* data_to_parse = data_buf; // Pointer to the start of data to be parsed.
-            int len_to_parse = read_len;       // Length of data to be parsed.
-
-            // Check if the received data starts with the command that was sent (UART echo).
-            // This can happen if TX and RX lines are connected in a way that allows echo.
-            if (len_to_parse >= sizeof(bms_read_all_cmd) &&
-                memcmp(data_to_parse, bms_read_all_cmd, sizeof(bms_read_all_cmd)) == 0) {
-                ESP_LOGI(TAG, "Command echo detected at the beginning of the read buffer. Skipping %d echo bytes.", (int)sizeof(bms_read_all_cmd));
-                // Advance the pointer and reduce the length to skip the echo.
-                data_to_parse += sizeof(bms_read_all_cmd);
-                len_to_parse -= sizeof(bms_read_all_cmd);
-
-                if (len_to_parse <= 0) {
-                    ESP_LOGW(TAG, "Buffer contained only echo, no further data for BMS response.");
-                    // uart_flush_input(UART_NUM); // Flush, though it will be flushed later anyway.
-                    return; // No actual BMS response data left.
-                }
-                ESP_LOGI(TAG, "Processing remaining %d bytes for BMS response:", len_to_parse);
-                ESP_LOG_BUFFER_HEX(TAG, data_to_parse, len_to_parse); // Log the data after skipping echo.
-            }
+    // Publishing is left to the caller so a rejected frame can be retried first
+    return current_bms_data.num_cells > 0 ? BMS_FRAME_OK : BMS_FRAME_NO_CELLS;
+}
 
-            // If there's still data left after potential echo removal, parse it.
-            if (len_to_parse > 0) { 
-                parse_and_print_bms_data(data_to_parse, len_to_parse);
-            } else {
-                ESP_LOGW(TAG, "No data left to parse after potential echo removal.");
-            }
 
-        } else { // uart_read_bytes returned 0 or error.
-            ESP_LOGW(TAG, "Failed to read data from UART buffer after length check (uart_read_bytes returned %d).", read_len);
-        }
-        // Flush the UART RX buffer to remove any remaining or old data.
-        // This is important to prevent interference with the next read cycle.
-        uart_flush_input(UART_NUM);
-        ESP_LOGI(TAG, "UART RX buffer flushed.");
-    } else { // No data available in UART buffer after the initial wait.
-        ESP_LOGW(TAG, "No data available from BMS after %dms wait.", 300);
+// --- Two-tier polling ---
+// Live values are polled every cycle with single-ID reads (command 0x03); the full read-all,
+// which also carries the ~50 static configuration fields, runs every full_read_interval_min
+// minutes. Single reads merge into the last full sample instead of replacing it.
+//
+// Each single-ID exchange carries 20 bytes of framing in each direction, so the fast set is
+// not automatically cheaper than one read-all, and the 0x03 read takes a single ID so the set
+// cannot be batched into one request. The bus time of both kinds of cycle is measured and the
+// fast tier is suspended until the next scheduled read-all if it turns out slower. The schedule
+// is kept separately so fallback and suspended read-alls do not push it back.
+// The warning word 0x8B is live as well, so its bit-flip events do not wait for a read-all.
+static const uint8_t bms_fast_ids[] = { 0x79, 0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x8B, 0x8C };
+#define BMS_FAST_IDS_COUNT (sizeof(bms_fast_ids)/sizeof(bms_fast_ids[0]))
+#define BMS_CMD_READ_ID 0x03
+#define BMS_CMD_WRITE_ID 0x02
+#define BMS_FRAME_TYPE_WRITE 0x02
+#define BMS_FRAME_SOURCE_HOST 0x03
+#define BMS_REQUEST_WRITE_ACK 0x100     // read_bms_data() request: acknowledgement of a write
+
+static struct {
+    bool have_full;                     // A read-all has succeeded since boot
+    int64_t next_full_us;               // Next scheduled read-all
+    bool full_due;                      // The scheduled read-all has not succeeded yet
+    bool fast_suspended;                // Fast tier measured slower than read-all
+    uint32_t fast_cycles;
+    uint32_t full_cycles;
+    uint32_t fallbacks;                 // Fast cycles replaced by a read-all after a failed single read
+    uint32_t fast_bus_us;               // Bus time of the last fast cycle
+    uint32_t full_bus_us;               // Bus time of the last read-all cycle
+    uint32_t fast_bytes;
+    uint32_t full_bytes;
+    bool last_fast;
+} bms_tier;
+
+// Builds a command frame around data into out (at least 20 + data_len bytes). Returns its length.
+// Layout: 4E 57 | len | terminal(4) | cmd | source | type | data | record(4) | 68 | 00 00 | sum
+static size_t bms_build_frame(uint8_t *out, uint8_t cmd, uint8_t type, const uint8_t *data, size_t data_len) {
+    size_t n = 0;
+    uint16_t len_field = (uint16_t)(18 + data_len);
+    out[n++] = 0x4E;
+    out[n++] = 0x57;
+    out[n++] = len_field >> 8;
+    out[n++] = len_field & 0xFF;
+    memset(&out[n], 0, 4);              // Terminal number
+    n += 4;
+    out[n++] = cmd;
+    out[n++] = BMS_FRAME_SOURCE_HOST;
+    out[n++] = type;
+    memcpy(&out[n], data, data_len);
+    n += data_len;
+    memset(&out[n], 0, 4);              // Record number
+    n += 4;
+    out[n++] = 0x68;
+    // Checksum: 16-bit sum of everything before the 4-byte checksum field, in its last 2 bytes
+    uint32_t sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        sum += out[i];
     }
+    out[n++] = 0x00;
+    out[n++] = 0x00;
+    out[n++] = (sum >> 8) & 0xFF;
+    out[n++] = sum & 0xFF;
+    return n;
 }
 
-// Place these functions before app_main so they are visible to it
-void load_wifi_config_from_nvs() {
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    if (err == ESP_OK) {
-        size_t ssid_len = sizeof(wifi_ssid);
-        size_t pass_len = sizeof(wifi_pass);
-        if (nvs_get_str(nvs_handle, WIFI_NVS_KEY_SSID, wifi_ssid, &ssid_len) != ESP_OK) {
-            strncpy(wifi_ssid, DEFAULT_WIFI_SSID, sizeof(wifi_ssid)-1);
-            nvs_set_str(nvs_handle, WIFI_NVS_KEY_SSID, wifi_ssid);
-        }
-        if (nvs_get_str(nvs_handle, WIFI_NVS_KEY_PASS, wifi_pass, &pass_len) != ESP_OK) {
-            strncpy(wifi_pass, DEFAULT_WIFI_PASS, sizeof(wifi_pass)-1);
-            nvs_set_str(nvs_handle, WIFI_NVS_KEY_PASS, wifi_pass);
+// Stores or updates one extra field without disturbing the rest of the last full read
+static void extra_field_merge(uint8_t id, uint32_t value) {
+    for (int i = 0; i < extra_fields_count; ++i) {
+        if (extra_fields[i].id == id) {
+            extra_fields[i].value = value;
+            return;
         }
-        nvs_commit(nvs_handle);
-        nvs_close(nvs_handle);
-    } else {
-        strncpy(wifi_ssid, DEFAULT_WIFI_SSID, sizeof(wifi_ssid)-1);
-        strncpy(wifi_pass, DEFAULT_WIFI_PASS, sizeof(wifi_pass)-1);
+    }
+    if (extra_fields_count < MAX_EXTRA_FIELDS) {
+        extra_fields[extra_fields_count].id = id;
+        extra_fields[extra_fields_count].value = value;
+        extra_fields[extra_fields_count].is_ascii = 0;
+        extra_fields[extra_fields_count].strval[0] = '\0';
+        extra_fields_count++;
     }
 }
 
-void load_mqtt_config_from_nvs() {
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    if (err == ESP_OK) {
-        size_t url_len = sizeof(mqtt_broker_url);
-        if (nvs_get_str(nvs_handle, MQTT_NVS_KEY_URL, mqtt_broker_url, &url_len) != ESP_OK) {
-            strncpy(mqtt_broker_url, DEFAULT_MQTT_BROKER_URL, sizeof(mqtt_broker_url)-1);
-            nvs_set_str(nvs_handle, MQTT_NVS_KEY_URL, mqtt_broker_url);
+// Parses the response to a single-ID read and merges the value into current_bms_data and
+// extra_fields. Nothing else in the sample is reset.
+static bms_frame_status_t parse_single_id_response(const uint8_t *data, int len, uint8_t id) {
+    const uint8_t *payload = NULL;
+    int payload_len = 0;
+    uint16_t frame_len_field = 0;
+    bms_frame_status_t frame_status = bms_frame_payload(data, len, &payload, &payload_len, &frame_len_field);
+    if (frame_status != BMS_FRAME_OK) {
+        return frame_status;
+    }
+    if (payload[0] != id) {
+        ESP_LOGW(TAG, "Single-ID read of 0x%02X answered with ID 0x%02X", id, payload[0]);
+        return BMS_FRAME_MALFORMED;
+    }
+    if (id == 0x79) {
+        return decode_cell_block(payload, payload_len) < 0 ? BMS_FRAME_NO_CELLS : BMS_FRAME_OK;
+    }
+    int field_len = (id >= 0x80 && id <= 0x84) ? 2 : (id == 0x85 ? 1 : 0);
+    const bms_idcode_t *code = field_len ? NULL : bms_idcode_lookup(id);
+    if (code) {
+        field_len = code->byte_len;
+    }
+    if (field_len == 0 || payload_len < 1 + field_len) {
+        return BMS_FRAME_MALFORMED;
+    }
+    uint32_t value = 0;
+    for (int b = 0; b < field_len; ++b) {
+        value = (value << 8) | payload[1 + b];
+    }
+    switch (id) {
+    case 0x80: current_bms_data.mosfet_temp = bms_temp_from_raw((uint16_t)value); break;
+    case 0x81: current_bms_data.probe1_temp = bms_temp_from_raw((uint16_t)value); break;
+    case 0x82: current_bms_data.probe2_temp = bms_temp_from_raw((uint16_t)value); break;
+    case 0x83: current_bms_data.pack_voltage = value / 100.0f; break;
+    case 0x84: current_bms_data.pack_current = bms_current_from_raw((uint16_t)value, bms_current_offset_encoding); break;
+    case 0x85: current_bms_data.soc_percent = (uint8_t)value; break;
+    default:
+        extra_field_merge(id, value);
+        if (id == 0x8B) {
+            current_bms_data.warning_flags = (uint16_t)value;
+        } else if (id == 0x8C) {
+            current_bms_data.status_flags = (uint16_t)value;
+            current_bms_data.charge_mosfet_status = (value >> 0) & 1;
+            current_bms_data.discharge_mosfet_status = (value >> 1) & 1;
+            current_bms_data.balancing_active = (value >> 2) & 1;
         }
-        nvs_commit(nvs_handle);
-        nvs_close(nvs_handle);
-    } else {
-        strncpy(mqtt_broker_url, DEFAULT_MQTT_BROKER_URL, sizeof(mqtt_broker_url)-1);
+        break;
     }
+    if (debug_logging) ESP_LOGI(TAG, "Single-ID 0x%02X = %lu", id, (unsigned long)value);
+    return BMS_FRAME_OK;
 }
 
-void load_sample_interval_from_nvs() {
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    if (err == ESP_OK) {
-        int64_t val = 0;
-        if (nvs_get_i64(nvs_handle, NVS_KEY_SAMPLE_INTERVAL, &val) == ESP_OK && val > 0) {
-            sample_interval_ms = (long)val;
-        } else {
-            sample_interval_ms = DEFAULT_SAMPLE_INTERVAL;
-            nvs_set_i64(nvs_handle, NVS_KEY_SAMPLE_INTERVAL, (int64_t)sample_interval_ms);
+// True if this cycle should use single-ID reads rather than a read-all
+static bool bms_tier_use_fast(void) {
+    if (full_read_interval_min == 0 || !bms_tier.have_full) {
+        return false;
+    }
+    if (esp_timer_get_time() >= bms_tier.next_full_us) {
+        bms_tier.full_due = true;       // Cleared by bms_tier_account() once it succeeds
+        return false;
+    }
+    return !bms_tier.fast_suspended;
+}
+
+// Records the outcome of a cycle for the tier scheduler and its cost comparison
+static void bms_tier_account(bool fast, bms_frame_status_t status) {
+    if (status != BMS_FRAME_OK) {
+        return;
+    }
+    uint32_t bytes = bms_wire.cycle_tx_bytes + bms_wire.cycle_rx_bytes;
+    bms_tier.last_fast = fast;
+    if (fast) {
+        bms_tier.fast_cycles++;
+        bms_tier.fast_bus_us = bms_wire.cycle_bus_us;
+        bms_tier.fast_bytes = bytes;
+        if (bms_tier.full_bus_us && bms_tier.fast_bus_us >= bms_tier.full_bus_us && !bms_tier.fast_suspended) {
+            bms_tier.fast_suspended = true;
+            ESP_LOGW(TAG, "Single-ID polling took %lu us vs %lu us for read-all; using read-all until the next full read",
+                     bms_tier.fast_bus_us, bms_tier.full_bus_us);
         }
-        nvs_commit(nvs_handle);
-        nvs_close(nvs_handle);
     } else {
-        sample_interval_ms = DEFAULT_SAMPLE_INTERVAL;
+        bms_tier.full_cycles++;
+        bms_tier.full_bus_us = bms_wire.cycle_bus_us;
+        bms_tier.full_bytes = bytes;
+        if (bms_tier.full_due || !bms_tier.have_full) {
+            // Scheduled read-all done: the fast tier gets another chance until the next one
+            bms_tier.next_full_us = esp_timer_get_time() + (int64_t)full_read_interval_min * 60 * 1000000;
+            bms_tier.full_due = false;
+            bms_tier.fast_suspended = false;
+        }
+        bms_tier.have_full = true;
     }
 }
 
+// Updates the echo detector after an exchange that produced a response frame
+static void echo_observe(bool seen) {
+    if (bms_echo.state == ECHO_UNKNOWN) {
+        bms_echo.streak = (bms_echo.streak == 0 || seen == bms_echo.last_seen) ? bms_echo.streak + 1 : 1;
+        bms_echo.last_seen = seen;
+        if (bms_echo.streak >= BMS_ECHO_PROBE_EXCHANGES) {
+            bms_echo.state = seen ? ECHO_PRESENT : ECHO_ABSENT;
+            bms_echo.streak = 0;
+            ESP_LOGI(TAG, "RS485 transceiver echo %s", seen ? "detected" : "not present");
+        }
+        return;
+    }
+    if (seen == (bms_echo.state == ECHO_PRESENT)) {
+        bms_echo.streak = 0;
+        return;
+    }
+    // Contradicts the decided state; re-probe if it keeps happening
+    bms_echo.unexpected++;
+    if (++bms_echo.streak >= BMS_ECHO_PROBE_EXCHANGES) {
+        ESP_LOGW(TAG, "RS485 echo behaviour changed, re-detecting");
+        bms_echo.state = ECHO_UNKNOWN;
+        bms_echo.streak = 0;
+    }
+}
+
+// Dispatches a response frame to the parser for the request that produced it. A write
+// acknowledgement carries nothing to decode; only its framing and checksum are checked.
+static bms_frame_status_t parse_bms_response(const uint8_t *data, int len, uint16_t request) {
+    if (request == 0) {
+        return parse_and_print_bms_data(data, len);
+    }
+    if (request == BMS_REQUEST_WRITE_ACK) {
+        const uint8_t *payload = NULL;
+        int payload_len = 0;
+        uint16_t frame_len_field = 0;
+        return bms_frame_payload(data, len, &payload, &payload_len, &frame_len_field);
+    }
+    return parse_single_id_response(data, len, (uint8_t)request);
+}
+
+// Reads one response from the BMS as it streams in and parses it. Returns as soon as a complete
+// frame (other than an echo of the command) has arrived, or when the learned deadline expires.
+// request selects the parser: 0 for read-all, an ID for a 0x03 read, or BMS_REQUEST_WRITE_ACK.
+static bms_frame_status_t read_bms_data(uint16_t request) {
+    uint8_t data_buf[UART_BUF_SIZE]; // Buffer to store raw data from UART.
+    int len = 0;
+    int frame_start = -1;            // Offset of the response frame in data_buf
+    int frame_len = 0;
+    int64_t first_byte_us = 0;
+    int64_t deadline_us = bms_last_cmd_us + (int64_t)bms_latency.deadline_ms * 1000;
+    bool echo_seen = false;
+    bool echo_prefix = bms_echo.state != ECHO_ABSENT && bms_last_tx_len > 0; // Stream so far could still be our echo
+
+    if (debug_logging) ESP_LOGI(TAG, "Attempting to read BMS data (deadline %lu ms)...", bms_latency.deadline_ms);
+
+    int scan = 0;
+    while (frame_start < 0 && len < UART_BUF_SIZE) {
+        int64_t now = esp_timer_get_time();
+        if (now >= deadline_us) {
+            break;
+        }
+        uint32_t wait_ms = (uint32_t)((deadline_us - now) / 1000);
+        if (wait_ms > BMS_READ_SLICE_MS) wait_ms = BMS_READ_SLICE_MS;
+        TickType_t wait_ticks = pdMS_TO_TICKS(wait_ms);
+        if (wait_ticks == 0) wait_ticks = 1; // Never spin: at 100 Hz anything under 10 ms rounds to 0
+        int n = uart_read_bytes(UART_NUM, data_buf + len, UART_BUF_SIZE - len, wait_ticks);
+        if (n <= 0) {
+            continue;
+        }
+        len += n;
+        // The response starts at the first byte that cannot belong to a leading echo
+        if (echo_prefix) {
+            int cmp = len < (int)bms_last_tx_len ? len : (int)bms_last_tx_len;
+            echo_prefix = memcmp(data_buf, bms_last_tx, cmp) == 0;
+        }
+        if (first_byte_us == 0 && len > (echo_prefix ? (int)bms_last_tx_len : 0)) {
+            first_byte_us = esp_timer_get_time();
+        }
+
+        // Look for complete frames in what has arrived so far
+        while (scan + 4 <= len) {
+            if (data_buf[scan] != 0x4E || data_buf[scan + 1] != 0x57) {
+                scan++;
+                continue;
+            }
+            int total = 2 + unpack_u16_be(data_buf, scan + 2);
+            if (total < 20 || total > UART_BUF_SIZE) {
+                scan++; // Not a plausible frame header (header + trailer alone are 20 bytes)
+                continue;
+            }
+            if (scan + total > len) {
+                break; // Frame still arriving
+            }
+            // Our own command looks like a frame too; step over it and keep reading
+            if (total == (int)bms_last_tx_len && memcmp(&data_buf[scan], bms_last_tx, bms_last_tx_len) == 0) {
+                if (debug_logging) ESP_LOGI(TAG, "Command echo at offset %d, skipping %d bytes.", scan, total);
+                echo_seen = true;
+                bms_echo.skipped++;
+                scan += total;
+                continue;
+            }
+            frame_start = scan;
+            frame_len = total;
+            break;
+        }
+    }
+    esp_task_wdt_reset();
+    bms_wire.cycle_rx_bytes += len;
+    bms_wire.cycle_bus_us += (uint32_t)(esp_timer_get_time() - bms_last_cmd_us);
+    bms_link.frames++;
+
+    bms_frame_status_t status;
+    if (frame_start >= 0) {
+        // Timestamp the sample at frame completion for the energy integrator and its UTC time
+        int64_t complete_us = esp_timer_get_time();
+        bms_wire.last_exchange_us = (uint32_t)(complete_us - bms_last_cmd_us);
+        current_bms_data.sample_time_us = complete_us;
+        ESP_LOGI(TAG, "Successfully read %d bytes from UART (frame %d bytes at offset %d)", len, frame_len, frame_start);
+        if (debug_logging) ESP_LOG_BUFFER_HEX(TAG, data_buf, len);
+        status = parse_bms_response(&data_buf[frame_start], frame_len, request);
+        if (!bms_baud_probing) {
+            echo_observe(echo_seen);
+        }
+        // Only read-all exchanges feed the estimator; single-ID replies are much shorter
+        if (request == 0 && !bms_baud_probing && (status == BMS_FRAME_OK || status == BMS_FRAME_NO_CELLS)) {
+            uint32_t terminal = ((uint32_t)data_buf[frame_start + 4] << 24) | ((uint32_t)data_buf[frame_start + 5] << 16) |
+                                ((uint32_t)data_buf[frame_start + 6] << 8) | data_buf[frame_start + 7];
+            latency_record(terminal, (uint32_t)((first_byte_us - bms_last_cmd_us) / 1000),
+                           (uint32_t)((complete_us - bms_last_cmd_us) / 1000));
+        }
+    } else {
+        // Nothing complete before the deadline: pass whatever arrived to the parser so a
+        // truncated or corrupt frame is still accounted as such, and back off the deadline.
+        // A missing write acknowledgement says nothing about latency; some firmware never sends one.
+        if (request != BMS_REQUEST_WRITE_ACK) {
+            latency_timeout();
+        }
+        if (len > 0) {
+            ESP_LOGW(TAG, "Incomplete BMS response: %d bytes before %lu ms deadline", len, bms_latency.deadline_ms);
+            status = parse_bms_response(data_buf + scan, len - scan, request);
+            if (status == BMS_FRAME_OK) status = BMS_FRAME_MALFORMED; // Cannot happen, but never trust a partial frame
+        } else {
+            ESP_LOGW(TAG, "No data available from BMS before %lu ms deadline.", bms_latency.deadline_ms);
+            status = BMS_FRAME_NO_DATA;
+        }
+    }
+
+    // Flush the UART RX buffer to remove any remaining or old data.
+    // This is important to prevent interference with the next read cycle.
+    uart_flush_input(UART_NUM);
+    return status;
+}
+
+// Boot milestones, in esp_timer time (0 = not reached yet). Reported under processor.boot
+// and logged once the first publish completes; see "Boot path" for how they are reached early.
+static struct {
+    int64_t wifi_ip_us;
+    int64_t mqtt_connected_us;
+    int64_t first_sample_us;
+    int64_t first_publish_us;
+} boot_marks;
+
+static void boot_mark(int64_t *mark) {
+    if (*mark == 0) {
+        *mark = esp_timer_get_time();
+        if (mark == &boot_marks.first_publish_us) {
+            ESP_LOGW(TAG, "Boot: first sample after %lld ms, first publish after %lld ms",
+                     boot_marks.first_sample_us / 1000, boot_marks.first_publish_us / 1000);
+        }
+    }
+}
+
+// ============================================================
+// Power management
+// ============================================================
+// With power save enabled, the CPU scales down to the crystal frequency and the chip enters
+// automatic light sleep whenever every task is blocked, which is most of each sample interval.
+// Wi-Fi uses maximum modem sleep and wakes every POWER_LISTEN_INTERVAL beacons (a multiple of
+// the usual DTIM periods of 1 and 3), so the broker link stays up. Downlink traffic (commands,
+// PUBACKs) can then wait up to one listen interval, about 300 ms. With power save off, Wi-Fi is
+// left at the IDF default, minimum modem sleep.
+// Light sleep needs CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE, which the shipped
+// sdkconfig sets; the power_save parameter decides at runtime whether esp_pm_configure() runs.
+//
+// The BMS only ever talks in answer to a poll, so instead of arming a UART wakeup (UART2 cannot
+// wake an ESP32 from light sleep anyway) the chip is kept awake, at full APB clock for the baud
+// rate, from the start of a poll cycle or command until its data is queued for MQTT. That keeps
+// sleep from adding latency between the frame and its publish. The time those locks are held
+// is the awake time per cycle; current draw is estimated from it with the figures below.
+#define POWER_ACTIVE_MA 45.0f           // 160 MHz running, radio in modem sleep (datasheet: 27-44 mA + bursts)
+#define POWER_IDLE_MA 30.0f             // Blocked at 160 MHz without light sleep
+#define POWER_SLEEP_MA 3.0f             // Light sleep, averaged over DTIM beacon wakeups
+#define POWER_SUPPLY_V 3.3f
+#define POWER_LISTEN_INTERVAL 3         // Beacon intervals between wakeups in modem sleep (~307 ms)
+
+static struct {
+    bool light_sleep;                   // DFS and automatic light sleep configured
+    int awake_depth;                    // Nested power_awake_begin() calls
+#if CONFIG_PM_ENABLE
+    esp_pm_lock_handle_t no_sleep_lock;
+    esp_pm_lock_handle_t apb_lock;
+#endif
+    int64_t cycle_start_us;             // Start of the previous poll cycle
+    uint32_t awake_us;                  // Last complete cycle
+    uint32_t period_us;
+    uint32_t publish_latency_us;        // Frame completion to telemetry queued, last sample
+    uint32_t max_publish_latency_us;
+    float avg_ma;                       // Estimated over the last cycle
+    double energy_mwh;                  // Estimated since boot
+} power;
+
+static void power_init(void) {
+    if (!power_save_enabled) {
+        return;
+    }
+    // listen_interval is part of the station config (see wifi_link_apply_config())
+    esp_wifi_set_ps(WIFI_PS_MAX_MODEM);
+#if CONFIG_PM_ENABLE
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_XTAL_FREQ,
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+        .light_sleep_enable = true,
+#endif
+    };
+    esp_err_t err = esp_pm_configure(&pm_config);
+    if (err == ESP_OK) {
+        esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "bms_cycle", &power.no_sleep_lock);
+        esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "bms_uart", &power.apb_lock);
+        power.light_sleep = pm_config.light_sleep_enable;
+        if (power.light_sleep) {
+            // Lets a boot button press wake the chip so its interrupt is seen (see "Boot path")
+            gpio_wakeup_enable(BOOT_BTN_GPIO, GPIO_INTR_LOW_LEVEL);
+            esp_sleep_enable_gpio_wakeup();
+        }
+        ESP_LOGI(TAG, "Power management: %d-%d MHz, light sleep %s", pm_config.min_freq_mhz,
+                 pm_config.max_freq_mhz, power.light_sleep ? "on" : "off (needs CONFIG_FREERTOS_USE_TICKLESS_IDLE)");
+    } else {
+        ESP_LOGW(TAG, "esp_pm_configure failed: %s", esp_err_to_name(err));
+    }
+#else
+    ESP_LOGW(TAG, "Power save: CONFIG_PM_ENABLE is off, only Wi-Fi modem sleep is used");
+#endif
+}
+
+// Keeps the chip awake and the UART clock fixed until the matching power_awake_end()
+static void power_awake_begin(void) {
+    if (power.awake_depth++ == 0) {
+#if CONFIG_PM_ENABLE
+        if (power.no_sleep_lock) {
+            esp_pm_lock_acquire(power.no_sleep_lock);
+            esp_pm_lock_acquire(power.apb_lock);
+        }
+#endif
+    }
+}
+
+static void power_awake_end(void) {
+    if (power.awake_depth > 0 && --power.awake_depth == 0) {
+#if CONFIG_PM_ENABLE
+        if (power.no_sleep_lock) {
+            esp_pm_lock_release(power.apb_lock);
+            esp_pm_lock_release(power.no_sleep_lock);
+        }
+#endif
+    }
+}
+
+// Closes the accounting for one poll cycle: awake from cycle_start_us until now, and asleep
+// (or idle) for the rest of the period since the previous cycle started
+static void power_account_cycle(int64_t cycle_start_us) {
+    int64_t now_us = esp_timer_get_time();
+    if (power.cycle_start_us > 0 && cycle_start_us > power.cycle_start_us) {
+        uint32_t period_us = (uint32_t)(cycle_start_us - power.cycle_start_us);
+        uint32_t awake_us = power.awake_us < period_us ? power.awake_us : period_us;
+        float rest_ma = power.light_sleep ? POWER_SLEEP_MA : POWER_IDLE_MA;
+        power.period_us = period_us;
+        power.avg_ma = (POWER_ACTIVE_MA * awake_us + rest_ma * (period_us - awake_us)) / period_us;
+        power.energy_mwh += power.avg_ma * POWER_SUPPLY_V * (period_us / 3.6e9);
+    }
+    power.cycle_start_us = cycle_start_us;
+    power.awake_us = (uint32_t)(now_us - cycle_start_us);
+}
+
+// ============================================================
+// Bus transaction scheduler
+// ============================================================
+// Every exchange goes through bms_transact(), which is only ever called from the BMS loop, so
+// there is never more than one transaction outstanding and each one ends at the reader's
+// deadline. The work of a poll cycle is queued as jobs in bms_sched (src/bms_sched.h): one per
+// single-ID read, or a read-all, plus the fallback and retries they turn into. MQTT commands
+// join the queue as safety jobs and link recovery queues baud probes as diagnostics.
+// bms_sched_run() always runs the highest-priority job next, first in first out within a class,
+// and takes in new commands before each job, so a load-shedding command waits for at most one
+// in-flight exchange rather than a whole poll cycle. Per-priority latency (request to response)
+// is kept as a histogram and checked against a deadline for each class.
+#define BMS_BUS_HIST_BUCKETS 7
+static const uint16_t bms_bus_hist_bounds_ms[BMS_BUS_HIST_BUCKETS - 1] = { 25, 50, 100, 200, 400, 800 };
+static const uint16_t bms_prio_deadline_ms[BMS_PRIO_COUNT] = { 500, 250, 1000, 2000 };
+static const char *bms_prio_names[BMS_PRIO_COUNT] = { "safety", "fast", "full", "diag" };
+
+static struct {
+    uint32_t count;
+    uint32_t failed;                    // Exchanges that did not return a valid frame
+    uint32_t deadline_misses;
+    uint32_t preempted;                 // Jobs of a higher class run while this class had jobs queued
+    uint32_t max_ms;
+    uint32_t last_ms;
+    uint32_t hist[BMS_BUS_HIST_BUCKETS];
+} bms_bus[BMS_PRIO_COUNT];
+
+typedef enum {
+    BMS_JOB_READ_ID = 0,                // arg: register ID, part of the fast set
+    BMS_JOB_READ_ALL,                   // arg: retry number, 0 for the first read-all of a slot
+    BMS_JOB_CMD,                        // arg: command slot, see bms_sched_add_command()
+    BMS_JOB_PROBE,                      // Baud rate probe
+} bms_job_kind_t;
+
+static bms_sched_t bms_sched;
+
+static void bms_sched_run(void);
+
+static void bms_bus_record(bms_prio_t prio, int64_t issued_us, bms_frame_status_t status) {
+    uint32_t ms = (uint32_t)((esp_timer_get_time() - issued_us) / 1000);
+    int bucket = 0;
+    while (bucket < BMS_BUS_HIST_BUCKETS - 1 && ms >= bms_bus_hist_bounds_ms[bucket]) {
+        bucket++;
+    }
+    bms_bus[prio].count++;
+    bms_bus[prio].hist[bucket]++;
+    bms_bus[prio].last_ms = ms;
+    if (ms > bms_bus[prio].max_ms) {
+        bms_bus[prio].max_ms = ms;
+    }
+    if (status != BMS_FRAME_OK) {
+        bms_bus[prio].failed++;
+    }
+    if (ms > bms_prio_deadline_ms[prio]) {
+        bms_bus[prio].deadline_misses++;
+        if (debug_logging) ESP_LOGW(TAG, "Bus %s transaction took %lu ms (deadline %u ms)", bms_prio_names[prio], ms, bms_prio_deadline_ms[prio]);
+    }
+}
+
+static bms_frame_status_t bms_transact(bms_prio_t prio, const uint8_t *frame, size_t frame_len, uint16_t request) {
+    power_awake_begin();
+    int64_t issued_us = esp_timer_get_time();
+    send_bms_command(frame, frame_len);
+    bms_frame_status_t status = read_bms_data(request);
+    bms_bus_record(prio, issued_us, status);
+    power_awake_end();
+    return status;
+}
+
+// Sends the read-all command and reads the response. Any transceiver echo is skipped by the reader.
+static bms_frame_status_t bms_read_all_transaction(bms_prio_t prio) {
+    if (debug_logging) {
+        ESP_LOGI(TAG, "Sending '%s' command to BMS...", "Read All Data");
+    }
+    return bms_transact(prio, bms_read_all_cmd, sizeof(bms_read_all_cmd), 0);
+}
+
+// The sample slot the queued poll jobs of the current cycle are filling
+static struct {
+    bool fast;                          // Filled by single-ID reads (no fallback so far)
+    bms_frame_status_t status;          // Outcome of the last poll job
+    int retries;                        // Read-all re-polls after corrupt responses
+} bms_slot;
+
+static void bms_count_corrupt(bms_frame_status_t status) {
+    if (status == BMS_FRAME_CRC_ERROR) {
+        bms_link.crc_errors++;
+    } else if (status == BMS_FRAME_MALFORMED) {
+        bms_link.malformed++;
+    }
+}
+
+// BMS_JOB_READ_ID: one live ID of the fast set. Any failure fills the slot with a read-all instead.
+static void bms_slot_read_id(uint8_t id) {
+    uint8_t cmd[24];
+    size_t cmd_len = bms_build_frame(cmd, BMS_CMD_READ_ID, 0x00, &id, 1);
+    bms_slot.status = bms_transact(BMS_PRIO_FAST, cmd, cmd_len, id);
+    if (bms_slot.status == BMS_FRAME_OK) {
+        return;
+    }
+    bms_count_corrupt(bms_slot.status);
+    bms_tier.fallbacks++;
+    bms_slot.fast = false;
+    ESP_LOGW(TAG, "Single-ID poll of 0x%02X failed (status %d), falling back to read-all", id, bms_slot.status);
+    bms_sched_cancel(&bms_sched, BMS_JOB_READ_ID);
+    bms_sched_push(&bms_sched, BMS_PRIO_FULL, BMS_JOB_READ_ALL, 0);
+}
+
+// BMS_JOB_READ_ALL: the slot's read-all, or a re-poll after a corrupt response
+static void bms_slot_read_all(int retry) {
+    int64_t retry_start = esp_timer_get_time();
+    if (retry > 0) {
+        uart_flush_input(UART_NUM);
+        vTaskDelay(pdMS_TO_TICKS(BMS_RETRY_GAP_MS)); // Let the bus go idle before re-polling
+        ESP_LOGW(TAG, "Corrupt BMS response, retry %d/%d", retry, BMS_CORRUPT_RETRY_BUDGET);
+    }
+    bms_slot.status = bms_read_all_transaction(BMS_PRIO_FULL);
+    if (retry > 0) {
+        uint32_t retry_ms = (uint32_t)((esp_timer_get_time() - retry_start) / 1000);
+        bms_link.last_retry_ms = retry_ms;
+        bms_link.retry_ms_total += retry_ms;
+        if (retry_ms > bms_link.max_retry_ms) {
+            bms_link.max_retry_ms = retry_ms;
+        }
+        esp_task_wdt_reset();
+    }
+    if ((bms_slot.status == BMS_FRAME_CRC_ERROR || bms_slot.status == BMS_FRAME_MALFORMED) &&
+        retry < BMS_CORRUPT_RETRY_BUDGET) {
+        bms_count_corrupt(bms_slot.status);
+        bms_slot.retries = retry + 1;
+        bms_link.retries++;
+        bms_sched_push(&bms_sched, BMS_PRIO_FULL, BMS_JOB_READ_ALL, (uint16_t)(retry + 1));
+    }
+}
+
+// Runs one sample slot: the fast set of single-ID reads or a read-all, queued as jobs, with a
+// read-all fallback if a single read fails and up to BMS_CORRUPT_RETRY_BUDGET immediate re-polls
+// if a read-all response was corrupt; then the per-sample processing and publish.
+// A BMS that does not answer at all is not retried; that is left to the next slot.
+static void bms_poll_cycle(void) {
+    int64_t cycle_start = esp_timer_get_time();
+    power_awake_begin();
+    bms_wire.cycle_tx_bytes = 0;
+    bms_wire.cycle_rx_bytes = 0;
+    bms_wire.cycle_bus_us = 0;
+    bms_slot.fast = bms_tier_use_fast();
+    bms_slot.status = BMS_FRAME_NO_DATA;
+    bms_slot.retries = 0;
+    if (bms_slot.fast) {
+        for (size_t i = 0; i < BMS_FAST_IDS_COUNT; ++i) {
+            bms_sched_push(&bms_sched, BMS_PRIO_FAST, BMS_JOB_READ_ID, bms_fast_ids[i]);
+        }
+    } else {
+        bms_sched_push(&bms_sched, BMS_PRIO_FULL, BMS_JOB_READ_ALL, 0);
+    }
+    bms_sched_run();
+    bool fast = bms_slot.fast;
+    bms_frame_status_t status = bms_slot.status;
+    int retries = bms_slot.retries;
+    if (status == BMS_FRAME_CRC_ERROR) {
+        bms_link.crc_errors++;
+    } else if (status == BMS_FRAME_MALFORMED) {
+        bms_link.malformed++;
+    }
+    if (retries > 0) {
+        if (status == BMS_FRAME_OK) {
+            bms_link.recovered++;
+            ESP_LOGI(TAG, "BMS response recovered after %d retr%s", retries, retries == 1 ? "y" : "ies");
+        } else {
+            bms_link.slots_lost++;
+            ESP_LOGE(TAG, "No valid BMS response after %d retries, sample slot lost", retries);
+        }
+    }
+
+    bms_tier_account(fast, status);
+
+    // Wire time is known now; cycle time is closed after the publish and reported next cycle
+    bms_wire.last_tx_bytes = bms_wire.cycle_tx_bytes;
+    bms_wire.last_rx_bytes = bms_wire.cycle_rx_bytes;
+    bms_wire.last_wire_us = uart_wire_time_us(bms_wire.cycle_tx_bytes + bms_wire.cycle_rx_bytes, bms_baud_active);
+
+    resources_tick();
+
+    // Only publish data that passed the checksum and contains cells
+    if (status == BMS_FRAME_OK) {
+        bms_last_sample_us = esp_timer_get_time();
+        boot_mark(&boot_marks.first_sample_us);
+        energy_accumulate(&current_bms_data);
+        anomaly_evaluate(&current_bms_data);
+        bms_flags_track(&current_bms_data);
+        if (debug_logging) printf("[DEBUG] Calling publish_bms_data_mqtt...\n");
+        publish_bms_data_mqtt(&current_bms_data);
+        publish_fanout_mqtt(&current_bms_data);
+        publish_batch_mqtt(&current_bms_data);
+        if (debug_logging) printf("[DEBUG] publish_bms_data_mqtt returned\n");
+    } else {
+        if (debug_logging) printf("[DEBUG] Not publishing - no valid cell data (status %d)\n", status);
+        publish_batch_mqtt(NULL); // A pending batch still goes out on time while the BMS is silent
+    }
+    bms_wire.last_cycle_us = (uint32_t)(esp_timer_get_time() - cycle_start);
+    rtc_snapshot_save();
+    power_account_cycle(cycle_start);
+    power_awake_end();
+}
+
+// Tries each candidate baud rate, fastest first, and keeps the first one that yields a frame
+// with a valid checksum. Falls back to DEFAULT_BMS_BAUD if none answers.
+static void bms_baud_autoprobe(void) {
+    uint32_t saved_deadline = bms_latency.deadline_ms;
+    uint32_t saved_timeouts = bms_latency.timeouts;
+    uint32_t found = 0;
+    bms_baud_probing = true;
+    for (size_t i = 0; i < BMS_BAUD_CANDIDATES_COUNT && !found; ++i) {
+        uint32_t baud = bms_baud_candidates[i];
+        uart_set_baudrate(UART_NUM, baud);
+        uart_flush_input(UART_NUM);
+        vTaskDelay(pdMS_TO_TICKS(BMS_RETRY_GAP_MS)); // Let the BMS discard any partial byte
+        bms_latency.deadline_ms = BMS_BAUD_PROBE_DEADLINE_MS;
+        bms_frame_status_t status = bms_read_all_transaction(BMS_PRIO_DIAG);
+        ESP_LOGI(TAG, "Baud probe %lu: %s", baud, status == BMS_FRAME_OK || status == BMS_FRAME_NO_CELLS ? "valid frame" : "no valid frame");
+        if (status == BMS_FRAME_OK || status == BMS_FRAME_NO_CELLS) {
+            found = baud;
+        }
+        esp_task_wdt_reset();
+    }
+    bms_baud_probing = false;
+    bms_baud_active = found ? found : DEFAULT_BMS_BAUD;
+    bms_wire.probed = found != 0;
+    uart_set_baudrate(UART_NUM, bms_baud_active);
+    uart_flush_input(UART_NUM);
+    bms_latency.deadline_ms = saved_deadline;
+    bms_latency.timeouts = saved_timeouts;
+    if (found) {
+        ESP_LOGI(TAG, "BMS baud rate auto-detected: %lu", bms_baud_active);
+    } else {
+        ESP_LOGW(TAG, "BMS baud rate auto-probe found no answer, using %lu", bms_baud_active);
+    }
+}
+
+// ============================================================
+// Time synchronisation
+// ============================================================
+// Samples are stamped with esp_timer_get_time() when their frame completes. That clock is
+// monotonic and never jumps, so it is kept as the time base and mapped to UTC through an offset
+// learned from SNTP: UTC = monotonic + offset(monotonic).
+// The offset is not replaced outright at a sync, which would step the UTC times of consecutive
+// samples. The crystal drift measured between the last two syncs is applied as a rate, and the
+// error the mapping still had at the sync (the correction) is slewed in over TIME_SLEW_MS.
+// Only the first sync, or a correction above TIME_STEP_LIMIT_US, steps the mapping.
+// Until the first sync, samples have no UTC time and consumers fall back to arrival time.
+#define TIME_SYNC_INTERVAL_MS (15 * 60 * 1000)
+#define TIME_SLEW_MS 60000
+#define TIME_STEP_LIMIT_US 500000
+#define TIME_MAX_DRIFT_PPM 200.0f       // Anything larger is a bad sync, not the crystal
+
+static struct {
+    int64_t offset_us;                  // Measured UTC minus monotonic at the last sync, valid once syncs > 0
+    int64_t synced_mono_us;             // Monotonic time of the last sync
+    int64_t slew_from_us;               // Mapped offset at the last sync, slewed to the measured one
+    int64_t last_correction_us;         // Measured offset minus mapped offset at the last sync
+    float drift_ppm;                    // Offset change per monotonic time between the last two syncs
+    uint32_t syncs;
+    bool started;
+} time_sync;
+
+// Offset for a monotonic time under the current mapping; call with time_sync_lock held
+static int64_t time_sync_offset_at(int64_t mono_us) {
+    int64_t since_us = mono_us - time_sync.synced_mono_us;
+    if (since_us <= 0) {
+        return time_sync.slew_from_us;
+    }
+    int64_t slew_us = (int64_t)TIME_SLEW_MS * 1000;
+    if (since_us >= slew_us) {
+        return time_sync.offset_us + (int64_t)((double)since_us * time_sync.drift_ppm * 1e-6);
+    }
+    int64_t slew_end_us = time_sync.offset_us + (int64_t)((double)slew_us * time_sync.drift_ppm * 1e-6);
+    return time_sync.slew_from_us + (slew_end_us - time_sync.slew_from_us) * since_us / slew_us;
+}
+static portMUX_TYPE time_sync_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Runs in the lwIP task each time SNTP has set the system clock
+static void time_sync_notification(struct timeval *tv) {
+    int64_t mono_us = esp_timer_get_time();
+    int64_t utc_us = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+    int64_t offset_us = utc_us - mono_us;
+    bool step = true;
+    taskENTER_CRITICAL(&time_sync_lock);
+    if (time_sync.syncs > 0) {
+        int64_t mapped_us = time_sync_offset_at(mono_us);
+        time_sync.last_correction_us = offset_us - mapped_us;
+        int64_t correction_us = time_sync.last_correction_us;
+        step = (correction_us < 0 ? -correction_us : correction_us) > TIME_STEP_LIMIT_US;
+        if (!step) {
+            // A stepped sync is a clock jump or a bad sample, not crystal drift: keep the old rate
+            int64_t since_us = mono_us - time_sync.synced_mono_us;
+            float drift_ppm = since_us > 0 ? (float)(offset_us - time_sync.offset_us) * 1e6f / (float)since_us : 0.0f;
+            time_sync.drift_ppm = fmaxf(-TIME_MAX_DRIFT_PPM, fminf(TIME_MAX_DRIFT_PPM, drift_ppm));
+        }
+        time_sync.slew_from_us = step ? offset_us : mapped_us;
+    } else {
+        time_sync.slew_from_us = offset_us;
+    }
+    time_sync.offset_us = offset_us;
+    time_sync.synced_mono_us = mono_us;
+    time_sync.syncs++;
+    taskEXIT_CRITICAL(&time_sync_lock);
+    ESP_LOGI(TAG, "SNTP sync #%lu, correction %lld ms (%s), drift %.1f ppm", time_sync.syncs,
+             time_sync.last_correction_us / 1000, step ? "stepped" : "slewed", time_sync.drift_ppm);
+}
+
+// Called on every IP_EVENT_STA_GOT_IP; SNTP is only started once and keeps running across reconnects
+static void time_sync_start(void) {
+    if (time_sync.started || !ntp_server[0]) {
+        return;
+    }
+    esp_sntp_setoperatingmode(ESP_SNTP_OPMODE_POLL);
+    esp_sntp_setservername(0, ntp_server);
+    sntp_set_sync_interval(TIME_SYNC_INTERVAL_MS);
+    sntp_set_time_sync_notification_cb(time_sync_notification);
+    esp_sntp_init();
+    time_sync.started = true;
+    ESP_LOGI(TAG, "SNTP started with server '%s'", ntp_server);
+}
+
+// UTC in ms for a monotonic timestamp, or 0 before the first sync
+static int64_t time_utc_ms(int64_t mono_us) {
+    int64_t offset_us;
+    uint32_t syncs;
+    taskENTER_CRITICAL(&time_sync_lock);
+    offset_us = time_sync_offset_at(mono_us);
+    syncs = time_sync.syncs;
+    taskEXIT_CRITICAL(&time_sync_lock);
+    return syncs > 0 ? (mono_us + offset_us) / 1000 : 0;
+}
+
+// Writes the UTC ms of a monotonic timestamp as a JSON value: a number, or null before the first sync
+static const char *time_utc_json(int64_t mono_us, char *out, size_t len) {
+    int64_t utc_ms = time_utc_ms(mono_us);
+    if (utc_ms) {
+        snprintf(out, len, "%lld", (long long)utc_ms);
+    } else {
+        snprintf(out, len, "null");
+    }
+    return out;
+}
+
+// ============================================================
+// Output streams
+// ============================================================
+// Each kind of message the gateway publishes is an output stream with its own QoS, retain flag,
+// topic template and encoding, stored in NVS as "qos,retain,encoding,template" under out_<name>.
+// Templates may use %topic% (BMS Topic), %pack% (pack name, made topic-safe), %node% (BMS Topic
+// as a single topic-safe level) and the per-message variable of the stream, %cell% or %field%,
+// if it has one. Templates with any other variable are rejected when saved or loaded. They are
+// expanded once when MQTT starts; a per-message topic is then just prefix + variable + suffix.
+// Defaults reproduce the fixed topics used before the table existed; fan-out and batch streams start off.
+typedef enum {
+    OUT_TELEMETRY = 0,
+    OUT_ALERTS,
+    OUT_EVENTS,
+    OUT_CMD_RESULT,
+    OUT_PACK_FIELDS,                    // Fan-out: one scalar per pack metric
+    OUT_CELL_FIELDS,                    // Fan-out: one scalar per cell
+    OUT_DISCOVERY,                      // Home Assistant MQTT discovery configs for the fan-out topics
+    OUT_BATCH,                          // Several samples per message, see publish_batch_mqtt()
+    OUT_STREAM_COUNT
+} out_stream_id_t;
+
+typedef enum {
+    OUT_ENC_OFF = 0,                    // Stream disabled
+    OUT_ENC_JSON,                       // Documents as JSON; fan-out scalars as {"value":x}
+    OUT_ENC_RAW,                        // Fan-out scalars as plain text; same as json for documents
+    OUT_ENC_BINARY,                     // Batches as packed little-endian records; same as raw elsewhere
+    OUT_ENC_COUNT
+} out_encoding_t;
+
+static const char *out_encoding_names[OUT_ENC_COUNT] = { "off", "json", "raw", "binary" };
+
+#define OUT_TEMPLATE_MAX 64
+#define OUT_TOPIC_MAX 128
+#define OUT_TOPIC_VAR '\x01'            // Stands in for %cell% / %field% in an expanded template
+
+typedef struct {
+    const char *name;                   // Also the NVS key suffix and form field prefix
+    const char *var;                    // Per-message variable the template may use, NULL = none
+    uint8_t qos;
+    bool retain;
+    out_encoding_t encoding;
+    char topic_template[OUT_TEMPLATE_MAX];
+    char topic[OUT_TOPIC_MAX];          // Expanded template, or the part before the variable
+    char topic_suffix[OUT_TEMPLATE_MAX]; // Part after the variable
+    bool has_var;                       // Template contains %cell% or %field%
+} out_stream_t;
+
+// Alerts share one topic by default and are not retained: a retained message there would only
+// hold the last event of any rule. With %field% (the alert name) each rule gets its own topic,
+// and retaining them gives late subscribers the state of every rule.
+static out_stream_t out_streams[OUT_STREAM_COUNT] = {
+    [OUT_TELEMETRY]   = { "telemetry",  NULL,      1, false, OUT_ENC_JSON, "%topic%" },
+    [OUT_ALERTS]      = { "alerts",     "%field%", 1, false, OUT_ENC_JSON, "%topic%/alerts" },
+    [OUT_EVENTS]      = { "events",     NULL,      1, false, OUT_ENC_JSON, "%topic%/events" },
+    [OUT_CMD_RESULT]  = { "cmdResult",  NULL,      1, false, OUT_ENC_JSON, "%topic%/cmd/result" },
+    [OUT_PACK_FIELDS] = { "packFields", "%field%", 0, false, OUT_ENC_OFF,  "%topic%/pack/%field%" },
+    [OUT_CELL_FIELDS] = { "cellFields", "%cell%",  0, false, OUT_ENC_OFF,  "%topic%/cells/%cell%/mv" },
+    [OUT_DISCOVERY]   = { "discovery",  "%field%", 1, true,  OUT_ENC_OFF,  "homeassistant/sensor/%node%/%field%/config" },
+    [OUT_BATCH]       = { "batch",      NULL,      1, false, OUT_ENC_OFF,  "%topic%/batch" },
+};
+
+// A template is a single token with no spaces, MQTT wildcards or characters that would need
+// escaping in params.json, and uses only the static variables and the stream's own variable,
+// at most once: a topic is built as prefix + variable + suffix
+static bool out_template_valid(const out_stream_t *st, const char *tmpl) {
+    static const char *static_vars[] = { "%topic%", "%pack%", "%node%" };
+    int per_message = 0;
+    if (!tmpl[0] || strpbrk(tmpl, " +#,\"\\")) {
+        return false;
+    }
+    for (const char *p = strchr(tmpl, '%'); p; p = strchr(p, '%')) {
+        size_t n = 0;
+        for (size_t k = 0; k < sizeof(static_vars) / sizeof(static_vars[0]) && !n; ++k) {
+            if (strncmp(p, static_vars[k], strlen(static_vars[k])) == 0) {
+                n = strlen(static_vars[k]);
+            }
+        }
+        if (!n && st->var && strncmp(p, st->var, strlen(st->var)) == 0) {
+            n = strlen(st->var);
+            per_message++;
+        }
+        if (!n || per_message > 1) {
+            return false;               // Unknown variable, one this stream does not fill in, or a repeat
+        }
+        p += n;
+    }
+    return true;
+}
+
+// Expands the static substitutions of a template; %cell% and %field% become OUT_TOPIC_VAR
+static void out_topic_expand(const char *tmpl, char *out, size_t out_len) {
+    size_t n = 0;
+    static const char var[2] = { OUT_TOPIC_VAR, '\0' };
+    while (*tmpl && n + 1 < out_len) {
+        const char *sub = NULL;
+        bool sanitize = false;          // Names must not add topic levels
+        if (strncmp(tmpl, "%topic%", 7) == 0) {
+            sub = bms_topic;
+            tmpl += 7;
+        } else if (strncmp(tmpl, "%pack%", 6) == 0) {
+            sub = pack_name;
+            sanitize = true;
+            tmpl += 6;
+        } else if (strncmp(tmpl, "%node%", 6) == 0) {
+            sub = bms_topic;
+            sanitize = true;
+            tmpl += 6;
+        } else if (strncmp(tmpl, "%cell%", 6) == 0 || strncmp(tmpl, "%field%", 7) == 0) {
+            sub = var;
+            tmpl += tmpl[1] == 'c' ? 6 : 7;
+        }
+        if (!sub) {
+            out[n++] = *tmpl++;
+            continue;
+        }
+        for (; *sub && n + 1 < out_len; ++sub) {
+            char c = *sub;
+            out[n++] = (c == ' ' || c == '+' || c == '#' || (sanitize && c == '/')) ? '_' : c;
+        }
+    }
+    out[n] = '\0';
+}
+
+static void out_streams_resolve(void) {
+    for (int i = 0; i < OUT_STREAM_COUNT; ++i) {
+        out_stream_t *st = &out_streams[i];
+        out_topic_expand(st->topic_template, st->topic, sizeof(st->topic));
+        char *var = strchr(st->topic, OUT_TOPIC_VAR);
+        st->has_var = var != NULL;
+        st->topic_suffix[0] = '\0';
+        if (var) {
+            *var = '\0';
+            strncpy(st->topic_suffix, var + 1, sizeof(st->topic_suffix) - 1);
+            st->topic_suffix[sizeof(st->topic_suffix) - 1] = '\0';
+        }
+        ESP_LOGI(TAG, "Output %s: qos %u, retain %d, %s -> %s%s%s", st->name, st->qos, st->retain,
+                 out_encoding_names[st->encoding], st->topic, st->has_var ? "<var>" : "", st->topic_suffix);
+    }
+}
+
+// Builds the topic of a per-message stream from its precomputed prefix and suffix
+static void out_stream_topic(const out_stream_t *st, const char *var, char *out, size_t out_len) {
+    size_t prefix_len = strlen(st->topic);
+    size_t var_len = st->has_var ? strlen(var) : 0;
+    size_t suffix_len = strlen(st->topic_suffix);
+    if (prefix_len + var_len + suffix_len >= out_len) {
+        out[0] = '\0';
+        return;
+    }
+    memcpy(out, st->topic, prefix_len);
+    memcpy(out + prefix_len, var, var_len);
+    memcpy(out + prefix_len + var_len, st->topic_suffix, suffix_len + 1);
+}
+
+// Parses "qos,retain,encoding,template" into a stream; leaves it unchanged if malformed
+static bool out_stream_parse(out_stream_t *st, const char *spec) {
+    int qos = 0, retain = 0;
+    char enc[8] = "";
+    char tmpl[OUT_TEMPLATE_MAX] = "";
+    if (sscanf(spec, "%d,%d,%7[^,],%63s", &qos, &retain, enc, tmpl) != 4 || qos < 0 || qos > 1 ||
+        !out_template_valid(st, tmpl)) {
+        return false;
+    }
+    for (int e = 0; e < OUT_ENC_COUNT; ++e) {
+        if (strcmp(enc, out_encoding_names[e]) == 0) {
+            st->qos = (uint8_t)qos;
+            st->retain = retain != 0;
+            st->encoding = (out_encoding_t)e;
+            strncpy(st->topic_template, tmpl, sizeof(st->topic_template) - 1);
+            st->topic_template[sizeof(st->topic_template) - 1] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+static void out_stream_nvs_key(const out_stream_t *st, char *key, size_t key_len) {
+    snprintf(key, key_len, "out_%s", st->name);
+}
+
+void load_output_streams_from_nvs() {
+    nvs_handle_t nvs_handle;
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK) {
+        return;
+    }
+    for (int i = 0; i < OUT_STREAM_COUNT; ++i) {
+        char key[16];
+        char spec[96];
+        size_t spec_len = sizeof(spec);
+        out_stream_nvs_key(&out_streams[i], key, sizeof(key));
+        if (nvs_get_str(nvs_handle, key, spec, &spec_len) == ESP_OK && !out_stream_parse(&out_streams[i], spec)) {
+            ESP_LOGW(TAG, "Ignoring malformed output setting %s='%s'", key, spec);
+        }
+    }
+    nvs_close(nvs_handle);
+}
+
+// Queues a message on a stream with its QoS and retain flag, without flow control. topic is NULL
+// for the stream's own topic, or a topic built with out_stream_topic(). Never waits on the network.
+// Returns the msg_id (0 for QoS 0), or -1 on failure or if the stream is off.
+static int out_enqueue(out_stream_id_t id, const char *topic, const char *payload, int len) {
+    const out_stream_t *st = &out_streams[id];
+    if (!mqtt_client || st->encoding == OUT_ENC_OFF || (!topic && st->has_var)) {
+        return -1;
+    }
+    int msg_id = esp_mqtt_client_enqueue(mqtt_client, topic ? topic : st->topic, payload, len, st->qos, st->retain, true);
+    // A QoS 0 send while connected gets no confirmation to wait for
+    if (msg_id >= 0 && (st->qos > 0 || !mqtt_connected)) {
+        publish_unconfirmed = true;
+    }
+    return msg_id;
+}
+
+// Flow-controlled publish, see the telemetry publish path
+static int out_publish_to(out_stream_id_t id, const char *topic, const char *payload, int len);
+static int out_publish(out_stream_id_t id, const char *payload, int len);
+
+// ============================================================
+// MQTT write commands
+// ============================================================
+// Commands arrive on <bms_topic>/cmd as {"token":"...","target":"chargeMos","value":0}. The MQTT
+// task only validates them and hands them to the BMS loop through a queue; the loop runs them
+// while it waits for the next sample, or ahead of the next exchange if a poll is in progress.
+// Each write is followed by a single-ID read of the same register, and the outcome is published
+// on <bms_topic>/cmd/result with the end-to-end latency from MQTT receipt to read-back.
+// Only the MOS switches are writable: current BMS firmware ignores writes to anything else.
+#define BMS_CMD_QUEUE_LEN 4
+#define BMS_CMD_TOKEN_MAX 32
+#define BMS_CMD_TOKEN_RING 16           // Recent tokens remembered for duplicate suppression
+#define BMS_CMD_RATE_BURST 4            // Commands accepted back to back
+#define BMS_CMD_RATE_REFILL_MS 1000     // One more command allowed per interval after a burst
+
+typedef struct {
+    const char *name;
+    uint8_t id;
+} bms_cmd_target_t;
+
+static const bms_cmd_target_t bms_cmd_targets[] = {
+    { "chargeMos", 0xAB },
+    { "dischargeMos", 0xAC },
+};
+#define BMS_CMD_TARGETS_COUNT (sizeof(bms_cmd_targets)/sizeof(bms_cmd_targets[0]))
+
+typedef struct {
+    char token[BMS_CMD_TOKEN_MAX + 1];
+    const bms_cmd_target_t *target;
+    uint8_t value;
+    int64_t received_us;
+} bms_cmd_t;
+
+// Tokens seen recently and the outcome of each, shared by the MQTT task and the BMS loop
+static struct {
+    char token[BMS_CMD_TOKEN_RING][BMS_CMD_TOKEN_MAX + 1];
+    const char *outcome[BMS_CMD_TOKEN_RING];
+    int next;
+} bms_cmd_tokens;
+static portMUX_TYPE bms_cmd_tokens_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static struct {
+    uint32_t accepted;
+    uint32_t confirmed;
+    uint32_t failed;                    // Executed but not confirmed by the read-back
+    uint32_t rejected;                  // Malformed, unknown target or queue full
+    uint32_t rate_limited;
+    uint32_t duplicates;
+    uint32_t last_latency_ms;
+    int rate_tokens;
+    int64_t rate_refill_us;
+} bms_cmd_stats = { .rate_tokens = BMS_CMD_RATE_BURST };
+// The MQTT task counts submissions, the BMS loop counts outcomes and the publish reads them all
+static portMUX_TYPE bms_cmd_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void bms_cmd_count(uint32_t *counter) {
+    taskENTER_CRITICAL(&bms_cmd_stats_lock);
+    (*counter)++;
+    taskEXIT_CRITICAL(&bms_cmd_stats_lock);
+}
+
+// Publishes one outcome on <bms_topic>/cmd/result. readback < 0 means no value was read back.
+static void bms_cmd_publish_result(const char *token, const char *target, int value, const char *status,
+                                   const char *detail, int readback, bool ack, int64_t received_us) {
+    if (!mqtt_client) {
+        return;
+    }
+    char payload[320];
+    char readback_str[8];
+    if (readback < 0) {
+        snprintf(readback_str, sizeof(readback_str), "null");
+    } else {
+        snprintf(readback_str, sizeof(readback_str), "%d", readback);
+    }
+    int len = snprintf(payload, sizeof(payload),
+                       "{\"packName\":\"%s\",\"token\":\"%s\",\"target\":\"%s\",\"value\":%d,\"status\":\"%s\","
+                       "\"detail\":\"%s\",\"ack\":%s,\"readback\":%s,\"latencyMs\":%.1f}",
+                       pack_name, token, target, value, status, detail, ack ? "true" : "false", readback_str,
+                       (esp_timer_get_time() - received_us) / 1000.0);
+    if (len >= (int)sizeof(payload)) {
+        len = sizeof(payload) - 1;
+    }
+    out_publish(OUT_CMD_RESULT, payload, len);
+}
+
+// Looks a token up in the recent ring. Returns its recorded outcome, or NULL if it is new, in
+// which case it is recorded as pending.
+static const char *bms_cmd_token_claim(const char *token) {
+    const char *outcome = NULL;
+    taskENTER_CRITICAL(&bms_cmd_tokens_lock);
+    for (int i = 0; i < BMS_CMD_TOKEN_RING; ++i) {
+        if (bms_cmd_tokens.outcome[i] && strcmp(bms_cmd_tokens.token[i], token) == 0) {
+            outcome = bms_cmd_tokens.outcome[i];
+            break;
+        }
+    }
+    if (!outcome) {
+        int slot = bms_cmd_tokens.next;
+        strncpy(bms_cmd_tokens.token[slot], token, BMS_CMD_TOKEN_MAX);
+        bms_cmd_tokens.token[slot][BMS_CMD_TOKEN_MAX] = '\0';
+        bms_cmd_tokens.outcome[slot] = "pending";
+        bms_cmd_tokens.next = (slot + 1) % BMS_CMD_TOKEN_RING;
+    }
+    taskEXIT_CRITICAL(&bms_cmd_tokens_lock);
+    return outcome;
+}
+
+static void bms_cmd_token_settle(const char *token, const char *outcome) {
+    taskENTER_CRITICAL(&bms_cmd_tokens_lock);
+    for (int i = 0; i < BMS_CMD_TOKEN_RING; ++i) {
+        if (bms_cmd_tokens.outcome[i] && strcmp(bms_cmd_tokens.token[i], token) == 0) {
+            bms_cmd_tokens.outcome[i] = outcome;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&bms_cmd_tokens_lock);
+}
+
+// Token bucket: BMS_CMD_RATE_BURST back to back, then one per BMS_CMD_RATE_REFILL_MS
+static bool bms_cmd_rate_allow(int64_t now_us) {
+    int64_t refill_us = (int64_t)BMS_CMD_RATE_REFILL_MS * 1000;
+    bool allow = false;
+    taskENTER_CRITICAL(&bms_cmd_stats_lock);
+    if (bms_cmd_stats.rate_tokens >= BMS_CMD_RATE_BURST) {
+        bms_cmd_stats.rate_refill_us = now_us;
+    }
+    while (bms_cmd_stats.rate_tokens < BMS_CMD_RATE_BURST && now_us - bms_cmd_stats.rate_refill_us >= refill_us) {
+        bms_cmd_stats.rate_tokens++;
+        bms_cmd_stats.rate_refill_us += refill_us;
+    }
+    if (bms_cmd_stats.rate_tokens > 0) {
+        bms_cmd_stats.rate_tokens--;
+        allow = true;
+    }
+    taskEXIT_CRITICAL(&bms_cmd_stats_lock);
+    return allow;
+}
+
+// Called from the MQTT event handler with the raw payload of a <bms_topic>/cmd message.
+// Never touches the UART; accepted commands are queued for the BMS loop.
+static void bms_cmd_submit(const char *data, int data_len) {
+    int64_t now_us = esp_timer_get_time();
+    cJSON *root = cJSON_ParseWithLength(data, data_len);
+    const cJSON *token = root ? cJSON_GetObjectItem(root, "token") : NULL;
+    const cJSON *target = root ? cJSON_GetObjectItem(root, "target") : NULL;
+    const cJSON *value = root ? cJSON_GetObjectItem(root, "value") : NULL;
+    const char *token_str = cJSON_IsString(token) ? token->valuestring : "";
+    const char *target_str = cJSON_IsString(target) ? target->valuestring : "";
+    // valueint truncates, so 1.5 would pass as 1: only an exact 0 or 1 (or a bool) is a value
+    int value_int = -1;
+    if (cJSON_IsBool(value)) {
+        value_int = cJSON_IsTrue(value) ? 1 : 0;
+    } else if (cJSON_IsNumber(value) && (value->valuedouble == 0.0 || value->valuedouble == 1.0)) {
+        value_int = (int)value->valuedouble;
+    }
+
+    bms_cmd_t cmd = { .received_us = now_us, .value = (uint8_t)value_int };
+    const char *reject = NULL;
+    if (!root) {
+        reject = "invalid JSON";
+    } else if (token_str[0] == '\0' || strlen(token_str) > BMS_CMD_TOKEN_MAX) {
+        reject = "token missing or longer than 32 characters";
+    } else if (strpbrk(token_str, "\"\\") != NULL) {
+        reject = "token contains quotes or backslashes";
+    } else if (value_int != 0 && value_int != 1) {
+        reject = "value must be 0/1 or false/true";
+    } else {
+        for (size_t i = 0; i < BMS_CMD_TARGETS_COUNT; ++i) {
+            if (strcmp(target_str, bms_cmd_targets[i].name) == 0) {
+                cmd.target = &bms_cmd_targets[i];
+            }
+        }
+        if (!cmd.target) {
+            reject = "unknown target";
+        }
+    }
+    // Echo only tokens that are safe to put back into JSON
+    if (strlen(token_str) > BMS_CMD_TOKEN_MAX || strpbrk(token_str, "\"\\") != NULL) {
+        token_str = "";
+    }
+    if (!cmd.target) {
+        target_str = "";
+    }
+
+    if (reject) {
+        bms_cmd_count(&bms_cmd_stats.rejected);
+        ESP_LOGW(TAG, "MQTT command rejected: %s", reject);
+        bms_cmd_publish_result(token_str, target_str, value_int, "rejected", reject, -1, false, now_us);
+    } else {
+        const char *previous = bms_cmd_token_claim(token_str);
+        if (previous) {
+            // Same token again: report what happened the first time and do nothing else
+            bms_cmd_count(&bms_cmd_stats.duplicates);
+            bms_cmd_publish_result(token_str, target_str, value_int, "duplicate", previous, -1, false, now_us);
+        } else if (!bms_cmd_rate_allow(now_us)) {
+            bms_cmd_count(&bms_cmd_stats.rate_limited);
+            bms_cmd_token_settle(token_str, "rateLimited");
+            ESP_LOGW(TAG, "MQTT command %s rate limited", token_str);
+            bms_cmd_publish_result(token_str, target_str, value_int, "rateLimited", "too many commands", -1, false, now_us);
+        } else {
+            strncpy(cmd.token, token_str, BMS_CMD_TOKEN_MAX);
+            if (!bms_cmd_queue || xQueueSend(bms_cmd_queue, &cmd, 0) != pdTRUE) {
+                bms_cmd_count(&bms_cmd_stats.rejected);
+                bms_cmd_token_settle(token_str, "rejected");
+                bms_cmd_publish_result(token_str, target_str, value_int, "rejected", "command queue full", -1, false, now_us);
+            } else {
+                bms_cmd_count(&bms_cmd_stats.accepted);
+                ESP_LOGI(TAG, "MQTT command %s queued: %s=%d", token_str, target_str, value_int);
+            }
+        }
+    }
+    cJSON_Delete(root);
+}
+
+// Runs one queued command on the bus: write, then read the register back to confirm it
+static void bms_cmd_execute(const bms_cmd_t *cmd) {
+    uint8_t data[2] = { cmd->target->id, cmd->value };
+    uint8_t frame[24];
+    size_t frame_len = bms_build_frame(frame, BMS_CMD_WRITE_ID, BMS_FRAME_TYPE_WRITE, data, sizeof(data));
+    bool ack = bms_transact(BMS_PRIO_SAFETY, frame, frame_len, BMS_REQUEST_WRITE_ACK) == BMS_FRAME_OK;
+
+    // The read-back is the confirmation; some firmware applies the write without a valid ack
+    frame_len = bms_build_frame(frame, BMS_CMD_READ_ID, 0x00, &cmd->target->id, 1);
+    int readback = -1;
+    uint32_t value = 0;
+    if (bms_transact(BMS_PRIO_SAFETY, frame, frame_len, cmd->target->id) == BMS_FRAME_OK && find_extra_field(cmd->target->id, &value)) {
+        readback = (int)value;
+    }
+    esp_task_wdt_reset();
+
+    const char *status;
+    const char *detail;
+    if (readback == cmd->value) {
+        status = "confirmed";
+        detail = ack ? "write acknowledged and read back" : "read back without write acknowledgement";
+        bms_cmd_count(&bms_cmd_stats.confirmed);
+    } else if (readback >= 0) {
+        status = "mismatch";
+        detail = "register read back with a different value";
+        bms_cmd_count(&bms_cmd_stats.failed);
+    } else {
+        status = "unconfirmed";
+        detail = "no valid read-back";
+        bms_cmd_count(&bms_cmd_stats.failed);
+    }
+    uint32_t latency_ms = (uint32_t)((esp_timer_get_time() - cmd->received_us) / 1000);
+    taskENTER_CRITICAL(&bms_cmd_stats_lock);
+    bms_cmd_stats.last_latency_ms = latency_ms;
+    taskEXIT_CRITICAL(&bms_cmd_stats_lock);
+    bms_cmd_token_settle(cmd->token, status);
+    ESP_LOGW(TAG, "MQTT command %s: %s=%d %s in %lu ms", cmd->token, cmd->target->name, cmd->value, status,
+             latency_ms);
+    bms_cmd_publish_result(cmd->token, cmd->target->name, cmd->value, status, detail, readback, ack, cmd->received_us);
+}
+
+// Commands taken off the MQTT hand-off queue and waiting in bms_sched, oldest at bms_cmd_head.
+// Safety jobs run first in first out, so they complete in slot order.
+static bms_cmd_t bms_cmd_slots[BMS_CMD_QUEUE_LEN];
+static int bms_cmd_head = 0;
+static int bms_cmd_pending = 0;
+
+static void bms_sched_add_command(const bms_cmd_t *cmd) {
+    int slot = (bms_cmd_head + bms_cmd_pending) % BMS_CMD_QUEUE_LEN;
+    bms_cmd_slots[slot] = *cmd;
+    bms_cmd_pending++;
+    bms_sched_push(&bms_sched, BMS_PRIO_SAFETY, BMS_JOB_CMD, (uint16_t)slot);
+}
+
+// Moves commands from the MQTT hand-off queue into the scheduler, as many as there are slots
+static void bms_sched_pull_commands(void) {
+    bms_cmd_t cmd;
+    while (bms_cmd_queue && bms_cmd_pending < BMS_CMD_QUEUE_LEN && xQueueReceive(bms_cmd_queue, &cmd, 0) == pdTRUE) {
+        bms_sched_add_command(&cmd);
+    }
+}
+
+static void bms_job_run(const bms_job_t *job) {
+    if (job->kind == BMS_JOB_READ_ID) {
+        bms_slot_read_id((uint8_t)job->arg);
+        return;
+    }
+    if (job->kind == BMS_JOB_READ_ALL) {
+        bms_slot_read_all(job->arg);
+        return;
+    }
+    // Commands and probes may run inside a poll cycle; keep its wire counters clear of them, and
+    // keep the sample timestamp on the last poll response rather than a write ack or read-back
+    uint32_t tx = bms_wire.cycle_tx_bytes;
+    uint32_t rx = bms_wire.cycle_rx_bytes;
+    uint32_t bus = bms_wire.cycle_bus_us;
+    int64_t sample_time_us = current_bms_data.sample_time_us;
+    if (job->kind == BMS_JOB_CMD) {
+        bms_cmd_execute(&bms_cmd_slots[job->arg]);
+        bms_cmd_head = (bms_cmd_head + 1) % BMS_CMD_QUEUE_LEN;
+        bms_cmd_pending--;
+    } else if (job->kind == BMS_JOB_PROBE) {
+        bms_baud_autoprobe();
+    }
+    bms_wire.cycle_tx_bytes = tx;
+    bms_wire.cycle_rx_bytes = rx;
+    bms_wire.cycle_bus_us = bus;
+    current_bms_data.sample_time_us = sample_time_us;
+}
+
+// Runs queued jobs, highest priority first, until the queue is empty. New MQTT commands are
+// taken in before each job so they overtake whatever of the cycle is still queued.
+static void bms_sched_run(void) {
+    bms_job_t job;
+    bms_sched_pull_commands();
+    while (bms_sched_pop(&bms_sched, &job)) {
+        for (int p = job.prio + 1; p < BMS_PRIO_COUNT; ++p) {
+            if (bms_sched_pending(&bms_sched, (bms_prio_t)p) > 0) {
+                bms_bus[p].preempted++;
+            }
+        }
+        bms_job_run(&job);
+        bms_sched_pull_commands();
+    }
+}
+
+// Sleeps until the next sample is due, running any MQTT commands that arrive in the meantime.
+// The wake-up time is fixed up front so commands do not push the poll schedule back.
+static void bms_idle_wait(uint32_t wait_ms) {
+    int64_t until_us = esp_timer_get_time() + (int64_t)wait_ms * 1000;
+    while (1) {
+        int64_t now = esp_timer_get_time();
+        if (now >= until_us) {
+            break;
+        }
+        uint32_t chunk_ms = (uint32_t)((until_us - now + 999) / 1000);
+        if (chunk_ms > 5000) chunk_ms = 5000; // Feed the TWDT at least every 5 s
+        TickType_t ticks = pdMS_TO_TICKS(chunk_ms);
+        if (ticks == 0) ticks = 1;
+        bms_cmd_t cmd;
+        if (bms_cmd_queue) {
+            if (xQueueReceive(bms_cmd_queue, &cmd, ticks) == pdTRUE) {
+                bms_sched_add_command(&cmd);
+                bms_sched_run();
+            }
+        } else {
+            vTaskDelay(ticks);
+        }
+        esp_task_wdt_reset();
+    }
+}
+
+// Place these functions before app_main so they are visible to it
+void load_wifi_config_from_nvs() {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err == ESP_OK) {
+        size_t ssid_len = sizeof(wifi_ssid);
+        size_t pass_len = sizeof(wifi_pass);
+        if (nvs_get_str(nvs_handle, WIFI_NVS_KEY_SSID, wifi_ssid, &ssid_len) != ESP_OK) {
+            strncpy(wifi_ssid, DEFAULT_WIFI_SSID, sizeof(wifi_ssid)-1);
+            nvs_set_str(nvs_handle, WIFI_NVS_KEY_SSID, wifi_ssid);
+        }
+        if (nvs_get_str(nvs_handle, WIFI_NVS_KEY_PASS, wifi_pass, &pass_len) != ESP_OK) {
+            strncpy(wifi_pass, DEFAULT_WIFI_PASS, sizeof(wifi_pass)-1);
+            nvs_set_str(nvs_handle, WIFI_NVS_KEY_PASS, wifi_pass);
+        }
+        size_t ssid2_len = sizeof(wifi_ssid2);
+        size_t pass2_len = sizeof(wifi_pass2);
+        if (nvs_get_str(nvs_handle, WIFI_NVS_KEY_SSID2, wifi_ssid2, &ssid2_len) != ESP_OK) {
+            wifi_ssid2[0] = '\0';
+        }
+        if (nvs_get_str(nvs_handle, WIFI_NVS_KEY_PASS2, wifi_pass2, &pass2_len) != ESP_OK) {
+            wifi_pass2[0] = '\0';
+        }
+        nvs_commit(nvs_handle);
+        nvs_close(nvs_handle);
+    } else {
+        strncpy(wifi_ssid, DEFAULT_WIFI_SSID, sizeof(wifi_ssid)-1);
+        strncpy(wifi_pass, DEFAULT_WIFI_PASS, sizeof(wifi_pass)-1);
+    }
+}
+
+void load_mqtt_config_from_nvs() {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err == ESP_OK) {
+        size_t url_len = sizeof(mqtt_broker_url);
+        if (nvs_get_str(nvs_handle, MQTT_NVS_KEY_URL, mqtt_broker_url, &url_len) != ESP_OK) {
+            strncpy(mqtt_broker_url, DEFAULT_MQTT_BROKER_URL, sizeof(mqtt_broker_url)-1);
+            nvs_set_str(nvs_handle, MQTT_NVS_KEY_URL, mqtt_broker_url);
+        }
+        nvs_commit(nvs_handle);
+        nvs_close(nvs_handle);
+    } else {
+        strncpy(mqtt_broker_url, DEFAULT_MQTT_BROKER_URL, sizeof(mqtt_broker_url)-1);
+    }
+}
+
+void load_sample_interval_from_nvs() {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err == ESP_OK) {
+        int64_t val = 0;
+        if (nvs_get_i64(nvs_handle, NVS_KEY_SAMPLE_INTERVAL, &val) == ESP_OK && val > 0) {
+            sample_interval_ms = (long)val;
+        } else {
+            sample_interval_ms = DEFAULT_SAMPLE_INTERVAL;
+            nvs_set_i64(nvs_handle, NVS_KEY_SAMPLE_INTERVAL, (int64_t)sample_interval_ms);
+        }
+        nvs_commit(nvs_handle);
+        nvs_close(nvs_handle);
+    } else {
+        sample_interval_ms = DEFAULT_SAMPLE_INTERVAL;
+    }
+}
+
+void load_bms_baud_from_nvs() {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
+    if (err == ESP_OK) {
+        uint32_t val = 0;
+        if (nvs_get_u32(nvs_handle, NVS_KEY_BMS_BAUD, &val) == ESP_OK && bms_baud_valid(val)) {
+            bms_baud_config = val;
+        } else {
+            if (val) {
+                ESP_LOGW(TAG, "Ignoring invalid BMS baud rate %lu in NVS", val);
+            }
+            bms_baud_config = DEFAULT_BMS_BAUD;
+        }
+        nvs_close(nvs_handle);
+    } else {
+        bms_baud_config = DEFAULT_BMS_BAUD;
+    }
+    // The UART starts at the configured rate, or the default until the auto-probe has run
+    bms_baud_active = bms_baud_config ? bms_baud_config : DEFAULT_BMS_BAUD;
+    ESP_LOGI(TAG, "BMS baud rate: %s%lu", bms_baud_config ? "" : "auto, starting at ", bms_baud_active);
+}
+
+void load_full_read_interval_from_nvs() {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
+    if (err == ESP_OK) {
+        uint32_t val = 0;
+        if (nvs_get_u32(nvs_handle, NVS_KEY_FULL_READ_MIN, &val) == ESP_OK) {
+            full_read_interval_min = val;
+        } else {
+            full_read_interval_min = DEFAULT_FULL_READ_MIN;
+        }
+        nvs_close(nvs_handle);
+    } else {
+        full_read_interval_min = DEFAULT_FULL_READ_MIN;
+    }
+    ESP_LOGI(TAG, "Full read interval: %lu min%s", full_read_interval_min, full_read_interval_min ? "" : " (read-all every cycle)");
+}
+
+void load_mqtt_cmd_from_nvs() {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
+    mqtt_cmd_enabled = false;
+    if (err == ESP_OK) {
+        uint32_t val = 0;
+        if (nvs_get_u32(nvs_handle, NVS_KEY_MQTT_CMD, &val) == ESP_OK) {
+            mqtt_cmd_enabled = val != 0;
+        }
+        nvs_close(nvs_handle);
+    }
+    ESP_LOGI(TAG, "MQTT commands: %s", mqtt_cmd_enabled ? "enabled" : "disabled");
+}
+
+void load_mqtt_outbox_from_nvs() {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
+    mqtt_outbox_kb = DEFAULT_MQTT_OUTBOX_KB;
+    if (err == ESP_OK) {
+        uint32_t val = 0;
+        if (nvs_get_u32(nvs_handle, NVS_KEY_MQTT_OUTBOX, &val) == ESP_OK && val >= MQTT_OUTBOX_KB_MIN &&
+            val <= MQTT_OUTBOX_KB_MAX) {
+            mqtt_outbox_kb = val;
+        }
+        nvs_close(nvs_handle);
+    }
+    ESP_LOGI(TAG, "MQTT outbox limit: %lu KB", mqtt_outbox_kb);
+}
+
+void load_batch_from_nvs() {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
+    batch_size = DEFAULT_BATCH_SIZE;
+    batch_max_age_ms = DEFAULT_BATCH_MS;
+    batch_compress = false;
+    if (err == ESP_OK) {
+        uint32_t val = 0;
+        if (nvs_get_u32(nvs_handle, NVS_KEY_BATCH_SIZE, &val) == ESP_OK && val >= 1 && val <= BATCH_MAX_SAMPLES) {
+            batch_size = val;
+        }
+        if (nvs_get_u32(nvs_handle, NVS_KEY_BATCH_MS, &val) == ESP_OK) {
+            batch_max_age_ms = val;
+        }
+        if (nvs_get_u32(nvs_handle, NVS_KEY_BATCH_ZIP, &val) == ESP_OK) {
+            batch_compress = val != 0;
+        }
+        nvs_close(nvs_handle);
+    }
+    ESP_LOGI(TAG, "Batching: %lu samples or %lu ms%s", batch_size, batch_max_age_ms, batch_compress ? ", compressed" : "");
+}
+
+void load_ntp_server_from_nvs() {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
+    strcpy(ntp_server, DEFAULT_NTP_SERVER);
+    if (err == ESP_OK) {
+        size_t len = sizeof(ntp_server);
+        if (nvs_get_str(nvs_handle, NVS_KEY_NTP_SERVER, ntp_server, &len) != ESP_OK) {
+            strcpy(ntp_server, DEFAULT_NTP_SERVER);
+        }
+        nvs_close(nvs_handle);
+    }
+    ESP_LOGI(TAG, "NTP server: '%s'%s", ntp_server, ntp_server[0] ? "" : " (time sync off)");
+}
+
+void load_power_save_from_nvs() {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
+    power_save_enabled = false;
+    if (err == ESP_OK) {
+        uint32_t val = 0;
+        if (nvs_get_u32(nvs_handle, NVS_KEY_POWER_SAVE, &val) == ESP_OK) {
+            power_save_enabled = val != 0;
+        }
+        nvs_close(nvs_handle);
+    }
+    ESP_LOGI(TAG, "Power save: %s", power_save_enabled ? "enabled" : "disabled");
+}
+
 void load_bms_topic_from_nvs() {
     ESP_LOGI(TAG, "=== LOADING BMS TOPIC FROM NVS ===");
     ESP_LOGI(TAG, "Initial bms_topic value: '%s'", bms_topic);
@@ -1064,6 +2931,475 @@ void save_pack_name_to_nvs(const char *name) {
     }
 }
 
+void load_energy_counters_from_nvs() {
+    memset(&energy_acc, 0, sizeof(energy_acc));
+    energy_acc.totals.version = ENERGY_NVS_VERSION;
+
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err == ESP_OK) {
+        energy_nvs_t stored;
+        size_t len = sizeof(stored);
+        esp_err_t get_err = nvs_get_blob(nvs_handle, NVS_KEY_ENERGY, &stored, &len);
+        if (get_err == ESP_OK && len == sizeof(stored) && stored.version == ENERGY_NVS_VERSION) {
+            energy_acc.totals = stored;
+            energy_acc.totals.restore_count++;
+            ESP_LOGI(TAG, "Energy counters restored: in %.3f Ah / %.1f Wh, out %.3f Ah / %.1f Wh",
+                     stored.charge_ah, stored.charge_wh, stored.discharge_ah, stored.discharge_wh);
+        } else {
+            ESP_LOGW(TAG, "Energy counters not found in NVS (%s), starting from zero", esp_err_to_name(get_err));
+        }
+        nvs_close(nvs_handle);
+    } else {
+        ESP_LOGE(TAG, "Failed to open NVS for energy counters: %s", esp_err_to_name(err));
+    }
+    energy_acc.saved_throughput_ah = energy_acc.totals.charge_ah + energy_acc.totals.discharge_ah;
+    energy_acc.saved_throughput_wh = energy_acc.totals.charge_wh + energy_acc.totals.discharge_wh;
+    energy_acc.last_save_us = esp_timer_get_time();
+    energy_acc.loaded = true;
+}
+
+void save_energy_counters_to_nvs() {
+    // Never overwrite stored counters with a zeroed struct (e.g. from AP config mode)
+    if (!energy_acc.loaded) {
+        return;
+    }
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err == ESP_OK) {
+        esp_err_t set_err = nvs_set_blob(nvs_handle, NVS_KEY_ENERGY, &energy_acc.totals, sizeof(energy_acc.totals));
+        if (set_err == ESP_OK) {
+            nvs_commit(nvs_handle);
+            energy_acc.nvs_writes++;
+            energy_acc.saved_throughput_ah = energy_acc.totals.charge_ah + energy_acc.totals.discharge_ah;
+            energy_acc.saved_throughput_wh = energy_acc.totals.charge_wh + energy_acc.totals.discharge_wh;
+            energy_acc.last_save_us = esp_timer_get_time();
+        } else {
+            ESP_LOGE(TAG, "Failed to save energy counters: %s", esp_err_to_name(set_err));
+        }
+        nvs_close(nvs_handle);
+    } else {
+        ESP_LOGE(TAG, "Failed to open NVS for saving energy counters: %s", esp_err_to_name(err));
+    }
+}
+
+static void latency_nvs_key(uint32_t terminal, char *key, size_t key_len) {
+    snprintf(key, key_len, NVS_KEY_LATENCY_FMT, (unsigned long)terminal);
+}
+
+// Loads the learned latency for a terminal. Falls back to the defaults if nothing is stored.
+void load_latency_from_nvs(uint32_t terminal) {
+    memset(&bms_latency.est, 0, sizeof(bms_latency.est));
+    bms_latency.est.version = LATENCY_NVS_VERSION;
+    bms_latency.terminal = terminal;
+    bms_latency.terminal_known = true;
+    bms_latency.samples_since_save = 0;
+
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err == ESP_OK) {
+        char key[16];
+        latency_nvs_key(terminal, key, sizeof(key));
+        bms_latency_nvs_t stored;
+        size_t len = sizeof(stored);
+        esp_err_t get_err = nvs_get_blob(nvs_handle, key, &stored, &len);
+        if (get_err == ESP_OK && len == sizeof(stored) && stored.version == LATENCY_NVS_VERSION) {
+            bms_latency.est = stored;
+            ESP_LOGI(TAG, "BMS latency for terminal %08lX restored: first byte %.1f ms, complete %.1f ms (%u samples)",
+                     (unsigned long)terminal, stored.ewma_first_ms, stored.ewma_complete_ms, stored.count);
+        } else {
+            ESP_LOGI(TAG, "No stored BMS latency for terminal %08lX (%s)", (unsigned long)terminal, esp_err_to_name(get_err));
+        }
+        nvs_close(nvs_handle);
+    } else {
+        ESP_LOGE(TAG, "Failed to open NVS for BMS latency: %s", esp_err_to_name(err));
+    }
+    latency_update_deadline();
+}
+
+// Picks the terminal seen on the previous boot so the first exchange already uses its deadline.
+void load_latency_terminal_from_nvs() {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
+    if (err == ESP_OK) {
+        uint32_t terminal = 0;
+        if (nvs_get_u32(nvs_handle, NVS_KEY_LATENCY_TERMINAL, &terminal) == ESP_OK) {
+            nvs_close(nvs_handle);
+            load_latency_from_nvs(terminal);
+            return;
+        }
+        nvs_close(nvs_handle);
+    }
+    ESP_LOGI(TAG, "No BMS terminal recorded yet, using %d ms response deadline", BMS_DEADLINE_DEFAULT_MS);
+}
+
+void save_latency_to_nvs() {
+    if (!bms_latency.terminal_known) {
+        return;
+    }
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err == ESP_OK) {
+        char key[16];
+        latency_nvs_key(bms_latency.terminal, key, sizeof(key));
+        esp_err_t set_err = nvs_set_blob(nvs_handle, key, &bms_latency.est, sizeof(bms_latency.est));
+        if (set_err == ESP_OK) {
+            nvs_set_u32(nvs_handle, NVS_KEY_LATENCY_TERMINAL, bms_latency.terminal);
+            nvs_commit(nvs_handle);
+            bms_latency.samples_since_save = 0;
+        } else {
+            ESP_LOGE(TAG, "Failed to save BMS latency: %s", esp_err_to_name(set_err));
+        }
+        nvs_close(nvs_handle);
+    } else {
+        ESP_LOGE(TAG, "Failed to open NVS for saving BMS latency: %s", esp_err_to_name(err));
+    }
+}
+
+// Recomputes the P95 of the completion ring and the read deadline derived from it
+static void latency_update_deadline(void) {
+    const bms_latency_nvs_t *e = &bms_latency.est;
+    if (e->count < LATENCY_MIN_SAMPLES) {
+        bms_latency.p95_ms = 0;
+        bms_latency.deadline_ms = BMS_DEADLINE_DEFAULT_MS;
+        return;
+    }
+    uint16_t sorted[LATENCY_RING_SIZE];
+    int n = e->count;
+    for (int i = 0; i < n; ++i) {
+        uint16_t v = e->ring_ms[i];
+        int j = i;
+        while (j > 0 && sorted[j - 1] > v) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = v;
+    }
+    bms_latency.p95_ms = sorted[(n * 95 + 99) / 100 - 1];
+    uint32_t margin = bms_latency.p95_ms / 4;
+    if (margin < BMS_DEADLINE_MARGIN_MS) margin = BMS_DEADLINE_MARGIN_MS;
+    uint32_t deadline = bms_latency.p95_ms + margin;
+    if (deadline < BMS_DEADLINE_MIN_MS) deadline = BMS_DEADLINE_MIN_MS;
+    if (deadline > BMS_DEADLINE_MAX_MS) deadline = BMS_DEADLINE_MAX_MS;
+    bms_latency.deadline_ms = deadline;
+}
+
+// Feeds one successful exchange into the estimator for the responding terminal
+static void latency_record(uint32_t terminal, uint32_t first_ms, uint32_t complete_ms) {
+    if (!bms_latency.terminal_known || bms_latency.terminal != terminal) {
+        if (bms_latency.terminal_known && bms_latency.samples_since_save > 0) {
+            save_latency_to_nvs();
+        }
+        load_latency_from_nvs(terminal);
+    }
+    bms_latency_nvs_t *e = &bms_latency.est;
+    if (e->count == 0) {
+        e->ewma_first_ms = first_ms;
+        e->ewma_complete_ms = complete_ms;
+    } else {
+        e->ewma_first_ms += ((float)first_ms - e->ewma_first_ms) / 8.0f;
+        e->ewma_complete_ms += ((float)complete_ms - e->ewma_complete_ms) / 8.0f;
+    }
+    e->ring_ms[e->head] = complete_ms > UINT16_MAX ? UINT16_MAX : (uint16_t)complete_ms;
+    e->head = (e->head + 1) % LATENCY_RING_SIZE;
+    if (e->count < LATENCY_RING_SIZE) e->count++;
+    bms_latency.last_first_ms = first_ms;
+    bms_latency.last_complete_ms = complete_ms;
+    latency_update_deadline();
+
+    if (++bms_latency.samples_since_save >= LATENCY_SAVE_EVERY) {
+        save_latency_to_nvs();
+    }
+}
+
+// No complete frame before the deadline: allow twice as long next time
+static void latency_timeout(void) {
+    bms_latency.timeouts++;
+    uint32_t deadline = bms_latency.deadline_ms * 2;
+    bms_latency.deadline_ms = deadline > BMS_DEADLINE_MAX_MS ? BMS_DEADLINE_MAX_MS : deadline;
+}
+
+// Integrates current and power between the previous and this sample (trapezoidal rule) and
+// writes the counters back to NVS when the coalescing policy allows it.
+static void energy_accumulate(const bms_data_t *sample) {
+    if (!energy_acc.loaded || sample->sample_time_us == 0) {
+        return;
+    }
+    float power_w = sample->pack_voltage * sample->pack_current;
+
+    if (energy_acc.have_last) {
+        int64_t dt_us = sample->sample_time_us - energy_acc.last_sample_us;
+        int64_t max_gap_us = (int64_t)sample_interval_ms * 1000 * ENERGY_MAX_GAP_INTERVALS;
+        if (dt_us > 0 && dt_us <= max_gap_us) {
+            double dt_h = (double)dt_us / 3600e6;
+            double amps = (energy_acc.last_current_a + sample->pack_current) / 2.0;
+            double watts = (energy_acc.last_power_w + power_w) / 2.0;
+            if (amps >= 0) {
+                energy_acc.totals.charge_ah += amps * dt_h;
+            } else {
+                energy_acc.totals.discharge_ah += -amps * dt_h;
+            }
+            if (watts >= 0) {
+                energy_acc.totals.charge_wh += watts * dt_h;
+            } else {
+                energy_acc.totals.discharge_wh += -watts * dt_h;
+            }
+        } else if (dt_us > 0) {
+            // Too long since the last sample to interpolate; account for the hole instead
+            energy_acc.totals.gap_seconds += (double)dt_us / 1e6;
+            ESP_LOGW(TAG, "Energy integrator skipped a %.1f s gap between samples", (double)dt_us / 1e6);
+        }
+    }
+    energy_acc.last_sample_us = sample->sample_time_us;
+    energy_acc.last_current_a = sample->pack_current;
+    energy_acc.last_power_w = power_w;
+    energy_acc.have_last = true;
+
+    double unsaved_ah = energy_acc.totals.charge_ah + energy_acc.totals.discharge_ah - energy_acc.saved_throughput_ah;
+    int64_t since_save_ms = (sample->sample_time_us - energy_acc.last_save_us) / 1000;
+    if (since_save_ms >= ENERGY_SAVE_MIN_INTERVAL_MS &&
+        (unsaved_ah >= ENERGY_SAVE_DELTA_AH || (since_save_ms >= ENERGY_SAVE_INTERVAL_MS && unsaved_ah > 0))) {
+        save_energy_counters_to_nvs();
+    }
+}
+
+// --- Streaming anomaly detector ---
+// Rules are evaluated on every sample as it is decoded, so alerts reach the broker within the
+// poll cycle instead of waiting for the Grafana aggregation pipeline. Each rule keeps O(1)
+// state (the per-cell drift rule keeps one EWMA per cell). Alerts are published on
+// <bms_topic>/alerts at QoS 1 only when a rule raises or clears.
+#define ANOMALY_EWMA_SHIFT 5                 // EWMA alpha = 1/32
+#define ANOMALY_WARMUP_SAMPLES 32            // Samples before the drift baseline is trusted
+#define ANOMALY_DRIFT_MV 20.0f               // Cell offset from pack mean vs its own baseline
+#define ANOMALY_CELL_RATE_MV_PER_S 50.0f     // Max plausible cell dV/dt
+#define ANOMALY_CELL_DELTA_MV 100            // Max cell spread before flagging imbalance
+#define ANOMALY_STUCK_SECONDS 1800           // NTC unchanged this long under load is suspicious
+#define ANOMALY_STUCK_MIN_CURRENT_A 5.0f     // Load required for the stuck-sensor rule to count
+#define ANOMALY_SUM_MISMATCH_MV 500.0f       // Sum of cells vs reported pack voltage
+#define ANOMALY_MOS_OFF_CURRENT_A 1.0f       // Current flowing with both MOSFETs off
+#define ANOMALY_CLEAR_SAMPLES 3              // Consecutive good samples before an alert clears
+
+typedef enum {
+    ALERT_CELL_DRIFT,
+    ALERT_CELL_RATE,
+    ALERT_CELL_IMBALANCE,
+    ALERT_NTC0_STUCK,
+    ALERT_NTC1_STUCK,
+    ALERT_NTC2_STUCK,
+    ALERT_VOLTAGE_MISMATCH,
+    ALERT_CURRENT_MOS_OFF,
+    ALERT_COUNT
+} alert_id_t;
+
+typedef struct {
+    const char *name;
+    bool active;
+    uint8_t clear_count;        // Consecutive samples with the condition false
+    int8_t cell;                // Offending cell (0-based) or -1
+    float value;                // Value that triggered the last transition
+    float threshold;
+    int64_t since_us;           // When the alert was raised
+    uint32_t raise_count;       // Times raised since boot
+} alert_state_t;
+
+static alert_state_t alerts[ALERT_COUNT] = {
+    [ALERT_CELL_DRIFT]       = { .name = "cellDrift",          .threshold = ANOMALY_DRIFT_MV },
+    [ALERT_CELL_RATE]        = { .name = "cellRateOfChange",   .threshold = ANOMALY_CELL_RATE_MV_PER_S },
+    [ALERT_CELL_IMBALANCE]   = { .name = "cellImbalance",      .threshold = ANOMALY_CELL_DELTA_MV },
+    [ALERT_NTC0_STUCK]       = { .name = "ntc0Stuck",          .threshold = ANOMALY_STUCK_SECONDS },
+    [ALERT_NTC1_STUCK]       = { .name = "ntc1Stuck",          .threshold = ANOMALY_STUCK_SECONDS },
+    [ALERT_NTC2_STUCK]       = { .name = "ntc2Stuck",          .threshold = ANOMALY_STUCK_SECONDS },
+    [ALERT_VOLTAGE_MISMATCH] = { .name = "packVoltageMismatch", .threshold = ANOMALY_SUM_MISMATCH_MV },
+    [ALERT_CURRENT_MOS_OFF]  = { .name = "currentWithMosOff",  .threshold = ANOMALY_MOS_OFF_CURRENT_A },
+};
+
+// Detector state carried between samples
+static struct {
+    uint32_t samples;
+    int64_t last_us;
+    uint16_t last_cell_mv[BMS_MAX_CELLS];
+    float offset_ewma[BMS_MAX_CELLS];   // EWMA of (cell - pack mean) per cell
+    float ntc_last[3];
+    int64_t ntc_since_us[3];            // Last time each NTC changed (or load dropped)
+} anomaly;
+
+// Looks up a decoded extra field by ID. Returns true and stores the value if present.
+static bool find_extra_field(uint8_t id, uint32_t *value) {
+    for (int i = 0; i < extra_fields_count; ++i) {
+        if (extra_fields[i].id == id) {
+            *value = extra_fields[i].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void publish_alert(alert_id_t id, int64_t now_us) {
+    if (!mqtt_client) {
+        return;
+    }
+    const alert_state_t *a = &alerts[id];
+    char payload[256];
+    char utc[24];
+    int len = snprintf(payload, sizeof(payload),
+                       "{\"packName\":\"%s\",\"alert\":\"%s\",\"state\":\"%s\",\"cell\":%d,"
+                       "\"value\":%.2f,\"threshold\":%.2f,\"uptimeMs\":%lld,\"timestamp\":%s}",
+                       pack_name, a->name, a->active ? "raised" : "cleared", a->cell,
+                       a->value, a->threshold, (long long)(now_us / 1000), time_utc_json(now_us, utc, sizeof(utc)));
+    if (out_streams[OUT_ALERTS].has_var) {
+        char topic[OUT_TOPIC_MAX];
+        out_stream_topic(&out_streams[OUT_ALERTS], a->name, topic, sizeof(topic));
+        if (topic[0]) {
+            out_publish_to(OUT_ALERTS, topic, payload, len);
+        }
+    } else {
+        out_publish(OUT_ALERTS, payload, len);
+    }
+    ESP_LOGW(TAG, "Alert %s %s (value %.2f, threshold %.2f, cell %d)",
+             a->name, a->active ? "RAISED" : "cleared", a->value, a->threshold, a->cell);
+}
+
+// Feeds one observation into a rule. Raises immediately, clears after ANOMALY_CLEAR_SAMPLES.
+static void alert_update(alert_id_t id, bool condition, float value, int cell, int64_t now_us) {
+    alert_state_t *a = &alerts[id];
+    if (condition) {
+        a->clear_count = 0;
+        if (!a->active) {
+            a->active = true;
+            a->value = value;
+            a->cell = (int8_t)cell;
+            a->since_us = now_us;
+            a->raise_count++;
+            publish_alert(id, now_us);
+        }
+    } else if (a->active && ++a->clear_count >= ANOMALY_CLEAR_SAMPLES) {
+        a->active = false;
+        a->value = value;
+        publish_alert(id, now_us);
+    }
+}
+
+static void anomaly_evaluate(const bms_data_t *sample) {
+    int64_t now_us = sample->sample_time_us;
+    int n = sample->num_cells;
+    float abs_current = fabsf(sample->pack_current);
+    float dt_s = (anomaly.samples > 0 && now_us > anomaly.last_us) ? (float)(now_us - anomaly.last_us) / 1e6f : 0.0f;
+
+    // Per-cell drift against each cell's own baseline offset from the pack mean, and dV/dt
+    float worst_drift = 0.0f, worst_rate = 0.0f;
+    int drift_cell = -1, rate_cell = -1;
+    uint32_t sum_mv = 0;
+    for (int i = 0; i < n; i++) {
+        uint16_t mv = sample->cell_mv[i];
+        float offset = (float)mv - sample->cell_mean_mv;
+        sum_mv += mv;
+        if (anomaly.samples == 0) {
+            anomaly.offset_ewma[i] = offset;
+        } else {
+            float drift = fabsf(offset - anomaly.offset_ewma[i]);
+            if (drift > worst_drift) { worst_drift = drift; drift_cell = i; }
+            anomaly.offset_ewma[i] += (offset - anomaly.offset_ewma[i]) / (float)(1 << ANOMALY_EWMA_SHIFT);
+            if (dt_s > 0.0f) {
+                float rate = fabsf((float)mv - (float)anomaly.last_cell_mv[i]) / dt_s;
+                if (rate > worst_rate) { worst_rate = rate; rate_cell = i; }
+            }
+        }
+        anomaly.last_cell_mv[i] = mv;
+    }
+    if (anomaly.samples >= ANOMALY_WARMUP_SAMPLES) {
+        alert_update(ALERT_CELL_DRIFT, worst_drift > ANOMALY_DRIFT_MV, worst_drift, drift_cell, now_us);
+    }
+    if (dt_s > 0.0f) {
+        alert_update(ALERT_CELL_RATE, worst_rate > ANOMALY_CELL_RATE_MV_PER_S, worst_rate, rate_cell, now_us);
+    }
+
+    // Cell spread
+    alert_update(ALERT_CELL_IMBALANCE, sample->cell_delta_mv > ANOMALY_CELL_DELTA_MV,
+                 sample->cell_delta_mv, sample->max_cell_idx, now_us);
+
+    // Stuck temperature sensors: no change for ANOMALY_STUCK_SECONDS while the pack is under load
+    const float ntc[3] = { sample->mosfet_temp, sample->probe1_temp, sample->probe2_temp };
+    for (int t = 0; t < 3; t++) {
+        if (anomaly.samples == 0 || ntc[t] != anomaly.ntc_last[t] || abs_current < ANOMALY_STUCK_MIN_CURRENT_A) {
+            anomaly.ntc_since_us[t] = now_us;
+        }
+        anomaly.ntc_last[t] = ntc[t];
+        float stuck_s = (float)(now_us - anomaly.ntc_since_us[t]) / 1e6f;
+        alert_update(ALERT_NTC0_STUCK + t, stuck_s >= ANOMALY_STUCK_SECONDS, stuck_s, -1, now_us);
+    }
+
+    // Current/voltage consistency: cell sum vs pack voltage, and current with both MOSFETs off
+    if (n > 0 && sample->pack_voltage > 0.0f) {
+        float mismatch_mv = fabsf((float)sum_mv - sample->pack_voltage * 1000.0f);
+        alert_update(ALERT_VOLTAGE_MISMATCH, mismatch_mv > ANOMALY_SUM_MISMATCH_MV, mismatch_mv, -1, now_us);
+    }
+    // Live MOSFET state from the 0x8C status word, so MOSFETs opened by the BMS's own protection
+    // count too (0xAB/0xAC are only the switch settings)
+    uint32_t status_raw;
+    if (find_extra_field(0x8C, &status_raw)) {
+        bool mos_off = !sample->charge_mosfet_status && !sample->discharge_mosfet_status;
+        alert_update(ALERT_CURRENT_MOS_OFF, mos_off && abs_current > ANOMALY_MOS_OFF_CURRENT_A,
+                     abs_current, -1, now_us);
+    }
+
+    anomaly.last_us = now_us;
+    anomaly.samples++;
+}
+
+// --- Warning/status bit events ---
+// The 0x8B warning and 0x8C status words are compared with the previous frame and each bit
+// that flips is published as a discrete event on <bms_topic>/events (QoS 1). At boot the
+// previous state is taken as all-clear, so any bit already set produces one initial event.
+static struct {
+    bool valid;
+    uint16_t warning_flags;
+    uint16_t status_flags;
+    uint32_t events_published;
+} bms_flags_prev;
+
+static void publish_flag_events(const char *word, const bms_flag_def_t *defs, size_t count,
+                                uint16_t prev, uint16_t now, int64_t now_us) {
+    uint16_t changed = prev ^ now;
+    if (!changed) {
+        return;
+    }
+    char payload[224];
+    char utc[24];
+    for (size_t i = 0; i < count; ++i) {
+        uint16_t mask = (uint16_t)(1u << defs[i].bit);
+        if (!(changed & mask)) {
+            continue;
+        }
+        bool set = (now & mask) != 0;
+        ESP_LOGW(TAG, "BMS %s bit %s -> %s", word, defs[i].name, set ? "SET" : "cleared");
+        if (!mqtt_client) {
+            continue;
+        }
+        int len = snprintf(payload, sizeof(payload),
+                           "{\"packName\":\"%s\",\"source\":\"%s\",\"flag\":\"%s\",\"state\":%s,"
+                           "\"raw\":%u,\"uptimeMs\":%lld,\"timestamp\":%s}",
+                           pack_name, word, defs[i].name, set ? "true" : "false",
+                           now, (long long)(now_us / 1000), time_utc_json(now_us, utc, sizeof(utc)));
+        out_publish(OUT_EVENTS, payload, len);
+        bms_flags_prev.events_published++;
+    }
+}
+
+static void bms_flags_track(const bms_data_t *sample) {
+    if (!sample->flags_valid) {
+        return;
+    }
+    uint16_t prev_warn = bms_flags_prev.valid ? bms_flags_prev.warning_flags : 0;
+    uint16_t prev_status = bms_flags_prev.valid ? bms_flags_prev.status_flags : 0;
+    publish_flag_events("warnings", bms_warning_flags, BMS_WARNING_FLAGS_COUNT,
+                        prev_warn, sample->warning_flags, sample->sample_time_us);
+    publish_flag_events("status", bms_status_flags, BMS_STATUS_FLAGS_COUNT,
+                        prev_status, sample->status_flags, sample->sample_time_us);
+    bms_flags_prev.warning_flags = sample->warning_flags;
+    bms_flags_prev.status_flags = sample->status_flags;
+    bms_flags_prev.valid = true;
+}
+
 // SPIFFS init
 void init_spiffs() {
     ESP_LOGI(TAG, "Initializing SPIFFS...");
@@ -1105,9 +3441,20 @@ esp_err_t params_json_get_handler(httpd_req_t *req) {
     ESP_LOGI(TAG, "Current watchdog_reset_counter: %lu", watchdog_reset_counter);
     ESP_LOGI(TAG, "Current pack_name: '%s'", pack_name);
     
-    char buf[512];
-    snprintf(buf, sizeof(buf), "{\"ssid\":\"%s\",\"password\":\"%s\",\"mqtt_url\":\"%s\",\"sample_interval\":%ld,\"bms_topic\":\"%s\",\"watchdog_reset_counter\":%lu,\"pack_name\":\"%s\"}", 
-             wifi_ssid, wifi_pass, mqtt_broker_url, sample_interval_ms, bms_topic, watchdog_reset_counter, pack_name);
+    char buf[2048];
+    int n = snprintf(buf, sizeof(buf), "{\"ssid\":\"%s\",\"password\":\"%s\",\"ssid2\":\"%s\",\"password2\":\"%s\",\"mqtt_url\":\"%s\",\"sample_interval\":%ld,\"bms_topic\":\"%s\",\"watchdog_reset_counter\":%lu,\"pack_name\":\"%s\",\"bms_baud\":%lu,\"full_read_min\":%lu,\"mqtt_cmd\":%d,\"mqtt_outbox_kb\":%lu,\"batch_size\":%lu,\"batch_ms\":%lu,\"batch_zip\":%d,\"ntp_server\":\"%s\",\"power_save\":%d}", 
+             wifi_ssid, wifi_pass, wifi_ssid2, wifi_pass2, mqtt_broker_url, sample_interval_ms, bms_topic, watchdog_reset_counter, pack_name, bms_baud_config, full_read_interval_min, mqtt_cmd_enabled ? 1 : 0, mqtt_outbox_kb, batch_size, batch_max_age_ms, batch_compress ? 1 : 0, ntp_server, power_save_enabled ? 1 : 0);
+    // Output streams: "outputs":{"telemetry":{"qos":1,"retain":0,"enc":"json","topic":"%topic%"},...}
+    n--; // Reopen the object
+    n += snprintf(buf + n, sizeof(buf) - n, ",\"outputs\":{");
+    for (int i = 0; i < OUT_STREAM_COUNT && n < (int)sizeof(buf); ++i) {
+        const out_stream_t *st = &out_streams[i];
+        n += snprintf(buf + n, sizeof(buf) - n, "%s\"%s\":{\"qos\":%u,\"retain\":%d,\"enc\":\"%s\",\"topic\":\"%s\"}",
+                      i ? "," : "", st->name, st->qos, st->retain ? 1 : 0, out_encoding_names[st->encoding], st->topic_template);
+    }
+    if (n < (int)sizeof(buf)) {
+        snprintf(buf + n, sizeof(buf) - n, "}}");
+    }
     ESP_LOGI(TAG, "Sending params.json response: %s", buf);
     httpd_resp_set_type(req, "application/json");
     httpd_resp_send(req, buf, HTTPD_RESP_USE_STRLEN);
@@ -1147,8 +3494,17 @@ static void reboot_task(void *param) {
 esp_err_t params_update_post_handler(httpd_req_t *req) {
     ESP_LOGI(TAG, "=== UPDATE REQUEST RECEIVED ===");
     
-    char buf[512];
-    int ret = httpd_req_recv(req, buf, sizeof(buf)-1);
+    char buf[2048]; // URL-encoded form; encoded credentials and topic templates take several hundred bytes
+    // A body this size can span several TCP segments; keep reading until all of it is in
+    int ret = 0;
+    int want = req->content_len < sizeof(buf) - 1 ? req->content_len : sizeof(buf) - 1;
+    while (ret < want) {
+        int got = httpd_req_recv(req, buf + ret, want - ret);
+        if (got <= 0) {
+            break;
+        }
+        ret += got;
+    }
     if (ret <= 0) {
         ESP_LOGE(TAG, "Failed to receive update data");
         httpd_resp_send_500(req);
@@ -1169,6 +3525,9 @@ esp_err_t params_update_post_handler(httpd_req_t *req) {
     url_decode(ssid_dec, ssid, sizeof(ssid_dec));
     url_decode(pass_dec, pass, sizeof(pass_dec));
     url_decode(url_dec, mqtt_url, sizeof(url_dec));
+    char old_ssid[sizeof(wifi_ssid)], old_ssid2[sizeof(wifi_ssid2)];
+    memcpy(old_ssid, wifi_ssid, sizeof(old_ssid));
+    memcpy(old_ssid2, wifi_ssid2, sizeof(old_ssid2));
     strncpy(wifi_ssid, ssid_dec, sizeof(wifi_ssid)-1);
     strncpy(wifi_pass, pass_dec, sizeof(wifi_pass)-1);
     strncpy(mqtt_broker_url, url_dec, sizeof(mqtt_broker_url)-1);
@@ -1180,6 +3539,24 @@ esp_err_t params_update_post_handler(httpd_req_t *req) {
     nvs_set_str(nvs_handle, WIFI_NVS_KEY_PASS, wifi_pass);
     nvs_set_str(nvs_handle, MQTT_NVS_KEY_URL, mqtt_broker_url);
     nvs_set_i64(nvs_handle, NVS_KEY_SAMPLE_INTERVAL, (int64_t)sample_interval_ms);
+    // Handle fallback network (empty SSID = none)
+    char *ssid2_ptr = strstr(buf, "ssid2=");
+    char *pass2_ptr = strstr(buf, "password2=");
+    if (ssid2_ptr && pass2_ptr) {
+        char ssid2_in[100] = "", pass2_in[196] = "";
+        sscanf(ssid2_ptr + 6, "%99[^&]", ssid2_in);
+        sscanf(pass2_ptr + 10, "%195[^&]", pass2_in);
+        url_decode(wifi_ssid2, ssid2_in, sizeof(wifi_ssid2));
+        url_decode(wifi_pass2, pass2_in, sizeof(wifi_pass2));
+        ESP_LOGI(TAG, "Fallback network updated to: '%s'", wifi_ssid2);
+    }
+    nvs_set_str(nvs_handle, WIFI_NVS_KEY_SSID2, wifi_ssid2);
+    nvs_set_str(nvs_handle, WIFI_NVS_KEY_PASS2, wifi_pass2);
+    // The last-AP hint belongs to the old network; pinning its BSSID would cost the first attempts
+    if (strcmp(old_ssid, wifi_ssid) != 0 || strcmp(old_ssid2, wifi_ssid2) != 0) {
+        nvs_erase_key(nvs_handle, WIFI_NVS_KEY_HINT);
+        ESP_LOGI(TAG, "Network changed, last-AP hint cleared");
+    }
     // Handle BMS topic
     ESP_LOGI(TAG, "=== PROCESSING BMS TOPIC ===");
     ESP_LOGI(TAG, "Current bms_topic before update: '%s'", bms_topic);
@@ -1250,6 +3627,150 @@ esp_err_t params_update_post_handler(httpd_req_t *req) {
     ESP_LOGI(TAG, "Saved watchdog counter %lu to NVS with key '%s': %s", watchdog_reset_counter, NVS_KEY_WATCHDOG_COUNTER, esp_err_to_name(watchdog_nvs_err));
     ESP_LOGI(TAG, "=== WATCHDOG RESET COUNTER PROCESSING COMPLETE ===");
     
+    // Handle BMS baud rate (0 = auto-probe)
+    char *baud_ptr = strstr(buf, "bms_baud=");
+    if (baud_ptr) {
+        uint32_t baud_value = 0;
+        sscanf(baud_ptr + 9, "%lu", &baud_value);
+        if (bms_baud_valid(baud_value)) {
+            bms_baud_config = baud_value;
+            ESP_LOGI(TAG, "BMS baud rate updated to: %lu%s", bms_baud_config, bms_baud_config ? "" : " (auto)");
+        } else {
+            ESP_LOGW(TAG, "Rejected BMS baud rate %lu, keeping %lu", baud_value, bms_baud_config);
+        }
+    }
+    esp_err_t baud_nvs_err = nvs_set_u32(nvs_handle, NVS_KEY_BMS_BAUD, bms_baud_config);
+    ESP_LOGI(TAG, "Saved BMS baud rate %lu to NVS with key '%s': %s", bms_baud_config, NVS_KEY_BMS_BAUD, esp_err_to_name(baud_nvs_err));
+    
+    // Handle full read interval (0 = read-all every cycle)
+    char *full_read_ptr = strstr(buf, "full_read_min=");
+    if (full_read_ptr) {
+        uint32_t full_read_value = DEFAULT_FULL_READ_MIN;
+        sscanf(full_read_ptr + 14, "%lu", &full_read_value);
+        full_read_interval_min = full_read_value;
+        ESP_LOGI(TAG, "Full read interval updated to: %lu min", full_read_interval_min);
+    }
+    esp_err_t full_read_nvs_err = nvs_set_u32(nvs_handle, NVS_KEY_FULL_READ_MIN, full_read_interval_min);
+    ESP_LOGI(TAG, "Saved full read interval %lu to NVS with key '%s': %s", full_read_interval_min, NVS_KEY_FULL_READ_MIN, esp_err_to_name(full_read_nvs_err));
+    
+    // Handle MQTT command enable (MOS switch control on <bms_topic>/cmd)
+    char *mqtt_cmd_ptr = strstr(buf, "mqtt_cmd=");
+    if (mqtt_cmd_ptr) {
+        mqtt_cmd_enabled = mqtt_cmd_ptr[9] == '1';
+        ESP_LOGI(TAG, "MQTT commands updated to: %s", mqtt_cmd_enabled ? "enabled" : "disabled");
+    }
+    esp_err_t mqtt_cmd_nvs_err = nvs_set_u32(nvs_handle, NVS_KEY_MQTT_CMD, mqtt_cmd_enabled ? 1 : 0);
+    ESP_LOGI(TAG, "Saved MQTT command enable %d to NVS with key '%s': %s", mqtt_cmd_enabled, NVS_KEY_MQTT_CMD, esp_err_to_name(mqtt_cmd_nvs_err));
+    
+    // Handle MQTT outbox limit (clamped, esp-mqtt would take 0 as unlimited)
+    char *outbox_ptr = strstr(buf, "mqtt_outbox_kb=");
+    if (outbox_ptr) {
+        uint32_t outbox_value = DEFAULT_MQTT_OUTBOX_KB;
+        sscanf(outbox_ptr + 15, "%lu", &outbox_value);
+        if (outbox_value < MQTT_OUTBOX_KB_MIN) {
+            outbox_value = MQTT_OUTBOX_KB_MIN;
+        } else if (outbox_value > MQTT_OUTBOX_KB_MAX) {
+            outbox_value = MQTT_OUTBOX_KB_MAX;
+        }
+        mqtt_outbox_kb = outbox_value;
+        ESP_LOGI(TAG, "MQTT outbox limit updated to: %lu KB", mqtt_outbox_kb);
+    }
+    esp_err_t outbox_nvs_err = nvs_set_u32(nvs_handle, NVS_KEY_MQTT_OUTBOX, mqtt_outbox_kb);
+    ESP_LOGI(TAG, "Saved MQTT outbox limit %lu to NVS with key '%s': %s", mqtt_outbox_kb, NVS_KEY_MQTT_OUTBOX, esp_err_to_name(outbox_nvs_err));
+    
+    // Handle batching (samples per batch message and the oldest sample age that sends it early)
+    char *batch_size_ptr = strstr(buf, "batch_size=");
+    if (batch_size_ptr) {
+        uint32_t batch_size_value = DEFAULT_BATCH_SIZE;
+        sscanf(batch_size_ptr + 11, "%lu", &batch_size_value);
+        if (batch_size_value >= 1 && batch_size_value <= BATCH_MAX_SAMPLES) {
+            batch_size = batch_size_value;
+            ESP_LOGI(TAG, "Batch size updated to: %lu", batch_size);
+        }
+    }
+    esp_err_t batch_size_nvs_err = nvs_set_u32(nvs_handle, NVS_KEY_BATCH_SIZE, batch_size);
+    ESP_LOGI(TAG, "Saved batch size %lu to NVS with key '%s': %s", batch_size, NVS_KEY_BATCH_SIZE, esp_err_to_name(batch_size_nvs_err));
+    char *batch_ms_ptr = strstr(buf, "batch_ms=");
+    if (batch_ms_ptr) {
+        uint32_t batch_ms_value = DEFAULT_BATCH_MS;
+        sscanf(batch_ms_ptr + 9, "%lu", &batch_ms_value);
+        batch_max_age_ms = batch_ms_value;
+        ESP_LOGI(TAG, "Batch max age updated to: %lu ms", batch_max_age_ms);
+    }
+    esp_err_t batch_ms_nvs_err = nvs_set_u32(nvs_handle, NVS_KEY_BATCH_MS, batch_max_age_ms);
+    ESP_LOGI(TAG, "Saved batch max age %lu to NVS with key '%s': %s", batch_max_age_ms, NVS_KEY_BATCH_MS, esp_err_to_name(batch_ms_nvs_err));
+    char *batch_zip_ptr = strstr(buf, "batch_zip=");
+    if (batch_zip_ptr) {
+        batch_compress = batch_zip_ptr[10] == '1';
+        ESP_LOGI(TAG, "Batch compression updated to: %s", batch_compress ? "on" : "off");
+    }
+    esp_err_t batch_zip_nvs_err = nvs_set_u32(nvs_handle, NVS_KEY_BATCH_ZIP, batch_compress ? 1 : 0);
+    ESP_LOGI(TAG, "Saved batch compression %d to NVS with key '%s': %s", batch_compress, NVS_KEY_BATCH_ZIP, esp_err_to_name(batch_zip_nvs_err));
+    
+    // Handle NTP server (empty turns time sync off)
+    char *ntp_ptr = strstr(buf, "ntp_server=");
+    if (ntp_ptr) {
+        char ntp_in[192] = "";
+        sscanf(ntp_ptr + 11, "%191[^&]", ntp_in);
+        url_decode(ntp_server, ntp_in, sizeof(ntp_server));
+        ESP_LOGI(TAG, "NTP server updated to: '%s'", ntp_server);
+    }
+    esp_err_t ntp_nvs_err = nvs_set_str(nvs_handle, NVS_KEY_NTP_SERVER, ntp_server);
+    ESP_LOGI(TAG, "Saved NTP server '%s' to NVS with key '%s': %s", ntp_server, NVS_KEY_NTP_SERVER, esp_err_to_name(ntp_nvs_err));
+    
+    // Handle power save (light sleep and modem sleep between samples)
+    char *power_save_ptr = strstr(buf, "power_save=");
+    if (power_save_ptr) {
+        power_save_enabled = power_save_ptr[11] == '1';
+        ESP_LOGI(TAG, "Power save updated to: %s", power_save_enabled ? "enabled" : "disabled");
+    }
+    esp_err_t power_save_nvs_err = nvs_set_u32(nvs_handle, NVS_KEY_POWER_SAVE, power_save_enabled ? 1 : 0);
+    ESP_LOGI(TAG, "Saved power save %d to NVS with key '%s': %s", power_save_enabled, NVS_KEY_POWER_SAVE, esp_err_to_name(power_save_nvs_err));
+    
+    // Handle output streams: out_<name>_qos, out_<name>_retain, out_<name>_enc, out_<name>_topic
+    for (int i = 0; i < OUT_STREAM_COUNT; ++i) {
+        out_stream_t *st = &out_streams[i];
+        char field[40];
+        char *p;
+        snprintf(field, sizeof(field), "out_%s_qos=", st->name);
+        if ((p = strstr(buf, field)) != NULL) {
+            st->qos = p[strlen(field)] == '1' ? 1 : 0;
+        }
+        snprintf(field, sizeof(field), "out_%s_retain=", st->name);
+        if ((p = strstr(buf, field)) != NULL) {
+            st->retain = p[strlen(field)] == '1';
+        }
+        snprintf(field, sizeof(field), "out_%s_enc=", st->name);
+        if ((p = strstr(buf, field)) != NULL) {
+            for (int e = 0; e < OUT_ENC_COUNT; ++e) {
+                size_t enc_len = strlen(out_encoding_names[e]);
+                char end = p[strlen(field) + enc_len];
+                if (strncmp(p + strlen(field), out_encoding_names[e], enc_len) == 0 && (end == '&' || end == '\0')) {
+                    st->encoding = (out_encoding_t)e;
+                }
+            }
+        }
+        snprintf(field, sizeof(field), "out_%s_topic=", st->name);
+        if ((p = strstr(buf, field)) != NULL) {
+            char raw[OUT_TEMPLATE_MAX * 3] = "";
+            char decoded[OUT_TEMPLATE_MAX];
+            sscanf(p + strlen(field), "%191[^&]", raw);
+            url_decode(decoded, raw, sizeof(decoded));
+            if (out_template_valid(st, decoded)) {
+                strncpy(st->topic_template, decoded, sizeof(st->topic_template) - 1);
+                st->topic_template[sizeof(st->topic_template) - 1] = '\0';
+            } else {
+                ESP_LOGW(TAG, "Rejected topic template for %s: '%s'", st->name, decoded);
+            }
+        }
+        char key[16];
+        char spec[96];
+        out_stream_nvs_key(st, key, sizeof(key));
+        snprintf(spec, sizeof(spec), "%u,%d,%s,%s", st->qos, st->retain ? 1 : 0, out_encoding_names[st->encoding], st->topic_template);
+        esp_err_t out_nvs_err = nvs_set_str(nvs_handle, key, spec);
+        ESP_LOGI(TAG, "Saved output %s='%s': %s", key, spec, esp_err_to_name(out_nvs_err));
+    }
+    
     nvs_commit(nvs_handle);
     nvs_close(nvs_handle);
     
@@ -1337,63 +3858,94 @@ esp_err_t captive_redirect_handler(httpd_req_t *req) {
     return ESP_OK;
 }
 
-// Handler for /sysinfo.json
-static esp_err_t sysinfo_json_get_handler(httpd_req_t *req) {
-    char resp[512];
-    esp_chip_info_t chip_info;
-    esp_chip_info(&chip_info);
+static const char *reset_reason_name(esp_reset_reason_t reason) {
+    switch (reason) {
+        case ESP_RST_POWERON: return "Power-on";
+        case ESP_RST_EXT: return "External";
+        case ESP_RST_SW: return "Software";
+        case ESP_RST_PANIC: return "Panic";
+        case ESP_RST_INT_WDT: return "Interrupt WDT";
+        case ESP_RST_TASK_WDT: return "Task WDT";
+        case ESP_RST_WDT: return "Other WDT";
+        case ESP_RST_DEEPSLEEP: return "Deep Sleep";
+        case ESP_RST_BROWNOUT: return "Brownout";
+        case ESP_RST_SDIO: return "SDIO";
+        default: return "Unknown";
+    }
+}
+
+// ============================================================
+// Device info
+// ============================================================
+// Processor metadata shared by the MQTT telemetry and /sysinfo.json. Items that cannot change
+// while running (version, build, SDK, chip id, flash size) are worked out once by
+// device_info_init() after SPIFFS is mounted. The IP address is set from the Wi-Fi events and
+// the RSSI is sampled at most every DEVICE_INFO_RSSI_REFRESH_MS, so a publish only copies
+// cached values. Every refresh while connected also times the lookups a publish used to make
+// (AP record, netif lookup, IP formatting); the running means of that and of the cached read are
+// reported as the saving per publish.
+#define DEVICE_INFO_RSSI_REFRESH_MS 10000
+
+static struct {
+    char version[16];                   // From /spiffs/version.txt, "0.0.0" if unreadable
+    char build_date[16];
+    char build_time[16];
+    char sdk[32];
+    char chip_id[13];                   // Wi-Fi station MAC
+    uint32_t flash_size;
+    uint32_t init_us;                   // Cost of the static part, paid once instead of per request
+    char ip[16];
+    int32_t rssi_percent;
+    int64_t rssi_sampled_us;
+    uint64_t uncached_total_us;         // Per-publish lookups before the cache, timed at each RSSI refresh
+    uint32_t uncached_samples;
+    uint64_t cached_total_us;           // Cached reads
+    uint32_t cached_samples;
+} device_info = { .version = "0.0.0", .ip = "0.0.0.0" };
+static portMUX_TYPE device_info_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int32_t rssi_to_percent(int32_t rssi_dbm) {
+    // Typical range: -100 dBm (0%) to -50 dBm (100%)
+    if (rssi_dbm >= -50) {
+        return 100;
+    } else if (rssi_dbm <= -100) {
+        return 0;
+    }
+    return 2 * (rssi_dbm + 100);
+}
+
+static void device_info_init(void) {
+    int64_t start_us = esp_timer_get_time();
+    // Note: data/version.txt must be kept in sync with the master version file (version.txt in
+    // the project root). The master file is the source of truth; this copy is deployed to the
+    // ESP32 for runtime display.
+    FILE *version_file = fopen("/spiffs/version.txt", "r");
+    if (version_file) {
+        if (fgets(device_info.version, sizeof(device_info.version), version_file)) {
+            device_info.version[strcspn(device_info.version, "\r\n")] = '\0';
+        }
+        fclose(version_file);
+    } else {
+        ESP_LOGE(TAG, "Failed to open /spiffs/version.txt - file may not exist or SPIFFS not mounted");
+    }
+
     // Use esp_app_get_description if available, else fallback
     #if ESP_IDF_VERSION_MAJOR >= 5
     const esp_app_desc_t *app_desc = esp_app_get_description();
     #else
     const esp_app_desc_t *app_desc = esp_ota_get_app_description();
     #endif
-    const char *idf_ver = esp_get_idf_version();
-    
-    // Read version from version.txt file in SPIFFS
-    // Note: This file (data/version.txt) must be kept in sync with the master 
-    // version file (version.txt in project root). The master file serves as 
-    // the source of truth, while this file is deployed to the ESP32 for 
-    // runtime display in the web interface.
-    char version_str[16] = "1.3.0"; // Default fallback - update when master version changes
-    FILE *version_file = fopen("/spiffs/version.txt", "r");
-    if (version_file) {
-        if (fgets(version_str, sizeof(version_str), version_file)) {
-            // Remove trailing newline if present
-            char *newline = strchr(version_str, '\n');
-            if (newline) *newline = '\0';
-            char *carriage_return = strchr(version_str, '\r');
-            if (carriage_return) *carriage_return = '\0';
-        }
-        fclose(version_file);
-    }
-    
-    esp_reset_reason_t reason = esp_reset_reason();
-    const char *reason_str = "Unknown";
-    switch (reason) {
-        case ESP_RST_POWERON: reason_str = "Power-on"; break;
-        case ESP_RST_EXT: reason_str = "External"; break;
-        case ESP_RST_SW: reason_str = "Software"; break;
-        case ESP_RST_PANIC: reason_str = "Panic"; break;
-        case ESP_RST_INT_WDT: reason_str = "Interrupt WDT"; break;
-        case ESP_RST_TASK_WDT: reason_str = "Task WDT"; break;
-        case ESP_RST_WDT: reason_str = "Other WDT"; break;
-        case ESP_RST_DEEPSLEEP: reason_str = "Deep Sleep"; break;
-        case ESP_RST_BROWNOUT: reason_str = "Brownout"; break;
-        case ESP_RST_SDIO: reason_str = "SDIO"; break;
-        default: break;
-    }
+    snprintf(device_info.build_date, sizeof(device_info.build_date), "%s", app_desc->date);
+    snprintf(device_info.build_time, sizeof(device_info.build_time), "%s", app_desc->time);
+    snprintf(device_info.sdk, sizeof(device_info.sdk), "%s", esp_get_idf_version());
+
     uint8_t mac[6];
     esp_read_mac(mac, ESP_MAC_WIFI_STA);
-    char chip_id[18];
-    snprintf(chip_id, sizeof(chip_id), "%02X%02X%02X%02X%02X%02X",
+    snprintf(device_info.chip_id, sizeof(device_info.chip_id), "%02X%02X%02X%02X%02X%02X",
              mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-    // Get flash chip information
-    uint32_t flash_id = 0x000000; // Placeholder
-    uint32_t flash_size = 0;
-    
-    // Get actual flash size - ESP32 DevKit V1 typically has 4MB
-    // Use the more reliable method of checking all partitions to estimate total flash
+
+    // Estimate the flash size from the end of the last partition, rounded up to whole MB.
+    // ESP32 DevKit V1 boards have at least 4 MB.
     esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, NULL);
     uint32_t max_offset = 0;
     while (it != NULL) {
@@ -1405,14 +3957,61 @@ static esp_err_t sysinfo_json_get_handler(httpd_req_t *req) {
         it = esp_partition_next(it);
     }
     if (it) esp_partition_iterator_release(it);
-    
-    // Round up to nearest MB and ensure it's at least 4MB for ESP32 DevKit V1
-    if (max_offset > 0) {
-        flash_size = ((max_offset + 1024*1024 - 1) / (1024*1024)) * 1024*1024; // Round up to nearest MB
-        if (flash_size < 4*1024*1024) flash_size = 4*1024*1024; // Minimum 4MB for ESP32 DevKit V1
+    device_info.flash_size = ((max_offset + 1024*1024 - 1) / (1024*1024)) * 1024*1024;
+    if (device_info.flash_size < 4*1024*1024) device_info.flash_size = 4*1024*1024;
+
+    device_info.init_us = (uint32_t)(esp_timer_get_time() - start_us);
+    ESP_LOGI(TAG, "Device info: version %s, chip %s, flash %lu KB (%lu us)", device_info.version,
+             device_info.chip_id, device_info.flash_size / 1024, device_info.init_us);
+}
+
+// Called from the Wi-Fi event handler; NULL when the connection is lost
+static void device_info_set_ip(const esp_ip4_addr_t *ip) {
+    taskENTER_CRITICAL(&device_info_lock);
+    if (ip) {
+        snprintf(device_info.ip, sizeof(device_info.ip), IPSTR, IP2STR(ip));
     } else {
-        flash_size = 4 * 1024 * 1024; // Default 4MB for ESP32 DevKit V1
+        snprintf(device_info.ip, sizeof(device_info.ip), "0.0.0.0");
+        device_info.rssi_percent = 0;
+    }
+    taskEXIT_CRITICAL(&device_info_lock);
+}
+
+// Copies the network items for a publish, refreshing the RSSI when it is due
+static void device_info_network(int32_t *rssi_percent, char *ip, size_t ip_len) {
+    int64_t start_us = esp_timer_get_time();
+    if (device_info.rssi_sampled_us == 0 || start_us - device_info.rssi_sampled_us >= DEVICE_INFO_RSSI_REFRESH_MS * 1000LL) {
+        wifi_ap_record_t ap_info;
+        int32_t percent = esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK ? rssi_to_percent(ap_info.rssi) : 0;
+        if (percent > 0) {
+            // What every publish used to cost: the AP record above plus the netif IP lookup
+            esp_netif_ip_info_t ip_info;
+            char ip_str[16];
+            esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+            if (netif && esp_netif_get_ip_info(netif, &ip_info) == ESP_OK) {
+                snprintf(ip_str, sizeof(ip_str), IPSTR, IP2STR(&ip_info.ip));
+            }
+            device_info.uncached_total_us += (uint64_t)(esp_timer_get_time() - start_us);
+            device_info.uncached_samples++;
+        }
+        taskENTER_CRITICAL(&device_info_lock);
+        device_info.rssi_percent = percent;
+        taskEXIT_CRITICAL(&device_info_lock);
+        device_info.rssi_sampled_us = start_us;
+        start_us = esp_timer_get_time(); // Time only the cached read below
     }
+    taskENTER_CRITICAL(&device_info_lock);
+    *rssi_percent = device_info.rssi_percent;
+    snprintf(ip, ip_len, "%s", device_info.ip);
+    taskEXIT_CRITICAL(&device_info_lock);
+    device_info.cached_total_us += (uint64_t)(esp_timer_get_time() - start_us);
+    device_info.cached_samples++;
+}
+
+// Handler for /sysinfo.json
+static esp_err_t sysinfo_json_get_handler(httpd_req_t *req) {
+    char resp[512];
+    uint32_t flash_id = 0x000000; // Placeholder
     snprintf(resp, sizeof(resp),
         "{"
         "\"version\":\"%s\","  // Program Version
@@ -1423,13 +4022,13 @@ static esp_err_t sysinfo_json_get_handler(httpd_req_t *req) {
         "\"flash_id\":\"%06lX\"," // Flash Chip Id
         "\"flash_size\":\"%lu KB\""
         "}",
-        version_str,  // Use version from version.txt file
-        app_desc->date, app_desc->time,
-        idf_ver,
-        reason_str,
-        chip_id,
+        device_info.version,  // From version.txt, read once by device_info_init()
+        device_info.build_date, device_info.build_time,
+        device_info.sdk,
+        reset_reason_name(esp_reset_reason()),
+        device_info.chip_id,
         (unsigned long)(flash_id & 0xFFFFFF),
-        (unsigned long)(flash_size / 1024)
+        (unsigned long)(device_info.flash_size / 1024)
     );
     httpd_resp_set_type(req, "application/json");
     httpd_resp_send(req, resp, HTTPD_RESP_USE_STRLEN);
@@ -1792,6 +4391,7 @@ static void start_ap_and_captive_portal() {
     ESP_LOGI(TAG, "About to call init_spiffs()...");
     init_spiffs();
     ESP_LOGI(TAG, "init_spiffs() completed successfully");
+    device_info_init();
     
     // Start HTTP server
     httpd_handle_t server = NULL;
@@ -1815,88 +4415,709 @@ static void start_ap_and_captive_portal() {
         ESP_LOGE(TAG, "Failed to start HTTP server: %s", esp_err_to_name(server_err));
         return;
     }
-    
-    ESP_LOGI(TAG, "HTTP server started successfully");
-    
-    // Register handlers in order of specificity (most specific first)
-    httpd_uri_t params_json = { .uri = "/params.json", .method = HTTP_GET, .handler = params_json_get_handler, .user_ctx = NULL };
-    httpd_uri_t params_update = { .uri = "/update", .method = HTTP_POST, .handler = params_update_post_handler, .user_ctx = NULL };
-    httpd_uri_t parameters_html = { .uri = "/parameters.html", .method = HTTP_GET, .handler = parameters_html_handler, .user_ctx = NULL };
-    httpd_uri_t sysinfo_json = { .uri = "/sysinfo.json", .method = HTTP_GET, .handler = sysinfo_json_get_handler, .user_ctx = NULL };
-    httpd_uri_t ota_firmware = { .uri = "/ota/firmware", .method = HTTP_POST, .handler = ota_firmware_handler, .user_ctx = NULL };
-    httpd_uri_t ota_filesystem = { .uri = "/ota/filesystem", .method = HTTP_POST, .handler = ota_filesystem_handler, .user_ctx = NULL };
-    httpd_uri_t ota_firmware_options = { .uri = "/ota/firmware", .method = HTTP_OPTIONS, .handler = ota_firmware_handler, .user_ctx = NULL };
-    httpd_uri_t ota_filesystem_options = { .uri = "/ota/filesystem", .method = HTTP_OPTIONS, .handler = ota_filesystem_handler, .user_ctx = NULL };
-    
-    // Register specific handlers first
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &params_json));
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &params_update));
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &parameters_html));
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &sysinfo_json));
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &ota_firmware));
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &ota_filesystem));
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &ota_firmware_options));
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &ota_filesystem_options));
-    
-    // Register wildcard handler last to catch all other requests
-    httpd_uri_t captive = { .uri = "/*", .method = HTTP_GET, .handler = captive_redirect_handler, .user_ctx = NULL };
-    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &captive));
-    
-    ESP_LOGI(TAG, "All HTTP handlers registered successfully");
-    ESP_LOGI(TAG, "Captive portal ready - connect to '%s' and visit any website", ap_ssid);
+    
+    ESP_LOGI(TAG, "HTTP server started successfully");
+    
+    // Register handlers in order of specificity (most specific first)
+    httpd_uri_t params_json = { .uri = "/params.json", .method = HTTP_GET, .handler = params_json_get_handler, .user_ctx = NULL };
+    httpd_uri_t params_update = { .uri = "/update", .method = HTTP_POST, .handler = params_update_post_handler, .user_ctx = NULL };
+    httpd_uri_t parameters_html = { .uri = "/parameters.html", .method = HTTP_GET, .handler = parameters_html_handler, .user_ctx = NULL };
+    httpd_uri_t sysinfo_json = { .uri = "/sysinfo.json", .method = HTTP_GET, .handler = sysinfo_json_get_handler, .user_ctx = NULL };
+    httpd_uri_t ota_firmware = { .uri = "/ota/firmware", .method = HTTP_POST, .handler = ota_firmware_handler, .user_ctx = NULL };
+    httpd_uri_t ota_filesystem = { .uri = "/ota/filesystem", .method = HTTP_POST, .handler = ota_filesystem_handler, .user_ctx = NULL };
+    httpd_uri_t ota_firmware_options = { .uri = "/ota/firmware", .method = HTTP_OPTIONS, .handler = ota_firmware_handler, .user_ctx = NULL };
+    httpd_uri_t ota_filesystem_options = { .uri = "/ota/filesystem", .method = HTTP_OPTIONS, .handler = ota_filesystem_handler, .user_ctx = NULL };
+    
+    // Register specific handlers first
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &params_json));
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &params_update));
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &parameters_html));
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &sysinfo_json));
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &ota_firmware));
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &ota_filesystem));
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &ota_firmware_options));
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &ota_filesystem_options));
+    
+    // Register wildcard handler last to catch all other requests
+    httpd_uri_t captive = { .uri = "/*", .method = HTTP_GET, .handler = captive_redirect_handler, .user_ctx = NULL };
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &captive));
+    
+    ESP_LOGI(TAG, "All HTTP handlers registered successfully");
+    ESP_LOGI(TAG, "Captive portal ready - connect to '%s' and visit any website", ap_ssid);
+}
+
+void ap_config_task(void *pvParameter) {
+    ESP_LOGI(TAG, "Starting AP configuration mode...");
+    
+    // Debug: Show watchdog counter before loading from NVS
+    ESP_LOGI(TAG, "*** DEBUG: watchdog_reset_counter before NVS load (AP mode): %lu ***", watchdog_reset_counter);
+    
+    // Load NVS values before starting AP and HTTP server
+    load_wifi_config_from_nvs();
+    load_mqtt_config_from_nvs();
+    load_sample_interval_from_nvs();
+    load_bms_topic_from_nvs();
+    load_watchdog_counter_from_nvs();
+    load_pack_name_from_nvs();
+    load_bms_baud_from_nvs();
+    load_full_read_interval_from_nvs();
+    load_mqtt_cmd_from_nvs();
+    load_mqtt_outbox_from_nvs();
+    load_batch_from_nvs();
+    load_ntp_server_from_nvs();
+    load_power_save_from_nvs();
+    load_output_streams_from_nvs();
+    
+    // Debug: Show watchdog counter after loading from NVS
+    ESP_LOGI(TAG, "*** DEBUG: watchdog_reset_counter after NVS load (AP mode): %lu ***", watchdog_reset_counter);
+    
+    ESP_LOGI(TAG, "=== CONFIG LOADED FROM NVS (AP MODE) ===");
+    ESP_LOGI(TAG, "WiFi SSID: %s", wifi_ssid);
+    ESP_LOGI(TAG, "WiFi PASS: %s", wifi_pass);
+    ESP_LOGI(TAG, "MQTT Broker URL: %s", mqtt_broker_url);
+    ESP_LOGI(TAG, "BMS Topic: %s", bms_topic);
+    ESP_LOGI(TAG, "Sample interval (ms): %ld", sample_interval_ms);
+    ESP_LOGI(TAG, "Watchdog reset counter: %lu", watchdog_reset_counter);
+    ESP_LOGI(TAG, "Pack name: '%s'", pack_name);
+    ESP_LOGI(TAG, "=== STARTING AP CONFIG MODE ===");
+    
+    // Note: esp_netif_init() and esp_event_loop_create_default() 
+    // are already called in main app initialization
+    
+    // Start the captive portal
+    start_ap_and_captive_portal();
+    
+    // Wait a moment for the HTTP server to stabilize
+    vTaskDelay(pdMS_TO_TICKS(2000));
+    
+    // Start DNS hijack server for captive portal
+    TaskHandle_t dns_task_handle = NULL;
+    BaseType_t dns_task_result = xTaskCreate(dns_hijack_task, "dns_hijack_task", 4096, NULL, 4, &dns_task_handle);
+    if (dns_task_result == pdPASS) {
+        ESP_LOGI(TAG, "DNS hijack task started successfully");
+    } else {
+        ESP_LOGE(TAG, "Failed to create DNS hijack task");
+    }
+    
+    ESP_LOGI(TAG, "AP configuration mode fully initialized");
+    ESP_LOGI(TAG, "Connect to ESP32-CONFIG-XXXX network and visit any website to configure");
+    
+    vTaskDelete(NULL);
+}
+
+// ============================================================
+// Wi-Fi reconnect
+// ============================================================
+// The station never stops trying. The first reconnect after a drop goes out straight away, later
+// ones back off exponentially from WIFI_BACKOFF_MIN_MS up to WIFI_BACKOFF_MAX_MS, half of each
+// delay random so gateways sharing an AP do not all hit it at the same moment when it returns.
+// The BSSID and channel of the last association are kept in NVS (written only when they change)
+// and given to the driver, which then probes one channel instead of scanning all of them. After
+// WIFI_HINT_MAX_FAILS failed attempts with the hint it is left out and the driver scans again, so
+// an AP that changed channel or was replaced is still found.
+// With a fallback network configured the station switches network after WIFI_AP_SWITCH_FAILS
+// failed attempts in a row. Outages and reconnect times are reported in processor.wifi.
+#define WIFI_BACKOFF_MIN_MS 500
+#define WIFI_BACKOFF_MAX_MS 30000
+#define WIFI_HINT_MAX_FAILS 2
+#define WIFI_AP_SWITCH_FAILS 6
+
+typedef struct {
+    uint8_t ap;                         // 0 = primary network, 1 = fallback
+    uint8_t channel;
+    uint8_t bssid[6];
+} wifi_hint_t;
+
+static struct {
+    esp_timer_handle_t timer;           // Delayed reconnect
+    wifi_hint_t hint;                   // Last association, as stored in NVS
+    bool hint_valid;
+    bool hinted;                        // The current attempt uses the hint
+    uint8_t ap;                         // Network being tried or connected to
+    uint32_t attempt;                   // Failed attempts since the last connect
+    uint32_t ap_fails;                  // Failed attempts in a row on the current network
+    uint32_t hint_fails;                // Failed attempts in a row with the hint
+    int64_t attempt_us;                 // Start of the attempt in progress
+    int64_t down_us;                    // Start of the current outage, 0 while connected
+    uint16_t last_reason;               // Last disconnect reason (wifi_err_reason_t)
+    uint32_t disconnects;
+    uint32_t last_outage_ms;
+    uint32_t max_outage_ms;
+    uint64_t total_outage_ms;
+    uint32_t last_attempts;             // Attempts the last connect took
+    uint32_t assoc_ms;                  // Attempt start to association, last connect
+    uint32_t connect_ms;                // Attempt start to IP, last connect
+    uint32_t hinted_connects;
+    uint32_t scanned_connects;
+    uint32_t hint_drops;
+    uint32_t ap_switches;
+} wifi_link;
+
+static const char *wifi_link_ssid(void) {
+    return wifi_link.ap ? wifi_ssid2 : wifi_ssid;
+}
+
+static void wifi_hint_load(void) {
+    nvs_handle_t nvs_handle;
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK) {
+        return;
+    }
+    size_t len = sizeof(wifi_link.hint);
+    wifi_link.hint_valid = nvs_get_blob(nvs_handle, WIFI_NVS_KEY_HINT, &wifi_link.hint, &len) == ESP_OK &&
+                           len == sizeof(wifi_link.hint) && wifi_link.hint.channel != 0 &&
+                           (wifi_link.hint.ap == 0 || wifi_ssid2[0]);
+    nvs_close(nvs_handle);
+    if (wifi_link.hint_valid) {
+        // Start on the network that worked last
+        wifi_link.ap = wifi_link.hint.ap;
+        ESP_LOGI(TAG, "Wi-Fi: last AP " MACSTR " on channel %u", MAC2STR(wifi_link.hint.bssid), wifi_link.hint.channel);
+    }
+}
+
+static void wifi_hint_save(const uint8_t *bssid, uint8_t channel) {
+    wifi_hint_t hint = { .ap = wifi_link.ap, .channel = channel };
+    memcpy(hint.bssid, bssid, sizeof(hint.bssid));
+    if (wifi_link.hint_valid && memcmp(&hint, &wifi_link.hint, sizeof(hint)) == 0) {
+        return;                         // Same AP as before: no flash write
+    }
+    wifi_link.hint = hint;
+    wifi_link.hint_valid = true;
+    nvs_handle_t nvs_handle;
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle) == ESP_OK) {
+        nvs_set_blob(nvs_handle, WIFI_NVS_KEY_HINT, &hint, sizeof(hint));
+        nvs_commit(nvs_handle);
+        nvs_close(nvs_handle);
+    }
+}
+
+// Hands the current network to the driver, with the hint when it belongs to that network and
+// has not failed too often
+static void wifi_link_apply_config(void) {
+    wifi_config_t wifi_config = {
+        .sta = {
+            .threshold.authmode = WIFI_AUTH_WPA2_PSK,
+            .listen_interval = power_save_enabled ? POWER_LISTEN_INTERVAL : 0,
+        },
+    };
+    strncpy((char*)wifi_config.sta.ssid, wifi_link_ssid(), sizeof(wifi_config.sta.ssid)-1);
+    strncpy((char*)wifi_config.sta.password, wifi_link.ap ? wifi_pass2 : wifi_pass, sizeof(wifi_config.sta.password)-1);
+    wifi_link.hinted = wifi_link.hint_valid && wifi_link.hint.ap == wifi_link.ap && wifi_link.hint_fails < WIFI_HINT_MAX_FAILS;
+    if (wifi_link.hinted) {
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, wifi_link.hint.bssid, sizeof(wifi_config.sta.bssid));
+        wifi_config.sta.channel = wifi_link.hint.channel;
+    }
+    esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
+}
+
+// Delay before the next attempt: none for the first, then exponential with equal jitter
+static uint32_t wifi_backoff_ms(uint32_t attempt) {
+    if (attempt == 0) {
+        return 0;
+    }
+    uint32_t ms = attempt > 16 ? WIFI_BACKOFF_MAX_MS : (uint32_t)WIFI_BACKOFF_MIN_MS << (attempt - 1);
+    if (ms > WIFI_BACKOFF_MAX_MS) {
+        ms = WIFI_BACKOFF_MAX_MS;
+    }
+    return ms / 2 + esp_random() % (ms / 2 + 1);
+}
+
+static void wifi_link_connect(void *arg) {
+    wifi_link.attempt_us = esp_timer_get_time();
+    esp_err_t err = esp_wifi_connect();
+    if (err != ESP_OK) {
+        // No disconnect event follows a rejected attempt, so the retry is scheduled here
+        wifi_link.attempt++;
+        uint32_t delay_ms = wifi_backoff_ms(wifi_link.attempt);
+        ESP_LOGW(TAG, "Wi-Fi: connect failed (%s), next in %lu ms", esp_err_to_name(err), delay_ms);
+        esp_timer_start_once(wifi_link.timer, (uint64_t)delay_ms * 1000);
+    }
+}
+
+// Called from wifi_init_sta before the driver starts
+static void wifi_link_init(void) {
+    esp_timer_create_args_t timer_args = { .callback = wifi_link_connect, .name = "wifi_retry" };
+    esp_timer_create(&timer_args, &wifi_link.timer);
+    wifi_hint_load();
+    wifi_link_apply_config();
+}
+
+// WIFI_EVENT_STA_START, also after a Wi-Fi restart by link recovery
+static void wifi_link_started(void) {
+    esp_timer_stop(wifi_link.timer);
+    if (wifi_has_ip) {
+        // Stopped while connected without a disconnect event
+        wifi_has_ip = false;
+        wifi_link.disconnects++;
+        wifi_link.down_us = esp_timer_get_time();
+    }
+    wifi_link.attempt = 0;
+    wifi_link_apply_config();
+    wifi_link_connect(NULL);
+}
+
+// WIFI_EVENT_STA_DISCONNECTED: either the link dropped or an attempt failed
+static void wifi_link_disconnected(const wifi_event_sta_disconnected_t *event) {
+    int64_t now_us = esp_timer_get_time();
+    wifi_link.last_reason = event->reason;
+    if (wifi_has_ip) {
+        wifi_has_ip = false;
+        wifi_link.disconnects++;
+        wifi_link.down_us = now_us;
+        ESP_LOGW(TAG, "Wi-Fi: lost '%s' (reason %u)", wifi_link_ssid(), event->reason);
+    } else {
+        wifi_link.attempt++;
+        wifi_link.ap_fails++;
+        if (wifi_link.hinted && ++wifi_link.hint_fails == WIFI_HINT_MAX_FAILS) {
+            wifi_link.hint_drops++;
+            ESP_LOGW(TAG, "Wi-Fi: last AP not found, scanning all channels");
+        }
+        if (wifi_ssid2[0] && wifi_link.ap_fails >= WIFI_AP_SWITCH_FAILS) {
+            wifi_link.ap ^= 1;
+            wifi_link.ap_fails = 0;
+            wifi_link.hint_fails = 0;
+            wifi_link.ap_switches++;
+            ESP_LOGW(TAG, "Wi-Fi: switching to '%s'", wifi_link_ssid());
+        }
+    }
+    wifi_link_apply_config();
+    uint32_t delay_ms = wifi_backoff_ms(wifi_link.attempt);
+    if (delay_ms == 0) {
+        wifi_link_connect(NULL);
+    } else {
+        if (debug_logging) {
+            ESP_LOGI(TAG, "Wi-Fi: attempt %lu failed (reason %u), next in %lu ms", wifi_link.attempt, event->reason, delay_ms);
+        }
+        esp_timer_start_once(wifi_link.timer, (uint64_t)delay_ms * 1000);
+    }
+}
+
+// WIFI_EVENT_STA_CONNECTED
+static void wifi_link_associated(const wifi_event_sta_connected_t *event) {
+    wifi_link.assoc_ms = (uint32_t)((esp_timer_get_time() - wifi_link.attempt_us) / 1000);
+    wifi_link.hint_fails = 0;
+    wifi_hint_save(event->bssid, event->channel);
+}
+
+// IP_EVENT_STA_GOT_IP
+static void wifi_link_got_ip(void) {
+    if (wifi_has_ip) {
+        return;                         // Address change on a link that stayed up
+    }
+    int64_t now_us = esp_timer_get_time();
+    wifi_has_ip = true;
+    wifi_link.connect_ms = (uint32_t)((now_us - wifi_link.attempt_us) / 1000);
+    wifi_link.last_attempts = wifi_link.attempt + 1;
+    if (wifi_link.hinted) {
+        wifi_link.hinted_connects++;
+    } else {
+        wifi_link.scanned_connects++;
+    }
+    wifi_link.attempt = 0;
+    wifi_link.ap_fails = 0;
+    if (wifi_link.down_us) {
+        wifi_link.last_outage_ms = (uint32_t)((now_us - wifi_link.down_us) / 1000);
+        if (wifi_link.last_outage_ms > wifi_link.max_outage_ms) {
+            wifi_link.max_outage_ms = wifi_link.last_outage_ms;
+        }
+        wifi_link.total_outage_ms += wifi_link.last_outage_ms;
+        wifi_link.down_us = 0;
+        ESP_LOGW(TAG, "Wi-Fi: back on '%s' after %lu ms (%lu attempts, connect %lu ms, %s)", wifi_link_ssid(),
+                 wifi_link.last_outage_ms, wifi_link.last_attempts, wifi_link.connect_ms, wifi_link.hinted ? "last AP" : "scan");
+    }
+}
+
+// True when no attempt was started for longer than the backoff allows: the driver is stuck,
+// as opposed to the network being out of reach
+static bool wifi_link_stalled(void) {
+    return !wifi_has_ip && esp_timer_get_time() - wifi_link.attempt_us > 2LL * WIFI_BACKOFF_MAX_MS * 1000;
+}
+
+static void wifi_link_json(cJSON *processor_root) {
+    cJSON *root = cJSON_CreateObject();
+    if (!root) {
+        return;
+    }
+    char bssid[18] = "";
+    if (wifi_link.hint_valid) {
+        snprintf(bssid, sizeof(bssid), MACSTR, MAC2STR(wifi_link.hint.bssid));
+    }
+    int64_t now_us = esp_timer_get_time();
+    cJSON_AddBoolToObject(root, "connected", wifi_has_ip);
+    cJSON_AddStringToObject(root, "network", wifi_link.ap ? "fallback" : "primary");
+    cJSON_AddStringToObject(root, "bssid", bssid);
+    cJSON_AddNumberToObject(root, "channel", wifi_link.hint_valid ? wifi_link.hint.channel : 0);
+    cJSON_AddNumberToObject(root, "outageMs", wifi_link.down_us ? (double)((now_us - wifi_link.down_us) / 1000) : 0);
+    cJSON_AddNumberToObject(root, "attempts", wifi_link.attempt);
+    cJSON_AddNumberToObject(root, "lastReason", wifi_link.last_reason);
+    cJSON_AddNumberToObject(root, "disconnects", wifi_link.disconnects);
+    cJSON_AddNumberToObject(root, "lastOutageMs", wifi_link.last_outage_ms);
+    cJSON_AddNumberToObject(root, "maxOutageMs", wifi_link.max_outage_ms);
+    cJSON_AddNumberToObject(root, "totalOutageMs", (double)wifi_link.total_outage_ms);
+    cJSON_AddNumberToObject(root, "lastAttempts", wifi_link.last_attempts);
+    cJSON_AddNumberToObject(root, "assocMs", wifi_link.assoc_ms);
+    cJSON_AddNumberToObject(root, "connectMs", wifi_link.connect_ms);
+    cJSON_AddNumberToObject(root, "lastApConnects", wifi_link.hinted_connects);
+    cJSON_AddNumberToObject(root, "scanConnects", wifi_link.scanned_connects);
+    cJSON_AddNumberToObject(root, "lastApMisses", wifi_link.hint_drops);
+    cJSON_AddNumberToObject(root, "networkSwitches", wifi_link.ap_switches);
+    cJSON_AddItemToObject(processor_root, "wifi", root);
+}
+
+// ============================================================
+// Link recovery
+// ============================================================
+// The software watchdog checks the broker link and the BMS link separately and works through
+// increasingly drastic steps for each, one per watchdog timeout, while polling and buffering
+// carry on:
+//   broker: MQTT reconnect -> Wi-Fi stack restart -> reboot only if the Wi-Fi reconnect loop
+//           stalled. With an IP the broker itself is down, without one the network is, and a
+//           reboot fixes neither; the gateway keeps collecting and starts the steps again every
+//           RECOVERY_OUTAGE_RETRY timeouts.
+//   BMS:    UART driver re-init (and baud re-probe when set to auto), repeated each timeout.
+// The broker link is faulty when nothing was confirmed for a timeout and either MQTT is down or
+// a publish is still waiting for confirmation, so a silent BMS does not look like a broker fault.
+// Time spent in each step and the step that cleared the fault are reported in processor.recovery.
+#define RECOVERY_OUTAGE_RETRY 4
+
+typedef enum {
+    REC_OK = 0,
+    REC_MQTT_RECONNECT,
+    REC_WIFI_RESTART,
+    REC_WIFI_OUTAGE,
+    REC_BROKER_OUTAGE,
+    REC_UART_REINIT,
+    REC_REBOOT,
+    REC_STAGE_COUNT
+} recovery_stage_t;
+
+static const char *recovery_stage_names[REC_STAGE_COUNT] = {
+    "ok", "mqttReconnect", "wifiRestart", "wifiOutage", "brokerOutage", "uartReinit", "reboot"
+};
+
+typedef struct {
+    const char *name;
+    recovery_stage_t stage;
+    int64_t fault_start_us;
+    int64_t stage_start_us;
+    uint32_t faults;
+    uint32_t entered[REC_STAGE_COUNT];
+    uint32_t stage_ms[REC_STAGE_COUNT]; // Total time spent in each step
+    uint32_t cleared[REC_STAGE_COUNT];  // Faults that ended during each step
+    recovery_stage_t last_cleared_by;
+    uint32_t last_fault_ms;
+} recovery_link_t;
+
+static struct {
+    recovery_link_t broker;
+    recovery_link_t bms;
+} recovery = {
+    .broker = { .name = "broker" },
+    .bms = { .name = "bms" },
+};
+
+static void recovery_enter(recovery_link_t *l, recovery_stage_t stage, int64_t now_us) {
+    if (l->stage == REC_OK) {
+        l->faults++;
+        l->fault_start_us = now_us;
+    } else {
+        l->stage_ms[l->stage] += (uint32_t)((now_us - l->stage_start_us) / 1000);
+    }
+    l->stage = stage;
+    l->stage_start_us = now_us;
+    l->entered[stage]++;
+    ESP_LOGW(TAG, "Recovery (%s link): %s, fault for %lld ms", l->name, recovery_stage_names[stage],
+             (now_us - l->fault_start_us) / 1000);
+}
+
+static void recovery_clear(recovery_link_t *l, int64_t now_us) {
+    if (l->stage == REC_OK) {
+        return;
+    }
+    l->stage_ms[l->stage] += (uint32_t)((now_us - l->stage_start_us) / 1000);
+    l->cleared[l->stage]++;
+    l->last_cleared_by = l->stage;
+    l->last_fault_ms = (uint32_t)((now_us - l->fault_start_us) / 1000);
+    ESP_LOGW(TAG, "Recovery (%s link): recovered during %s after %lu ms", l->name,
+             recovery_stage_names[l->stage], l->last_fault_ms);
+    l->stage = REC_OK;
+}
+
+static void recovery_mqtt_reconnect(void) {
+    if (!mqtt_client) {
+        return;
+    }
+    if (mqtt_connected) {
+        // Connected but nothing acknowledged: drop the session and start a new one
+        esp_mqtt_client_disconnect(mqtt_client);
+    }
+    esp_mqtt_client_reconnect(mqtt_client);
+}
+
+static void recovery_wifi_restart(void) {
+    esp_wifi_stop();                    // The disconnect event clears wifi_has_ip
+    esp_wifi_start();                   // WIFI_EVENT_STA_START connects again
+}
+
+static void recovery_uart_reinit(void) {
+    uart_driver_delete(UART_NUM);
+    init_uart();
+    if (bms_baud_config == 0) {
+        // Runs with the next poll cycle, once the cycle's own exchanges are done
+        bms_sched_push(&bms_sched, BMS_PRIO_DIAG, BMS_JOB_PROBE, 0);
+    }
+}
+
+static void recovery_reboot(void) {
+    watchdog_reset_counter++;
+    ESP_LOGE(TAG, "Recovery: Wi-Fi stopped reconnecting, rebooting (restart #%lu)", watchdog_reset_counter);
+    save_watchdog_counter_to_nvs();
+    // Flush the energy counters so the restart does not lose the unsaved portion
+    save_energy_counters_to_nvs();
+    rtc_snapshot_save();
+    vTaskDelay(pdMS_TO_TICKS(100));
+    esp_restart();
+}
+
+// Called from the main loop before each poll cycle. timeout_ms is the broker timeout, which is
+// longer than watchdog_timeout_ms when batches are the only regular publish.
+static void recovery_check(uint32_t timeout_ms) {
+    int64_t now_us = esp_timer_get_time();
+
+    recovery_link_t *b = &recovery.broker;
+    uint32_t since_publish_ms = pdTICKS_TO_MS(xTaskGetTickCount() - last_successful_publish);
+    if (since_publish_ms < timeout_ms || (mqtt_connected && !publish_unconfirmed)) {
+        recovery_clear(b, now_us);
+    } else {
+        uint32_t in_stage_ms = (uint32_t)((now_us - b->stage_start_us) / 1000);
+        switch (b->stage) {
+        case REC_OK:
+            ESP_LOGE(TAG, "Software watchdog: no MQTT publish confirmed in %lu ms (timeout: %lu ms)", since_publish_ms, timeout_ms);
+            recovery_enter(b, REC_MQTT_RECONNECT, now_us);
+            recovery_mqtt_reconnect();
+            break;
+        case REC_MQTT_RECONNECT:
+            if (in_stage_ms >= timeout_ms) {
+                recovery_enter(b, REC_WIFI_RESTART, now_us);
+                recovery_wifi_restart();
+            }
+            break;
+        case REC_WIFI_RESTART:
+            if (in_stage_ms >= timeout_ms) {
+                if (wifi_link_stalled()) {
+                    recovery_enter(b, REC_REBOOT, now_us);
+                    recovery_reboot();
+                }
+                recovery_enter(b, wifi_has_ip ? REC_BROKER_OUTAGE : REC_WIFI_OUTAGE, now_us);
+            }
+            break;
+        case REC_WIFI_OUTAGE:
+            if (wifi_link_stalled()) {
+                recovery_enter(b, REC_REBOOT, now_us);
+                recovery_reboot();
+            }
+            // fall through
+        case REC_BROKER_OUTAGE:
+            if (in_stage_ms >= RECOVERY_OUTAGE_RETRY * timeout_ms) {
+                recovery_enter(b, REC_MQTT_RECONNECT, now_us);
+                recovery_mqtt_reconnect();
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    recovery_link_t *u = &recovery.bms;
+    int64_t bms_timeout_us = (int64_t)watchdog_timeout_ms * 1000;
+    if (now_us - bms_last_sample_us < bms_timeout_us) {
+        recovery_clear(u, now_us);
+    } else if (u->stage == REC_OK || now_us - u->stage_start_us >= bms_timeout_us) {
+        recovery_enter(u, REC_UART_REINIT, now_us);
+        recovery_uart_reinit();
+    }
+}
+
+// Adds the counters of one link, listing only the steps it uses
+static void recovery_link_json(cJSON *parent, const recovery_link_t *l, const recovery_stage_t *stages, int n) {
+    cJSON *link = cJSON_CreateObject();
+    if (!link) {
+        return;
+    }
+    int64_t now_us = esp_timer_get_time();
+    cJSON_AddStringToObject(link, "stage", recovery_stage_names[l->stage]);
+    cJSON_AddNumberToObject(link, "faultMs", l->stage == REC_OK ? 0 : (double)((now_us - l->fault_start_us) / 1000));
+    cJSON_AddNumberToObject(link, "faults", l->faults);
+    cJSON_AddNumberToObject(link, "lastFaultMs", l->last_fault_ms);
+    cJSON_AddStringToObject(link, "lastClearedBy", l->faults ? recovery_stage_names[l->last_cleared_by] : "none");
+    for (int i = 0; i < n; ++i) {
+        recovery_stage_t s = stages[i];
+        cJSON *step = cJSON_CreateObject();
+        if (!step) {
+            continue;
+        }
+        uint32_t ms = l->stage_ms[s] + (l->stage == s ? (uint32_t)((now_us - l->stage_start_us) / 1000) : 0);
+        cJSON_AddNumberToObject(step, "count", l->entered[s]);
+        cJSON_AddNumberToObject(step, "ms", ms);
+        cJSON_AddNumberToObject(step, "cleared", l->cleared[s]);
+        cJSON_AddItemToObject(link, recovery_stage_names[s], step);
+    }
+    cJSON_AddItemToObject(parent, l->name, link);
+}
+
+static void recovery_json(cJSON *processor_root) {
+    static const recovery_stage_t broker_stages[] = { REC_MQTT_RECONNECT, REC_WIFI_RESTART, REC_WIFI_OUTAGE, REC_BROKER_OUTAGE };
+    static const recovery_stage_t bms_stages[] = { REC_UART_REINIT };
+    cJSON *root = cJSON_CreateObject();
+    if (!root) {
+        return;
+    }
+    cJSON_AddBoolToObject(root, "enabled", watchdog_enabled);
+    cJSON_AddNumberToObject(root, "timeoutMs", watchdog_timeout_ms);
+    recovery_link_json(root, &recovery.broker, broker_stages, sizeof(broker_stages) / sizeof(broker_stages[0]));
+    recovery_link_json(root, &recovery.bms, bms_stages, sizeof(bms_stages) / sizeof(bms_stages[0]));
+    cJSON_AddItemToObject(processor_root, "recovery", root);
 }
 
-void ap_config_task(void *pvParameter) {
-    ESP_LOGI(TAG, "Starting AP configuration mode...");
-    
-    // Debug: Show watchdog counter before loading from NVS
-    ESP_LOGI(TAG, "*** DEBUG: watchdog_reset_counter before NVS load (AP mode): %lu ***", watchdog_reset_counter);
-    
-    // Load NVS values before starting AP and HTTP server
-    load_wifi_config_from_nvs();
-    load_mqtt_config_from_nvs();
-    load_sample_interval_from_nvs();
-    load_bms_topic_from_nvs();
-    load_watchdog_counter_from_nvs();
-    load_pack_name_from_nvs();
-    
-    // Debug: Show watchdog counter after loading from NVS
-    ESP_LOGI(TAG, "*** DEBUG: watchdog_reset_counter after NVS load (AP mode): %lu ***", watchdog_reset_counter);
-    
-    ESP_LOGI(TAG, "=== CONFIG LOADED FROM NVS (AP MODE) ===");
-    ESP_LOGI(TAG, "WiFi SSID: %s", wifi_ssid);
-    ESP_LOGI(TAG, "WiFi PASS: %s", wifi_pass);
-    ESP_LOGI(TAG, "MQTT Broker URL: %s", mqtt_broker_url);
-    ESP_LOGI(TAG, "BMS Topic: %s", bms_topic);
-    ESP_LOGI(TAG, "Sample interval (ms): %ld", sample_interval_ms);
-    ESP_LOGI(TAG, "Watchdog reset counter: %lu", watchdog_reset_counter);
-    ESP_LOGI(TAG, "Pack name: '%s'", pack_name);
-    ESP_LOGI(TAG, "=== STARTING AP CONFIG MODE ===");
-    
-    // Note: esp_netif_init() and esp_event_loop_create_default() 
-    // are already called in main app initialization
-    
-    // Start the captive portal
-    start_ap_and_captive_portal();
-    
-    // Wait a moment for the HTTP server to stabilize
-    vTaskDelay(pdMS_TO_TICKS(2000));
-    
-    // Start DNS hijack server for captive portal
-    TaskHandle_t dns_task_handle = NULL;
-    BaseType_t dns_task_result = xTaskCreate(dns_hijack_task, "dns_hijack_task", 4096, NULL, 4, &dns_task_handle);
-    if (dns_task_result == pdPASS) {
-        ESP_LOGI(TAG, "DNS hijack task started successfully");
-    } else {
-        ESP_LOGE(TAG, "Failed to create DNS hijack task");
+// ============================================================
+// Boot path
+// ============================================================
+// Config (AP) mode is requested without holding up a normal boot:
+//  - the BOOT button held while the device starts, or pressed at any time afterwards. The press
+//    is caught by a GPIO interrupt and debounced by a one-shot esp_timer; a short-lived task then
+//    saves the energy counters and restarts straight into config mode through an RTC flag. The
+//    flag is only trusted after a software reset; after power-on RTC memory holds garbage.
+//  - two external (EN pin) resets within BOOT_DOUBLE_RESET_WINDOW_MS, seen through a marker in
+//    NVS that a short-lived task erases once the window has passed. Power-on resets never count,
+//    so a bouncing supply or a BMS cutoff cycling the gateway cannot put it into config mode.
+//    The classic ESP32 reports its EN pin as a power-on reset, so there only the button applies.
+// Config mode restarts into normal mode after BOOT_CONFIG_IDLE_TIMEOUT_MS without a client on the
+// AP, so a unit that ends up there unattended goes back to collecting data.
+// A normal boot starts polling the BMS straight away. Wi-Fi and MQTT come up in the background,
+// and samples taken meanwhile wait in the MQTT outbox until the broker connection is up.
+#define BOOT_CONFIG_MAGIC 0xC0F16A7EUL
+#define BOOT_DOUBLE_RESET_WINDOW_MS 3000
+#define BOOT_CONFIG_IDLE_TIMEOUT_MS (10 * 60 * 1000)
+#define BOOT_BTN_DEBOUNCE_MS 50
+
+static RTC_NOINIT_ATTR uint32_t boot_config_request;
+static esp_timer_handle_t boot_btn_timer = NULL;
+
+static bool boot_double_reset_marker_get(void) {
+    nvs_handle_t nvs_handle;
+    uint8_t marker = 0;
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) == ESP_OK) {
+        nvs_get_u8(nvs_handle, NVS_KEY_DOUBLE_RESET, &marker);
+        nvs_close(nvs_handle);
     }
-    
-    ESP_LOGI(TAG, "AP configuration mode fully initialized");
-    ESP_LOGI(TAG, "Connect to ESP32-CONFIG-XXXX network and visit any website to configure");
-    
+    return marker != 0;
+}
+
+static void boot_double_reset_marker_set(bool set) {
+    nvs_handle_t nvs_handle;
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle) == ESP_OK) {
+        if (set) {
+            nvs_set_u8(nvs_handle, NVS_KEY_DOUBLE_RESET, 1);
+        } else {
+            nvs_erase_key(nvs_handle, NVS_KEY_DOUBLE_RESET);
+        }
+        nvs_commit(nvs_handle);
+        nvs_close(nvs_handle);
+    }
+}
+
+// Closes the double-reset window. A task rather than an esp_timer callback because of the NVS write.
+static void boot_double_reset_task(void *param) {
+    vTaskDelay(pdMS_TO_TICKS(BOOT_DOUBLE_RESET_WINDOW_MS));
+    boot_double_reset_marker_set(false);
     vTaskDelete(NULL);
 }
 
+// Returns what asked for config mode on this boot, or NULL for a normal boot
+static const char *boot_config_trigger(void) {
+    const char *trigger = NULL;
+    esp_reset_reason_t reason = esp_reset_reason();
+    gpio_set_direction(BOOT_BTN_GPIO, GPIO_MODE_INPUT);
+    gpio_set_pull_mode(BOOT_BTN_GPIO, GPIO_PULLUP_ONLY);
+    bool user_reset = reason == ESP_RST_EXT;
+    bool marker = boot_double_reset_marker_get();
+    if (reason == ESP_RST_SW && boot_config_request == BOOT_CONFIG_MAGIC) {
+        trigger = "button";
+    } else if (user_reset && marker) {
+        trigger = "double reset";
+    } else if (gpio_get_level(BOOT_BTN_GPIO) == 0) {
+        trigger = "button held at boot";
+    }
+    boot_config_request = 0;
+    if (!trigger && user_reset) {
+        // Arm the double-reset window; another EN reset before it closes means config mode
+        boot_double_reset_marker_set(true);
+        if (xTaskCreate(boot_double_reset_task, "dbl_reset_task", 3072, NULL, 1, NULL) != pdPASS) {
+            boot_double_reset_marker_set(false);
+        }
+    } else if (marker) {
+        // Entering config mode, or any other reset inside the window: not a double reset
+        boot_double_reset_marker_set(false);
+    }
+    return trigger;
+}
+
+// Runs in the main task for as long as config mode lasts. A form submit restarts from its own
+// handler; without any client on the AP for BOOT_CONFIG_IDLE_TIMEOUT_MS, restart into normal mode.
+static void boot_config_wait(void) {
+    int64_t idle_since_us = esp_timer_get_time();
+    while (1) {
+        esp_task_wdt_reset(); // Feed watchdog in config mode
+        vTaskDelay(1000/portTICK_PERIOD_MS);
+        wifi_sta_list_t clients;
+        int64_t now_us = esp_timer_get_time();
+        if (esp_wifi_ap_get_sta_list(&clients) == ESP_OK && clients.num > 0) {
+            idle_since_us = now_us;
+        } else if (now_us - idle_since_us >= (int64_t)BOOT_CONFIG_IDLE_TIMEOUT_MS * 1000) {
+            ESP_LOGW(TAG, "No config client for %d min, restarting into normal mode", BOOT_CONFIG_IDLE_TIMEOUT_MS / 60000);
+            esp_restart();
+        }
+    }
+}
+
+// The NVS write needs more stack than the esp_timer task can spare, so it gets its own task
+static void boot_btn_task(void *param) {
+    ESP_LOGW(TAG, "Boot button pressed, restarting into config mode");
+    save_energy_counters_to_nvs();
+    boot_config_request = BOOT_CONFIG_MAGIC;
+    esp_restart();
+}
+
+// Runs in the esp_timer task once the debounce time has passed: a press that is still down
+// restarts into config mode, anything shorter re-arms the interrupt
+static void boot_btn_debounced(void *arg) {
+    if (gpio_get_level(BOOT_BTN_GPIO) != 0) {
+        gpio_intr_enable(BOOT_BTN_GPIO);
+        return;
+    }
+    if (xTaskCreate(boot_btn_task, "boot_btn_task", 4096, NULL, 5, NULL) != pdPASS) {
+        gpio_intr_enable(BOOT_BTN_GPIO);
+    }
+}
+
+// Low-level rather than edge-triggered so the same setting can wake the chip from light sleep
+static void boot_btn_isr(void *arg) {
+    gpio_intr_disable(BOOT_BTN_GPIO);
+    esp_timer_start_once(boot_btn_timer, (uint64_t)BOOT_BTN_DEBOUNCE_MS * 1000);
+}
+
+static void boot_btn_arm(void) {
+    esp_timer_create_args_t timer_args = { .callback = boot_btn_debounced, .name = "boot_btn" };
+    if (esp_timer_create(&timer_args, &boot_btn_timer) != ESP_OK) {
+        ESP_LOGE(TAG, "Boot button: failed to create debounce timer, button disabled");
+        return;
+    }
+    gpio_set_intr_type(BOOT_BTN_GPIO, GPIO_INTR_LOW_LEVEL);
+    gpio_install_isr_service(0);
+    gpio_isr_handler_add(BOOT_BTN_GPIO, boot_btn_isr, NULL);
+    gpio_intr_enable(BOOT_BTN_GPIO);
+}
+
 // Blink task for onboard LED
 #define ONBOARD_LED_GPIO GPIO_NUM_2
 
@@ -1954,32 +5175,18 @@ void app_main(void) {
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     ESP_LOGI(TAG, "Network stack initialized successfully");
 
-    ESP_LOGI(TAG, "Waiting 10 seconds for boot button press...");
-    gpio_set_direction(BOOT_BTN_GPIO, GPIO_MODE_INPUT);
-    bool boot_btn_pressed = false;
-    for (int i = 0; i < 1000; ++i) { // 10 seconds, check every 10ms
-        if (gpio_get_level(BOOT_BTN_GPIO) == 0) {
-            boot_btn_pressed = true;
-            ESP_LOGI(TAG, "Boot button press detected during wait!");
-            break;
-        }
-        // Feed watchdog every 100 iterations (1 second)
-        if (i % 100 == 0) {
-            esp_task_wdt_reset();
-        }
-        vTaskDelay(10 / portTICK_PERIOD_MS);
-    }
-    ESP_LOGI(TAG, "Boot button wait finished, continuing startup...");
-    if (boot_btn_pressed) {
-        ESP_LOGI(TAG, "Entering AP config mode due to boot button press.");
+    const char *config_trigger = boot_config_trigger();
+    if (config_trigger) {
+        ESP_LOGW(TAG, "Entering AP config mode (%s).", config_trigger);
         xTaskCreate(ap_config_task, "ap_config_task", 8192, NULL, 5, NULL);
-        while (1) {
-            esp_task_wdt_reset(); // Feed watchdog in config mode
-            vTaskDelay(1000/portTICK_PERIOD_MS); // Block forever
-        }
+        boot_config_wait();
     }
 
+    boot_btn_arm();
+
     // Initialize UART communication.
+    load_bms_baud_from_nvs();
+    load_full_read_interval_from_nvs();
     init_uart();
 
     // Debug: Show watchdog counter before loading from NVS
@@ -1991,6 +5198,19 @@ void app_main(void) {
     load_bms_topic_from_nvs();
     load_watchdog_counter_from_nvs();
     load_pack_name_from_nvs();
+    load_energy_counters_from_nvs();
+    load_latency_terminal_from_nvs();
+    load_mqtt_cmd_from_nvs();
+    load_mqtt_outbox_from_nvs();
+    load_batch_from_nvs();
+    load_ntp_server_from_nvs();
+    load_power_save_from_nvs();
+    load_output_streams_from_nvs();
+    bms_sched_init(&bms_sched);
+    if (mqtt_cmd_enabled) {
+        bms_cmd_queue = xQueueCreate(BMS_CMD_QUEUE_LEN, sizeof(bms_cmd_t));
+    }
+    rtc_snapshot_restore();
     
     // Debug: Show watchdog counter after loading from NVS
     ESP_LOGI(TAG, "*** DEBUG: watchdog_reset_counter after NVS load (normal mode): %lu ***", watchdog_reset_counter);
@@ -2004,14 +5224,23 @@ void app_main(void) {
     ESP_LOGI(TAG, "Watchdog reset counter: %lu", watchdog_reset_counter);
     ESP_LOGI(TAG, "Pack name: %s", pack_name);
     
-    // Initialize SPIFFS for normal operation mode
+    // Wi-Fi connects in the background while SPIFFS mounts and the first samples are taken.
+    // The MQTT client exists from here on so those samples can be queued before it connects.
+    mqtt_app_init();
+    ESP_LOGI(TAG, "=== STARTING WIFI INIT ===");
+    ESP_LOGI(TAG, "ESP_WIFI_MODE_STA");
+    wifi_init_sta(); // Initialize Wi-Fi
+    power_init();
+    
+    // Initialize SPIFFS for normal operation mode (the software version is read from it)
     ESP_LOGI(TAG, "About to call init_spiffs() in normal mode...");
     init_spiffs();
     ESP_LOGI(TAG, "init_spiffs() completed successfully in normal mode");
+    device_info_init();
     
-    ESP_LOGI(TAG, "=== STARTING WIFI INIT ===");
-    ESP_LOGI(TAG, "ESP_WIFI_MODE_STA");
-    wifi_init_sta(); // Initialize Wi-Fi
+    if (bms_baud_config == 0 && !bms_wire.probed) {
+        bms_baud_autoprobe();
+    }
     
     // Initialize software watchdog
     // Watchdog timeout is 10× sample interval (in ms), inactive if timeout ≤10,000 ms
@@ -2025,176 +5254,998 @@ void app_main(void) {
         ESP_LOGI(TAG, "Software watchdog inactive (timeout ≤10,000 ms, sample interval: %lu ms)", sample_interval_ms);
     }
 
-    // Buffer to attempt to read and discard UART echo. Size of the command sent.
-    uint8_t echo_buf[sizeof(bms_read_all_cmd)]; 
-
-    // Main loop to periodically send command and read response from BMS.
-    while (1) {
-        ESP_LOGD(TAG, "[MAIN LOOP] Start iteration");
-        esp_task_wdt_reset();
-        
-        // Check software watchdog timeout
-        ESP_LOGD(TAG, "[MAIN LOOP] Check software watchdog");
-        if (watchdog_enabled) {
-            TickType_t current_time = xTaskGetTickCount();
-            TickType_t elapsed_ms = pdTICKS_TO_MS(current_time - last_successful_publish);
-            if (elapsed_ms >= watchdog_timeout_ms) {
-                ESP_LOGE(TAG, "Software watchdog timeout! No successful MQTT publish in %lu ms (timeout: %lu ms)", elapsed_ms, watchdog_timeout_ms);
-                
-                // Debug: Show counter before increment
-                ESP_LOGE(TAG, "*** DEBUG: watchdog_reset_counter BEFORE increment: %lu ***", watchdog_reset_counter);
-                
-                // Increment watchdog reset counter and save to NVS
-                watchdog_reset_counter++;
-                ESP_LOGE(TAG, "Incrementing watchdog reset counter to: %lu", watchdog_reset_counter);
-                
-                // Debug: Show counter after increment
-                ESP_LOGE(TAG, "*** DEBUG: watchdog_reset_counter AFTER increment: %lu ***", watchdog_reset_counter);
-                
-                save_watchdog_counter_to_nvs();
-                
-                // Debug: Verify save by reloading from NVS
-                uint32_t verify_counter = 0;
-                nvs_handle_t verify_handle;
-                esp_err_t verify_err = nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &verify_handle);
-                if (verify_err == ESP_OK) {
-                    esp_err_t get_err = nvs_get_u32(verify_handle, NVS_KEY_WATCHDOG_COUNTER, &verify_counter);
-                    ESP_LOGE(TAG, "*** DEBUG: Verification read from NVS result: %s, value: %lu ***", 
-                             esp_err_to_name(get_err), verify_counter);
-                    nvs_close(verify_handle);
-                } else {
-                    ESP_LOGE(TAG, "*** DEBUG: Failed to open NVS for verification: %s ***", esp_err_to_name(verify_err));
-                }
-                
-                ESP_LOGE(TAG, "Forcing system restart...");
-                vTaskDelay(pdMS_TO_TICKS(100));
-                esp_restart();
+    // Main loop to periodically send command and read response from BMS.
+    while (1) {
+        ESP_LOGD(TAG, "[MAIN LOOP] Start iteration");
+        esp_task_wdt_reset();
+        
+        // Software watchdog: staged recovery of the broker and BMS links (see recovery_check())
+        ESP_LOGD(TAG, "[MAIN LOOP] Check software watchdog");
+        if (watchdog_enabled) {
+            uint32_t timeout_ms = watchdog_timeout_ms;
+            if (out_streams[OUT_TELEMETRY].encoding == OUT_ENC_OFF && out_streams[OUT_BATCH].encoding != OUT_ENC_OFF) {
+                // Batches are then the only regular publish: allow two full batch windows between them
+                uint32_t window_ms = batch_size * (uint32_t)sample_interval_ms;
+                if (batch_max_age_ms > 0 && batch_max_age_ms < window_ms) {
+                    window_ms = batch_max_age_ms;
+                }
+                if (2 * window_ms > timeout_ms) {
+                    timeout_ms = 2 * window_ms;
+                }
+            }
+            recovery_check(timeout_ms);
+        }
+        ESP_LOGD(TAG, "[MAIN LOOP] After software watchdog check");
+
+        mqtt_publish_success = false;
+        ESP_LOGD(TAG, "[MAIN LOOP] After reset mqtt_publish_success");
+
+        bms_poll_cycle();
+        ESP_LOGD(TAG, "[MAIN LOOP] After bms_poll_cycle");
+
+        if (debug_logging) {
+            ESP_LOGI(TAG, "Waiting %ld ms before next BMS read cycle...", sample_interval_ms);
+        }
+        bms_idle_wait(sample_interval_ms);
+        ESP_LOGD(TAG, "[MAIN LOOP] End of iteration, feeding TWDT");
+        esp_task_wdt_reset();
+    }
+}
+
+// Wi-Fi Event Handler
+static void wifi_event_handler(void* arg, esp_event_base_t event_base,
+                                int32_t event_id, void* event_data)
+{
+    printf("[WIFI] Event handler called: base=%s, event_id=%ld\n", event_base, event_id);
+    
+    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+        printf("[WIFI] WIFI_EVENT_STA_START - connecting to '%s'\n", wifi_link_ssid());
+        wifi_link_started();
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        wifi_link_associated((wifi_event_sta_connected_t*) event_data);
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        printf("[WIFI] WIFI_EVENT_STA_DISCONNECTED - attempt=%lu\n", wifi_link.attempt);
+        device_info_set_ip(NULL);
+        wifi_link_disconnected((wifi_event_sta_disconnected_t*) event_data);
+    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+        printf("[WIFI] IP_EVENT_STA_GOT_IP received!\n");
+        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
+        printf("[WIFI] got ip:" IPSTR "\n", IP2STR(&event->ip_info.ip));
+        printf("Obtained IP address: " IPSTR "\n", IP2STR(&event->ip_info.ip));
+        wifi_link_got_ip();
+        device_info_set_ip(&event->ip_info.ip);
+        boot_mark(&boot_marks.wifi_ip_us);
+        time_sync_start();
+        // Start MQTT client once IP is obtained
+        printf("[WIFI] About to start MQTT client...\n");
+        mqtt_app_start();
+        printf("[WIFI] MQTT client start function completed\n");
+    } else {
+        printf("[WIFI] Unhandled event: base=%s, event_id=%ld\n", event_base, event_id);
+    }
+    printf("[WIFI] Event handler completed\n");
+}
+
+// Wi-Fi Initialization
+void wifi_init_sta(void)
+{
+    // Note: esp_netif_init() and esp_event_loop_create_default() 
+    // are already called in main app initialization
+    esp_netif_create_default_wifi_sta();
+
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    // Credentials live in our own NVS namespace; the driver copy would rewrite flash on every
+    // config change the reconnect loop makes (hint on/off, network switch)
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+
+    esp_event_handler_instance_t instance_any_id;
+    esp_event_handler_instance_t instance_got_ip;
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
+                                                        ESP_EVENT_ANY_ID,
+                                                        &wifi_event_handler,
+                                                        NULL,
+                                                        &instance_any_id));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
+                                                        IP_EVENT_STA_GOT_IP,
+                                                        &wifi_event_handler,
+                                                        NULL,
+                                                        &instance_got_ip));
+
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
+    wifi_link_init(); // Network, password and last AP
+    ESP_ERROR_CHECK(esp_wifi_start() );
+
+    ESP_LOGI(TAG, "wifi_init_sta finished.");
+}
+
+// ============================================================
+// Fan-out publishing
+// ============================================================
+// Optional one-scalar-per-topic output for Home Assistant and flat consumers. A value is only
+// published when it moved by more than its deadband since the last publish, or when it has not
+// been published for FANOUT_REFRESH_MS, so consumers never see it go stale. Everything is sent
+// again after each (re)connect. Discovery configs for every fan-out topic are published once
+// per boot, retained, as soon as the cell count is known.
+#define FANOUT_REFRESH_MS (5 * 60 * 1000)
+#define FANOUT_CELL_DEADBAND_MV 2.0f
+
+typedef enum {
+    FANOUT_SOC = 0,
+    FANOUT_VOLTAGE,
+    FANOUT_CURRENT,
+    FANOUT_POWER,
+    FANOUT_CELL_MIN_MV,
+    FANOUT_CELL_MAX_MV,
+    FANOUT_CELL_DELTA_MV,
+    FANOUT_MOS_TEMP,
+    FANOUT_PROBE1_TEMP,
+    FANOUT_PROBE2_TEMP,
+    FANOUT_CHARGE_MOS,
+    FANOUT_DISCHARGE_MOS,
+    FANOUT_BALANCING,
+    FANOUT_CYCLE_COUNT,
+    FANOUT_FIELD_COUNT
+} fanout_field_id_t;
+
+typedef struct {
+    const char *field;                  // Topic level and discovery object id
+    const char *name;                   // Home Assistant entity name (after the pack name)
+    const char *unit;                   // NULL for unitless
+    const char *device_class;           // NULL if Home Assistant has none for it
+    float deadband;
+    uint8_t decimals;
+} fanout_field_t;
+
+static const fanout_field_t fanout_fields[FANOUT_FIELD_COUNT] = {
+    [FANOUT_SOC]           = { "soc",          "SOC",                "%",  "battery",     0.5f, 0 },
+    [FANOUT_VOLTAGE]       = { "voltage",      "Voltage",            "V",  "voltage",     0.02f, 2 },
+    [FANOUT_CURRENT]       = { "current",      "Current",            "A",  "current",     0.1f, 2 },
+    [FANOUT_POWER]         = { "power",        "Power",              "W",  "power",       5.0f, 1 },
+    [FANOUT_CELL_MIN_MV]   = { "cellMinMv",    "Cell Min",           "mV", "voltage",     FANOUT_CELL_DEADBAND_MV, 0 },
+    [FANOUT_CELL_MAX_MV]   = { "cellMaxMv",    "Cell Max",           "mV", "voltage",     FANOUT_CELL_DEADBAND_MV, 0 },
+    [FANOUT_CELL_DELTA_MV] = { "cellDeltaMv",  "Cell Delta",         "mV", "voltage",     FANOUT_CELL_DEADBAND_MV, 0 },
+    [FANOUT_MOS_TEMP]      = { "mosTemp",      "MOSFET Temperature", "°C", "temperature", 0.5f, 1 },
+    [FANOUT_PROBE1_TEMP]   = { "probe1Temp",   "Probe 1 Temperature", "°C", "temperature", 0.5f, 1 },
+    [FANOUT_PROBE2_TEMP]   = { "probe2Temp",   "Probe 2 Temperature", "°C", "temperature", 0.5f, 1 },
+    [FANOUT_CHARGE_MOS]    = { "chargeMos",    "Charge MOSFET",      NULL, NULL,          0.5f, 0 },
+    [FANOUT_DISCHARGE_MOS] = { "dischargeMos", "Discharge MOSFET",   NULL, NULL,          0.5f, 0 },
+    [FANOUT_BALANCING]     = { "balancing",    "Balancing",          NULL, NULL,          0.5f, 0 },
+    [FANOUT_CYCLE_COUNT]   = { "cycleCount",   "Cycle Count",        NULL, NULL,          0.5f, 0 },
+};
+
+typedef struct {
+    float value;
+    int64_t published_us;               // 0 = never published on this connection
+} fanout_last_t;
+
+static struct {
+    fanout_last_t pack[FANOUT_FIELD_COUNT];
+    fanout_last_t cells[BMS_MAX_CELLS];
+    volatile bool resync;               // Set on (re)connect: publish everything on the next sample
+    uint64_t discovery_sent;            // Bit per config: pack fields, then one per cell (14 + 32 <= 64)
+    bool discovery_done;                // Every config queued once this boot
+    uint32_t published;
+    uint32_t suppressed;
+    uint32_t discovery_configs;
+} fanout;
+
+static float fanout_value(fanout_field_id_t id, const bms_data_t *d) {
+    switch (id) {
+    case FANOUT_SOC: return d->soc_percent;
+    case FANOUT_VOLTAGE: return d->pack_voltage;
+    case FANOUT_CURRENT: return d->pack_current;
+    case FANOUT_POWER: return d->pack_voltage * d->pack_current;
+    case FANOUT_CELL_MIN_MV: return d->min_cell_voltage * 1000.0f;
+    case FANOUT_CELL_MAX_MV: return d->max_cell_voltage * 1000.0f;
+    case FANOUT_CELL_DELTA_MV: return d->cell_delta_mv;
+    case FANOUT_MOS_TEMP: return d->mosfet_temp;
+    case FANOUT_PROBE1_TEMP: return d->probe1_temp;
+    case FANOUT_PROBE2_TEMP: return d->probe2_temp;
+    case FANOUT_CHARGE_MOS: return d->charge_mosfet_status;
+    case FANOUT_DISCHARGE_MOS: return d->discharge_mosfet_status;
+    case FANOUT_BALANCING: return d->balancing_active;
+    case FANOUT_CYCLE_COUNT: return d->cycle_count;
+    default: return 0.0f;
+    }
+}
+
+// Publishes one scalar if it changed by more than the deadband or is due for a refresh
+static void fanout_publish_value(out_stream_id_t stream, const char *var, fanout_last_t *last,
+                                 float value, float deadband, uint8_t decimals, int64_t now_us) {
+    bool due = last->published_us == 0 || now_us - last->published_us >= (int64_t)FANOUT_REFRESH_MS * 1000;
+    if (!due && fabsf(value - last->value) < deadband) {
+        fanout.suppressed++;
+        return;
+    }
+    char topic[OUT_TOPIC_MAX];
+    char payload[40];
+    out_stream_topic(&out_streams[stream], var, topic, sizeof(topic));
+    int len = out_streams[stream].encoding == OUT_ENC_RAW
+                  ? snprintf(payload, sizeof(payload), "%.*f", decimals, value)
+                  : snprintf(payload, sizeof(payload), "{\"value\":%.*f}", decimals, value);
+    if (topic[0] && out_publish_to(stream, topic, payload, len) >= 0) {
+        last->value = value;
+        last->published_us = now_us;
+        fanout.published++;
+    }
+}
+
+// Publishes one retained Home Assistant discovery config pointing at a fan-out topic. Returns
+// false only if it could not be queued and should be tried again with the next sample.
+static bool fanout_publish_discovery(out_stream_id_t state_stream, const char *var, const char *object_id,
+                                     const char *name, const char *unit, const char *device_class) {
+    char node[OUT_TOPIC_MAX];
+    char state_topic[OUT_TOPIC_MAX];
+    char config_topic[OUT_TOPIC_MAX];
+    char payload[640];
+    out_topic_expand("%node%", node, sizeof(node));
+    out_stream_topic(&out_streams[state_stream], var, state_topic, sizeof(state_topic));
+    out_stream_topic(&out_streams[OUT_DISCOVERY], object_id, config_topic, sizeof(config_topic));
+    if (!state_topic[0] || !config_topic[0]) {
+        return true;                    // Topic too long: retrying would not help
+    }
+    char extra[160] = "";
+    int n = 0;
+    if (unit) {
+        n += snprintf(extra + n, sizeof(extra) - n, ",\"unit_of_measurement\":\"%s\",\"state_class\":\"measurement\"", unit);
+    }
+    if (device_class) {
+        n += snprintf(extra + n, sizeof(extra) - n, ",\"device_class\":\"%s\"", device_class);
+    }
+    if (out_streams[state_stream].encoding == OUT_ENC_JSON) {
+        snprintf(extra + n, sizeof(extra) - n, ",\"value_template\":\"{{ value_json.value }}\"");
+    }
+    int len = snprintf(payload, sizeof(payload),
+                       "{\"name\":\"%s\",\"unique_id\":\"%s_%s\",\"state_topic\":\"%s\"%s,"
+                       "\"device\":{\"identifiers\":[\"%s\"],\"name\":\"%s\",\"manufacturer\":\"JiKong\",\"model\":\"JK BMS\"}}",
+                       name, node, object_id, state_topic, extra, node, pack_name);
+    if (len >= (int)sizeof(payload)) {
+        return true;
+    }
+    if (out_publish_to(OUT_DISCOVERY, config_topic, payload, len) < 0) {
+        return false;
+    }
+    fanout.discovery_configs++;
+    return true;
+}
+
+// Queues the configs not sent yet this boot; those the outbox refused go out with a later sample.
+// Returns true once all of them are queued.
+static bool fanout_send_discovery(int num_cells) {
+    char name[96];
+    bool done = true;
+    if (out_streams[OUT_PACK_FIELDS].encoding != OUT_ENC_OFF) {
+        for (int i = 0; i < FANOUT_FIELD_COUNT; ++i) {
+            const fanout_field_t *f = &fanout_fields[i];
+            if (fanout.discovery_sent & (1ULL << i)) {
+                continue;
+            }
+            snprintf(name, sizeof(name), "%s %s", pack_name, f->name);
+            if (fanout_publish_discovery(OUT_PACK_FIELDS, f->field, f->field, name, f->unit, f->device_class)) {
+                fanout.discovery_sent |= 1ULL << i;
+            } else {
+                done = false;
+            }
+        }
+    }
+    if (out_streams[OUT_CELL_FIELDS].encoding != OUT_ENC_OFF) {
+        for (int i = 0; i < num_cells; ++i) {
+            uint64_t bit = 1ULL << (FANOUT_FIELD_COUNT + i);
+            if (fanout.discovery_sent & bit) {
+                continue;
+            }
+            char cell[8];
+            char object_id[16];
+            snprintf(cell, sizeof(cell), "%d", i);
+            snprintf(object_id, sizeof(object_id), "cell%dMv", i);
+            snprintf(name, sizeof(name), "%s Cell %d", pack_name, i);
+            if (fanout_publish_discovery(OUT_CELL_FIELDS, cell, object_id, name, "mV", "voltage")) {
+                fanout.discovery_sent |= bit;
+            } else {
+                done = false;
+            }
+        }
+    }
+    return done;
+}
+
+// Called after each valid sample; does nothing unless a fan-out stream is enabled
+static void publish_fanout_mqtt(const bms_data_t *d) {
+    bool pack_on = out_streams[OUT_PACK_FIELDS].encoding != OUT_ENC_OFF;
+    bool cells_on = out_streams[OUT_CELL_FIELDS].encoding != OUT_ENC_OFF;
+    if ((!pack_on && !cells_on) || !mqtt_client || !mqtt_connected) {
+        return;
+    }
+    int64_t now_us = esp_timer_get_time();
+    if (fanout.resync) {
+        fanout.resync = false;
+        memset(fanout.pack, 0, sizeof(fanout.pack));
+        memset(fanout.cells, 0, sizeof(fanout.cells));
+    }
+    if (!fanout.discovery_done && out_streams[OUT_DISCOVERY].encoding != OUT_ENC_OFF && d->num_cells > 0) {
+        fanout.discovery_done = fanout_send_discovery(d->num_cells);
+    }
+    if (pack_on) {
+        for (int i = 0; i < FANOUT_FIELD_COUNT; ++i) {
+            const fanout_field_t *f = &fanout_fields[i];
+            fanout_publish_value(OUT_PACK_FIELDS, f->field, &fanout.pack[i], fanout_value((fanout_field_id_t)i, d),
+                                 f->deadband, f->decimals, now_us);
+        }
+    }
+    if (cells_on) {
+        for (int i = 0; i < d->num_cells; ++i) {
+            char cell[8];
+            snprintf(cell, sizeof(cell), "%d", i);
+            fanout_publish_value(OUT_CELL_FIELDS, cell, &fanout.cells[i], d->cell_mv[i],
+                                 FANOUT_CELL_DEADBAND_MV, 0, now_us);
+        }
+    }
+}
+
+// ============================================================
+// Telemetry publish path
+// ============================================================
+// The main JSON document is printed into one static buffer rather than a fresh malloc each sample,
+// and handed to esp_mqtt_client_enqueue(), which never waits on the network. esp-mqtt always
+// copies a QoS 1 payload into its outbox, so true zero-copy is not available. What keeps the heap
+// flat is bounding that outbox instead: each telemetry message takes one of a fixed number of
+// in-flight slots, which is only returned on MQTT_EVENT_PUBLISHED (PUBACK) or MQTT_EVENT_DELETED
+// (expired, reported because CONFIG_MQTT_REPORT_DELETED_MESSAGES is set). While all slots are taken, the broker is behind, and new samples are dropped rather
+// than queued. QoS 1 messages on the other streams (alerts, events, command results, fan-out,
+// discovery, batches) take slots from a separate share of the pool through out_publish_to(), so a
+// burst of them is bounded too and cannot starve telemetry. The outbox itself is capped at
+// mqtt_outbox_kb as a backstop for QoS 0 and retransmissions.
+// The MQTT task can send a message and handle its PUBACK before esp_mqtt_client_enqueue() has
+// returned its msg_id to us, so acks that match no slot are remembered for a while and settled
+// when the slot is given its msg_id. msg_ids are reused across connections, so the remembered
+// acks are forgotten on every reconnect.
+#define MQTT_PUB_BUF_SIZE 8192
+#define MQTT_PUB_MAX_IN_FLIGHT 2        // Telemetry messages waiting for PUBACK
+#define MQTT_PUB_SLOTS 8                // Telemetry and all other streams together
+#define MQTT_PUB_SLOT_STALE_MS 60000    // Reclaim a slot whose PUBACK never came (e.g. session lost)
+#define MQTT_PUB_EARLY_ACKS 8           // Acks that arrived before their msg_id was known
+
+static char mqtt_pub_buf[MQTT_PUB_BUF_SIZE];
+static struct {
+    bool in_use;
+    bool telemetry;                     // Counts against MQTT_PUB_MAX_IN_FLIGHT, not the other share
+    int msg_id;
+    int64_t since_us;
+} mqtt_pub_slots[MQTT_PUB_SLOTS];
+static struct {
+    int msg_id;                         // 0 = empty (acked messages are QoS 1, msg_id > 0)
+    bool acked;
+} mqtt_pub_early[MQTT_PUB_EARLY_ACKS];
+static uint8_t mqtt_pub_early_next;
+static portMUX_TYPE mqtt_pub_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static struct {
+    uint32_t enqueued;
+    uint32_t acked;
+    uint32_t expired;                   // Deleted from the outbox or reclaimed as stale
+    uint32_t dropped_busy;              // All in-flight slots taken
+    uint32_t dropped_outbox;            // Outbox limit reached or enqueue failed
+    uint32_t print_overflows;           // Document larger than MQTT_PUB_BUF_SIZE
+    uint32_t peak_in_flight;
+} mqtt_out_stats;
+
+// Takes an in-flight slot for a telemetry or other message, or returns -1 if the broker has not
+// acknowledged the previous ones of that share
+static int mqtt_pub_slot_acquire(bool telemetry) {
+    int64_t now = esp_timer_get_time();
+    int slot = -1;
+    int free_slot = -1;
+    uint32_t in_flight = 0;
+    uint32_t share = 0;
+    taskENTER_CRITICAL(&mqtt_pub_lock);
+    for (int i = 0; i < MQTT_PUB_SLOTS; ++i) {
+        if (mqtt_pub_slots[i].in_use && now - mqtt_pub_slots[i].since_us > (int64_t)MQTT_PUB_SLOT_STALE_MS * 1000) {
+            mqtt_pub_slots[i].in_use = false;
+            mqtt_out_stats.expired++;
+        }
+        if (!mqtt_pub_slots[i].in_use && free_slot < 0) {
+            free_slot = i;
+        }
+        if (mqtt_pub_slots[i].in_use && mqtt_pub_slots[i].telemetry == telemetry) {
+            share++;
+        }
+    }
+    if (free_slot >= 0 && share < (telemetry ? MQTT_PUB_MAX_IN_FLIGHT : MQTT_PUB_SLOTS - MQTT_PUB_MAX_IN_FLIGHT)) {
+        slot = free_slot;
+        mqtt_pub_slots[slot].in_use = true;
+        mqtt_pub_slots[slot].telemetry = telemetry;
+        mqtt_pub_slots[slot].msg_id = -1;
+        mqtt_pub_slots[slot].since_us = now;
+    }
+    for (int i = 0; i < MQTT_PUB_SLOTS; ++i) {
+        if (mqtt_pub_slots[i].in_use) {
+            in_flight++;
+        }
+    }
+    if (in_flight > mqtt_out_stats.peak_in_flight) {
+        mqtt_out_stats.peak_in_flight = in_flight;
+    }
+    taskEXIT_CRITICAL(&mqtt_pub_lock);
+    return slot;
+}
+
+// Records the msg_id of the message a slot now stands for; a failed enqueue frees the slot, and
+// so does an ack that arrived before the msg_id was known
+static void mqtt_pub_slot_set(int slot, int msg_id) {
+    int early = -1;
+    bool early_acked = false;
+    taskENTER_CRITICAL(&mqtt_pub_lock);
+    if (msg_id < 0) {
+        mqtt_pub_slots[slot].in_use = false;
+    } else {
+        for (int i = 0; i < MQTT_PUB_EARLY_ACKS; ++i) {
+            if (mqtt_pub_early[i].msg_id == msg_id) {
+                early = i;
+                break;
             }
         }
-        ESP_LOGD(TAG, "[MAIN LOOP] After software watchdog check");
-
-        mqtt_publish_success = false;
-        ESP_LOGD(TAG, "[MAIN LOOP] After reset mqtt_publish_success");
+        if (early >= 0) {
+            early_acked = mqtt_pub_early[early].acked;
+            mqtt_pub_early[early].msg_id = 0;
+            mqtt_pub_slots[slot].in_use = false;
+        } else {
+            mqtt_pub_slots[slot].msg_id = msg_id;
+        }
+    }
+    taskEXIT_CRITICAL(&mqtt_pub_lock);
+    if (early >= 0) {
+        if (early_acked) {
+            mqtt_out_stats.acked++;
+        } else {
+            mqtt_out_stats.expired++;
+        }
+    }
+}
 
-        if (debug_logging) {
-            ESP_LOGI(TAG, "Sending '%s' command to BMS...", "Read All Data");
+// Called from the MQTT event handler when a message has left the outbox
+static void mqtt_pub_slot_release(int msg_id, bool acked) {
+    bool found = false;
+    taskENTER_CRITICAL(&mqtt_pub_lock);
+    for (int i = 0; i < MQTT_PUB_SLOTS; ++i) {
+        if (mqtt_pub_slots[i].in_use && mqtt_pub_slots[i].msg_id == msg_id) {
+            mqtt_pub_slots[i].in_use = false;
+            found = true;
+            break;
+        }
+    }
+    if (!found && msg_id > 0) {
+        mqtt_pub_early[mqtt_pub_early_next].msg_id = msg_id;
+        mqtt_pub_early[mqtt_pub_early_next].acked = acked;
+        mqtt_pub_early_next = (mqtt_pub_early_next + 1) % MQTT_PUB_EARLY_ACKS;
+    }
+    taskEXIT_CRITICAL(&mqtt_pub_lock);
+    if (found) {
+        if (acked) {
+            mqtt_out_stats.acked++;
+        } else {
+            mqtt_out_stats.expired++;
         }
-        send_bms_command(bms_read_all_cmd, sizeof(bms_read_all_cmd));
-        ESP_LOGD(TAG, "[MAIN LOOP] After send_bms_command");
+    }
+}
+
+static uint32_t mqtt_pub_in_flight(void) {
+    uint32_t n = 0;
+    taskENTER_CRITICAL(&mqtt_pub_lock);
+    for (int i = 0; i < MQTT_PUB_SLOTS; ++i) {
+        n += mqtt_pub_slots[i].in_use ? 1 : 0;
+    }
+    taskEXIT_CRITICAL(&mqtt_pub_lock);
+    return n;
+}
+
+// Called on MQTT_EVENT_CONNECTED: acks remembered from the last connection would match new msg_ids
+static void mqtt_pub_early_clear(void) {
+    taskENTER_CRITICAL(&mqtt_pub_lock);
+    for (int i = 0; i < MQTT_PUB_EARLY_ACKS; ++i) {
+        mqtt_pub_early[i].msg_id = 0;
+    }
+    mqtt_pub_early_next = 0;
+    taskEXIT_CRITICAL(&mqtt_pub_lock);
+}
+
+// Publishes on a stream other than telemetry. A QoS 1 message takes an in-flight slot and is
+// dropped while the other streams' share is taken; returns the msg_id, or -1 if it was not queued.
+static int out_publish_to(out_stream_id_t id, const char *topic, const char *payload, int len) {
+    const out_stream_t *st = &out_streams[id];
+    if (!mqtt_client || st->encoding == OUT_ENC_OFF) {
+        return -1;
+    }
+    if (st->qos == 0) {
+        return out_enqueue(id, topic, payload, len);
+    }
+    int slot = mqtt_pub_slot_acquire(false);
+    if (slot < 0) {
+        mqtt_out_stats.dropped_busy++;
+        return -1;
+    }
+    int msg_id = out_enqueue(id, topic, payload, len);
+    mqtt_pub_slot_set(slot, msg_id);
+    if (msg_id < 0) {
+        mqtt_out_stats.dropped_outbox++;
+    } else {
+        mqtt_out_stats.enqueued++;
+    }
+    return msg_id;
+}
+
+static int out_publish(out_stream_id_t id, const char *payload, int len) {
+    return out_publish_to(id, NULL, payload, len);
+}
+
+// ============================================================
+// Payload compression
+// ============================================================
+// LZSS in the heatshrink stream format with a 256-byte window and 16-byte lookahead (heatshrink
+// -w 8 -l 4), so any heatshrink decoder reads it. A literal is a 1 bit then the byte; a repeat is
+// a 0 bit, distance - 1 in 8 bits and length - 1 in 4 bits, all MSB first, the last byte padded
+// with zeros. Repeats are found by a plain search of the window, which costs a few ms for a full
+// buffer and needs no tables: the only memory is the buffer being compressed.
+//
+// Compression runs in place. The input sits HS_INPLACE_MARGIN bytes into the buffer and the
+// output is written from the start. Output grows by at most 9 bits per input byte, so it stays
+// behind the input window as long as the margin exceeds 256 + input / 8 + 2 bytes.
+#define HS_WINDOW_BITS 8
+#define HS_LOOKAHEAD_BITS 4
+#define HS_WINDOW (1 << HS_WINDOW_BITS)
+#define HS_LOOKAHEAD (1 << HS_LOOKAHEAD_BITS)
+#define HS_INPLACE_MARGIN 1280          // Covers inputs up to 7 KB (256 + 7168 / 8 + 2 = 1154)
 
-        int echo_read_len = uart_read_bytes(UART_NUM, echo_buf, sizeof(bms_read_all_cmd), pdMS_TO_TICKS(20));
-        ESP_LOGD(TAG, "[MAIN LOOP] After uart_read_bytes for echo");
+typedef struct {
+    uint8_t *out;
+    size_t pos;
+    uint8_t cur;
+    int bits;
+} hs_writer_t;
+
+static void hs_put_bits(hs_writer_t *w, uint32_t value, int count) {
+    while (count-- > 0) {
+        w->cur = (w->cur << 1) | ((value >> count) & 1);
+        if (++w->bits == 8) {
+            w->out[w->pos++] = w->cur;
+            w->cur = 0;
+            w->bits = 0;
+        }
+    }
+}
 
-        if (echo_read_len == sizeof(bms_read_all_cmd)) {
-            if (debug_logging) {
-                ESP_LOGI(TAG, "Successfully read and discarded %d echo bytes.", echo_read_len);
+// Compresses len bytes at in into out, which may be the same buffer as long as out sits at least
+// 256 + len / 8 + 2 bytes before in. Returns the compressed length.
+static size_t hs_compress(const uint8_t *in, size_t len, uint8_t *out) {
+    hs_writer_t w = { .out = out };
+    size_t i = 0;
+    while (i < len) {
+        size_t best_len = 0;
+        size_t best_dist = 0;
+        size_t max_len = len - i < HS_LOOKAHEAD ? len - i : HS_LOOKAHEAD;
+        size_t start = i > HS_WINDOW ? i - HS_WINDOW : 0;
+        for (size_t j = start; j < i && best_len < max_len; ++j) {
+            size_t k = 0;
+            while (k < max_len && in[j + k] == in[i + k]) {
+                k++;
             }
-        } else if (echo_read_len > 0) {
-            if (debug_logging) {
-                ESP_LOGW(TAG, "Partially read %d echo bytes (expected %d). The rest might be in the main read or BMS response is very fast.", echo_read_len, (int)sizeof(bms_read_all_cmd));
+            if (k > best_len) {
+                best_len = k;
+                best_dist = i - j;
             }
+        }
+        // A repeat costs 13 bits, a literal 9: repeats of 2 bytes or more are shorter
+        if (best_len >= 2) {
+            hs_put_bits(&w, 0, 1);
+            hs_put_bits(&w, best_dist - 1, HS_WINDOW_BITS);
+            hs_put_bits(&w, best_len - 1, HS_LOOKAHEAD_BITS);
+            i += best_len;
         } else {
-            if (debug_logging) {
-                ESP_LOGI(TAG, "No echo read or timeout/error during dedicated echo read attempt (read %d bytes). Main read will handle if echo is present.", echo_read_len);
-            }
+            hs_put_bits(&w, 0x100 | in[i], 9);
+            i++;
         }
-        ESP_LOGD(TAG, "[MAIN LOOP] After echo read handling");
+    }
+    if (w.bits) {
+        w.out[w.pos++] = w.cur << (8 - w.bits);
+    }
+    return w.pos;
+}
 
-        read_bms_data();
-        ESP_LOGD(TAG, "[MAIN LOOP] After read_bms_data");
+// ============================================================
+// Sample batching
+// ============================================================
+// With the batch stream enabled, samples are collected and published batch_size at a time on
+// <bms_topic>/batch, or earlier once the oldest one is batch_max_age_ms old, so a fast sample rate
+// does not cost one MQTT message, TCP segment, radio wakeup and Node-RED invocation per sample.
+// Each sample keeps its own timestamp (uptime ms at frame completion). The message carries the
+// SNTP offset that turns those into UTC ms, and the uptime at which it was sent, so a consumer
+// without a synced gateway can still place samples on its own clock from the arrival time.
+// Uptimes are 32-bit ms and wrap after about 49.7 days; the offset is taken against the wrapped
+// sent time, so a sample's UTC ms is utcOffsetMs + sentMs - ((sentMs - t) mod 2^32), which stays
+// right across a wrap inside the batch.
+// A batch that does not fit the publish buffer goes out as several messages.
+// With batch_compress set, each message is compressed with hs_compress() and published on
+// <batch topic>/hs instead, so consumers can tell the two apart by topic.
+//
+// Binary encoding, little-endian:
+//   header (24 bytes): 'J' 'B', version 2, sample count, cell count, 3 reserved,
+//                      uint32 first sample uptime ms, uint32 sent uptime ms,
+//                      int64 UTC ms minus sent uptime ms (0 before the first SNTP sync)
+//   per sample (18 + 2 x cells bytes): uint32 ms after the first sample, uint16 pack 10 mV,
+//                      int32 pack mA, uint8 SOC %, uint8 MOS bits (0 charge, 1 discharge,
+//                      2 balancing), int16 x 3 MOSFET/probe 1/probe 2 temperature 0.1 °C,
+//                      uint16 x cells mV
+#define BATCH_BIN_VERSION 2
+#define BATCH_BIN_HEADER_SIZE 24
 
-        if (debug_logging) {
-            ESP_LOGI(TAG, "Waiting %ld ms before next BMS read cycle...", sample_interval_ms);
+typedef struct {
+    uint32_t t_ms;
+    uint16_t pack_10mv;
+    int32_t pack_ma;
+    uint8_t soc;
+    uint8_t mos_bits;
+    int16_t temp_dc[3];                 // MOSFET, probe 1, probe 2 in 0.1 °C
+    uint16_t cell_mv[BMS_MAX_CELLS];
+} batch_sample_t;
+
+static struct {
+    batch_sample_t samples[BATCH_MAX_SAMPLES];
+    int count;
+    int num_cells;                      // All samples of a batch have the same cell count
+    uint32_t published;                 // Batch messages queued
+    uint32_t samples_published;
+    uint32_t samples_dropped;           // Lost to a full outbox
+    uint32_t bytes_encoded;             // Before compression
+    uint32_t bytes_sent;                // After compression (same as encoded when it is off)
+    int64_t frame_shift_ms;             // Uptime base of the samples minus this boot's (restored samples)
+} batch;
+
+static void batch_put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void batch_put_u32(uint8_t *p, uint32_t v) {
+    batch_put_u16(p, v & 0xFFFF);
+    batch_put_u16(p + 2, v >> 16);
+}
+
+// Encodes samples from index first into out until it is full. Returns the length and sets *used.
+static int batch_encode_binary(int first, int *used, uint8_t *out, size_t size) {
+    size_t sample_size = 18 + 2 * batch.num_cells;
+    int n = 0;
+    while (first + n < batch.count && BATCH_BIN_HEADER_SIZE + (n + 1) * sample_size <= size) {
+        n++;
+    }
+    uint8_t *p = out;
+    memset(p, 0, BATCH_BIN_HEADER_SIZE);
+    p[0] = 'J';
+    p[1] = 'B';
+    p[2] = BATCH_BIN_VERSION;
+    p[3] = n;
+    p[4] = batch.num_cells;
+    uint32_t t0 = batch.samples[first].t_ms;
+    int64_t now_us = esp_timer_get_time();
+    int64_t utc_ms = time_utc_ms(now_us);
+    uint32_t sent_ms = (uint32_t)(now_us / 1000 + batch.frame_shift_ms); // On the samples' uptime base
+    int64_t utc_offset_ms = utc_ms ? utc_ms - sent_ms : 0;
+    batch_put_u32(p + 8, t0);
+    batch_put_u32(p + 12, sent_ms);
+    batch_put_u32(p + 16, (uint32_t)((uint64_t)utc_offset_ms & 0xFFFFFFFF));
+    batch_put_u32(p + 20, (uint32_t)((uint64_t)utc_offset_ms >> 32));
+    p += BATCH_BIN_HEADER_SIZE;
+    for (int i = first; i < first + n; ++i) {
+        const batch_sample_t *s = &batch.samples[i];
+        batch_put_u32(p, s->t_ms - t0);
+        batch_put_u16(p + 4, s->pack_10mv);
+        batch_put_u32(p + 6, (uint32_t)s->pack_ma);
+        p[10] = s->soc;
+        p[11] = s->mos_bits;
+        for (int t = 0; t < 3; ++t) {
+            batch_put_u16(p + 12 + 2 * t, (uint16_t)s->temp_dc[t]);
+        }
+        p += 18;
+        for (int c = 0; c < batch.num_cells; ++c, p += 2) {
+            batch_put_u16(p, s->cell_mv[c]);
+        }
+    }
+    *used = n;
+    return p - out;
+}
+
+// Encodes samples from index first as one JSON document into out until it is full
+static int batch_encode_json(int first, int *used, char *out, size_t size) {
+    int64_t now_us = esp_timer_get_time();
+    int64_t utc_ms = time_utc_ms(now_us);
+    uint32_t sent_ms = (uint32_t)(now_us / 1000 + batch.frame_shift_ms); // On the samples' uptime base
+    int len = snprintf(out, size, "{\"packName\":\"%s\",\"sentMs\":%lu,", pack_name, sent_ms);
+    if (utc_ms) {
+        len += snprintf(out + len, size - len, "\"utcOffsetMs\":%lld,", (long long)(utc_ms - sent_ms));
+    }
+    len += snprintf(out + len, size - len, "\"samples\":[");
+    int n = 0;
+    for (int i = first; i < batch.count && len < (int)size; ++i) {
+        const batch_sample_t *s = &batch.samples[i];
+        int start = len;
+        len += snprintf(out + len, size - len,
+                        "%s{\"t\":%lu,\"packV\":%.2f,\"packA\":%.3f,\"packSOC\":%u,\"mosTemp\":%.1f,"
+                        "\"probe1Temp\":%.1f,\"probe2Temp\":%.1f,\"mos\":%u,\"cellsMv\":[",
+                        n ? "," : "", s->t_ms, s->pack_10mv / 100.0, s->pack_ma / 1000.0, s->soc,
+                        s->temp_dc[0] / 10.0, s->temp_dc[1] / 10.0, s->temp_dc[2] / 10.0, s->mos_bits);
+        for (int c = 0; c < batch.num_cells && len < (int)size; ++c) {
+            len += snprintf(out + len, size - len, "%s%u", c ? "," : "", s->cell_mv[c]);
+        }
+        if (len < (int)size) {
+            len += snprintf(out + len, size - len, "]}");
+        }
+        // Keep room for the closing "]}"; a sample that does not fit starts the next message
+        if (len + 2 >= (int)size) {
+            len = start;
+            break;
+        }
+        n++;
+    }
+    len += snprintf(out + len, size - len, "]}");
+    *used = n;
+    return len;
+}
+
+// Publishes everything collected so far, in as many messages as the publish buffer needs
+static void batch_flush(void) {
+    const out_stream_t *st = &out_streams[OUT_BATCH];
+    // Compressed messages are encoded past the in-place margin and compressed to the buffer start
+    size_t margin = batch_compress ? HS_INPLACE_MARGIN : 0;
+    char *raw = mqtt_pub_buf + margin;
+    char zip_topic[OUT_TOPIC_MAX];
+    snprintf(zip_topic, sizeof(zip_topic), "%s/hs", st->topic);
+    int first = 0;
+    while (first < batch.count) {
+        int used = 0;
+        int len = st->encoding == OUT_ENC_BINARY
+                      ? batch_encode_binary(first, &used, (uint8_t *)raw, sizeof(mqtt_pub_buf) - margin)
+                      : batch_encode_json(first, &used, raw, sizeof(mqtt_pub_buf) - margin);
+        if (used == 0) {
+            break;
         }
-        if (sample_interval_ms > 5000) {
-            uint32_t remaining_ms = sample_interval_ms;
-            while (remaining_ms > 0) {
-                uint32_t chunk_ms = (remaining_ms > 5000) ? 5000 : remaining_ms;
-                vTaskDelay(pdMS_TO_TICKS(chunk_ms));
-                esp_task_wdt_reset();
-                remaining_ms -= chunk_ms;
+        batch.bytes_encoded += len;
+        if (batch_compress) {
+            len = hs_compress((const uint8_t *)raw, len, (uint8_t *)mqtt_pub_buf);
+        }
+        batch.bytes_sent += len;
+        if (out_publish_to(OUT_BATCH, batch_compress ? zip_topic : NULL, mqtt_pub_buf, len) >= 0) {
+            batch.published++;
+            batch.samples_published += used;
+            ESP_LOGI(TAG, "Queued batch of %d samples to %s (length: %d)", used, batch_compress ? zip_topic : st->topic, len);
+            if (st->qos == 0 && mqtt_connected) {
+                blink_heartbeat();
+                publish_unconfirmed = false;
+                if (watchdog_enabled) {
+                    last_successful_publish = xTaskGetTickCount();
+                }
             }
         } else {
-            vTaskDelay(pdMS_TO_TICKS(sample_interval_ms));
+            batch.samples_dropped += used;
+            ESP_LOGW(TAG, "MQTT outbox full, dropping a batch of %d samples", used);
         }
-        ESP_LOGD(TAG, "[MAIN LOOP] End of iteration, feeding TWDT");
-        esp_task_wdt_reset();
+        first += used;
     }
+    batch.count = 0;
+    batch.frame_shift_ms = 0;
 }
 
-// Wi-Fi Event Handler
-static void wifi_event_handler(void* arg, esp_event_base_t event_base,
-                                int32_t event_id, void* event_data)
-{
-    printf("[WIFI] Event handler called: base=%s, event_id=%ld\n", event_base, event_id);
-    
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        printf("[WIFI] WIFI_EVENT_STA_START - calling esp_wifi_connect()\n");
-        esp_wifi_connect();
-    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        printf("[WIFI] WIFI_EVENT_STA_DISCONNECTED - retry_num=%d\n", wifi_retry_num);
-        if (wifi_retry_num < EXAMPLE_ESP_MAXIMUM_RETRY) {
-            esp_wifi_connect();
-            wifi_retry_num++;
-            printf("[WIFI] retry to connect to the AP\n");
-        } else {
-            printf("[WIFI] connect to the AP fail\n");
-            printf("[WIFI] WiFi SSID used: %s\n", wifi_ssid);
-            printf("[WIFI] WiFi Password used: %s\n", wifi_pass);
+// Called after every poll with the new sample, or NULL if the poll failed, so that a partial
+// batch still leaves on time. Does nothing unless the batch stream is enabled.
+static void publish_batch_mqtt(const bms_data_t *d) {
+    if (out_streams[OUT_BATCH].encoding == OUT_ENC_OFF || !mqtt_client) {
+        batch.count = 0;
+        return;
+    }
+    uint32_t now_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    if (d) {
+        // Samples restored from before a restart go out on their own, with their own uptime base
+        if (batch.count > 0 && (d->num_cells != batch.num_cells || batch.frame_shift_ms != 0)) {
+            batch_flush();
         }
-    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-        printf("[WIFI] IP_EVENT_STA_GOT_IP received!\n");
-        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        printf("[WIFI] got ip:" IPSTR "\n", IP2STR(&event->ip_info.ip));
-        printf("Obtained IP address: " IPSTR "\n", IP2STR(&event->ip_info.ip));
-        wifi_retry_num = 0;
-        // Start MQTT client once IP is obtained
-        printf("[WIFI] About to start MQTT client...\n");
-        mqtt_app_start();
-        printf("[WIFI] MQTT client start function completed\n");
-    } else {
-        printf("[WIFI] Unhandled event: base=%s, event_id=%ld\n", event_base, event_id);
+        batch_sample_t *s = &batch.samples[batch.count++];
+        s->t_ms = (uint32_t)(d->sample_time_us / 1000);
+        s->pack_10mv = (uint16_t)lroundf(d->pack_voltage * 100.0f);
+        s->pack_ma = lroundf(d->pack_current * 1000.0f);
+        s->soc = d->soc_percent;
+        s->mos_bits = (d->charge_mosfet_status ? 1 : 0) | (d->discharge_mosfet_status ? 2 : 0) | (d->balancing_active ? 4 : 0);
+        s->temp_dc[0] = (int16_t)lroundf(d->mosfet_temp * 10.0f);
+        s->temp_dc[1] = (int16_t)lroundf(d->probe1_temp * 10.0f);
+        s->temp_dc[2] = (int16_t)lroundf(d->probe2_temp * 10.0f);
+        memcpy(s->cell_mv, d->cell_mv, sizeof(s->cell_mv));
+        batch.num_cells = d->num_cells;
+    }
+    bool full = batch.count >= (int)batch_size || batch.count >= BATCH_MAX_SAMPLES;
+    bool aged = batch.count > 0 && batch_max_age_ms > 0 &&
+                (uint32_t)(now_ms + batch.frame_shift_ms) - batch.samples[0].t_ms >= batch_max_age_ms;
+    if (full || aged) {
+        batch_flush();
     }
-    printf("[WIFI] Event handler completed\n");
 }
 
-// Wi-Fi Initialization
-void wifi_init_sta(void)
-{
-    // Note: esp_netif_init() and esp_event_loop_create_default() 
-    // are already called in main app initialization
-    esp_netif_create_default_wifi_sta();
+// ============================================================
+// RTC snapshot
+// ============================================================
+// What a restart would otherwise lose is copied into RTC slow memory at the end of every poll
+// cycle: the last sample, the energy counters and the point they were last integrated at, the
+// learned response deadline, echo state and baud rate, the SNTP offset, and up to
+// RTC_SNAP_MAX_SAMPLES samples of a batch not yet published. RTC memory keeps its contents
+// across software, watchdog and panic resets but not across power loss, so a cold boot still
+// starts from NVS. The snapshot is only restored when its magic, version, size and CRC32 match.
+//
+// Timestamps in the snapshot are on the previous boot's esp_timer clock. The system time keeps
+// running across the reset, so the wall-clock time from the snapshot to the restore gives the
+// downtime, and with it the shift that moves them onto this boot's clock. A downtime that is
+// negative or above RTC_SNAP_MAX_DOWNTIME_MS (a clock step) drops the timestamped parts.
+#define RTC_SNAP_MAGIC 0x50414E53UL        // "SNAP"
+#define RTC_SNAP_VERSION 2
+#define RTC_SNAP_MAX_SAMPLES 32
+#define RTC_SNAP_MAX_DOWNTIME_MS 120000
 
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;                      // sizeof(rtc_snapshot_t)
+    uint32_t crc;                       // Over the rest of the struct up to the used batch samples
+    int64_t wall_us;                    // gettimeofday() when written
+    int64_t mono_us;                    // esp_timer_get_time() when written
+    bms_data_t last_sample;
+    bool energy_valid;
+    bool energy_have_last;
+    energy_nvs_t energy;
+    int64_t energy_last_us;
+    float energy_last_a;
+    float energy_last_w;
+    bool latency_valid;
+    uint32_t latency_terminal;
+    bms_latency_nvs_t latency;
+    uint8_t echo_state;
+    bool baud_probed;
+    uint32_t baud;
+    uint32_t time_syncs;                // 0 = no SNTP offset
+    int64_t time_offset_us;
+    int64_t time_synced_mono_us;
+    int64_t time_slew_from_us;
+    float time_drift_ppm;
+    uint8_t batch_cells;
+    uint8_t batch_count;
+    batch_sample_t batch_samples[RTC_SNAP_MAX_SAMPLES];
+} rtc_snapshot_t;
+
+static RTC_NOINIT_ATTR rtc_snapshot_t rtc_snap;
+
+static struct {
+    bool restored;
+    uint32_t downtime_ms;
+    uint32_t restored_samples;
+    uint32_t dropped_samples;           // Pending samples that could not be restored
+    uint32_t last_write_us;
+} rtc_snap_stats;
+
+static uint32_t rtc_snapshot_crc(void) {
+    size_t start = offsetof(rtc_snapshot_t, crc) + sizeof(rtc_snap.crc);
+    size_t end = offsetof(rtc_snapshot_t, batch_samples) + rtc_snap.batch_count * sizeof(batch_sample_t);
+    return esp_rom_crc32_le(0, (const uint8_t *)&rtc_snap + start, end - start);
+}
 
-    esp_event_handler_instance_t instance_any_id;
-    esp_event_handler_instance_t instance_got_ip;
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &wifi_event_handler,
-                                                        NULL,
-                                                        &instance_any_id));
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                        IP_EVENT_STA_GOT_IP,
-                                                        &wifi_event_handler,
-                                                        NULL,
-                                                        &instance_got_ip));
+// Called from the BMS loop only, which owns everything copied here
+static void rtc_snapshot_save(void) {
+    int64_t start_us = esp_timer_get_time();
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    rtc_snap.magic = 0;                 // A reset part-way through leaves no valid snapshot
+    rtc_snap.version = RTC_SNAP_VERSION;
+    rtc_snap.size = sizeof(rtc_snap);
+    rtc_snap.wall_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    rtc_snap.mono_us = start_us;
+    rtc_snap.last_sample = current_bms_data;
+    rtc_snap.energy_valid = energy_acc.loaded;
+    rtc_snap.energy_have_last = energy_acc.have_last;
+    rtc_snap.energy = energy_acc.totals;
+    rtc_snap.energy_last_us = energy_acc.last_sample_us;
+    rtc_snap.energy_last_a = energy_acc.last_current_a;
+    rtc_snap.energy_last_w = energy_acc.last_power_w;
+    rtc_snap.latency_valid = bms_latency.terminal_known;
+    rtc_snap.latency_terminal = bms_latency.terminal;
+    rtc_snap.latency = bms_latency.est;
+    rtc_snap.echo_state = bms_echo.state;
+    rtc_snap.baud_probed = bms_wire.probed;
+    rtc_snap.baud = bms_baud_active;
+    taskENTER_CRITICAL(&time_sync_lock);
+    rtc_snap.time_syncs = time_sync.syncs;
+    rtc_snap.time_offset_us = time_sync.offset_us;
+    rtc_snap.time_synced_mono_us = time_sync.synced_mono_us;
+    rtc_snap.time_slew_from_us = time_sync.slew_from_us;
+    rtc_snap.time_drift_ppm = time_sync.drift_ppm;
+    taskEXIT_CRITICAL(&time_sync_lock);
+    // Keep the newest samples if the batch is larger than the snapshot can hold
+    int n = batch.count < RTC_SNAP_MAX_SAMPLES ? batch.count : RTC_SNAP_MAX_SAMPLES;
+    memcpy(rtc_snap.batch_samples, batch.samples + batch.count - n, n * sizeof(batch_sample_t));
+    rtc_snap.batch_cells = batch.num_cells;
+    rtc_snap.batch_count = n;
+    rtc_snap.crc = rtc_snapshot_crc();
+    rtc_snap.magic = RTC_SNAP_MAGIC;
+    rtc_snap_stats.last_write_us = (uint32_t)(esp_timer_get_time() - start_us);
+}
 
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = "",
-            .password = "",
-            .threshold.authmode = WIFI_AUTH_WPA2_PSK, // Or other appropriate authmode
-        },
-    };
-    strncpy((char*)wifi_config.sta.ssid, wifi_ssid, sizeof(wifi_config.sta.ssid)-1);
-    strncpy((char*)wifi_config.sta.password, wifi_pass, sizeof(wifi_config.sta.password)-1);
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
-    ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config) );
-    ESP_ERROR_CHECK(esp_wifi_start() );
+// Called once in app_main after the NVS settings are loaded, before the first poll
+static void rtc_snapshot_restore(void) {
+    esp_reset_reason_t reason = esp_reset_reason();
+    bool valid = reason != ESP_RST_POWERON && rtc_snap.magic == RTC_SNAP_MAGIC &&
+                 rtc_snap.version == RTC_SNAP_VERSION && rtc_snap.size == sizeof(rtc_snap) &&
+                 rtc_snap.batch_count <= RTC_SNAP_MAX_SAMPLES && rtc_snap.crc == rtc_snapshot_crc();
+    rtc_snap.magic = 0;                 // Restored at most once
+    if (!valid) {
+        ESP_LOGI(TAG, "No RTC snapshot to restore (reset reason: %s)", reset_reason_name(reason));
+        return;
+    }
 
-    ESP_LOGI(TAG, "wifi_init_sta finished.");
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    int64_t now_us = esp_timer_get_time();
+    int64_t downtime_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - rtc_snap.wall_us - now_us;
+    bool timed = downtime_us >= 0 && downtime_us <= (int64_t)RTC_SNAP_MAX_DOWNTIME_MS * 1000;
+    // Previous boot's esp_timer time at this boot's time zero
+    int64_t shift_us = rtc_snap.mono_us + downtime_us;
+    rtc_snap_stats.restored = true;
+    rtc_snap_stats.downtime_ms = timed ? (uint32_t)(downtime_us / 1000) : 0;
+
+    if (rtc_snap.last_sample.num_cells > 0 && rtc_snap.last_sample.num_cells <= BMS_MAX_CELLS) {
+        current_bms_data = rtc_snap.last_sample;
+        current_bms_data.sample_time_us = timed ? rtc_snap.last_sample.sample_time_us - shift_us : 0;
+    }
+    if (rtc_snap.energy_valid && rtc_snap.energy.version == ENERGY_NVS_VERSION && energy_acc.loaded) {
+        // Newer than the NVS copy; keep the restore count load_energy_counters_from_nvs() kept
+        uint32_t restore_count = energy_acc.totals.restore_count;
+        energy_acc.totals = rtc_snap.energy;
+        energy_acc.totals.restore_count = restore_count;
+        if (timed && rtc_snap.energy_have_last) {
+            // The first sample of this boot integrates across the restart like any other gap
+            energy_acc.have_last = true;
+            energy_acc.last_sample_us = rtc_snap.energy_last_us - shift_us;
+            energy_acc.last_current_a = rtc_snap.energy_last_a;
+            energy_acc.last_power_w = rtc_snap.energy_last_w;
+        }
+    }
+    if (rtc_snap.latency_valid && rtc_snap.latency.version == LATENCY_NVS_VERSION) {
+        bms_latency.terminal = rtc_snap.latency_terminal;
+        bms_latency.terminal_known = true;
+        bms_latency.est = rtc_snap.latency;
+        latency_update_deadline();
+    }
+    if (rtc_snap.echo_state <= ECHO_ABSENT) {
+        bms_echo.state = (bms_echo_state_t)rtc_snap.echo_state;
+    }
+    if (bms_baud_config == 0 && rtc_snap.baud_probed) {
+        // Skips the auto-probe; a wrong rate is caught like any other dead link
+        bms_baud_active = rtc_snap.baud;
+        bms_wire.probed = true;
+        uart_set_baudrate(UART_NUM, bms_baud_active);
+    }
+    if (timed && rtc_snap.time_syncs > 0) {
+        taskENTER_CRITICAL(&time_sync_lock);
+        time_sync.offset_us = rtc_snap.time_offset_us + shift_us;
+        time_sync.synced_mono_us = rtc_snap.time_synced_mono_us - shift_us;
+        time_sync.slew_from_us = rtc_snap.time_slew_from_us + shift_us;
+        time_sync.drift_ppm = rtc_snap.time_drift_ppm;
+        time_sync.syncs = rtc_snap.time_syncs;
+        taskEXIT_CRITICAL(&time_sync_lock);
+    }
+    if (timed && rtc_snap.batch_count > 0 && out_streams[OUT_BATCH].encoding != OUT_ENC_OFF) {
+        memcpy(batch.samples, rtc_snap.batch_samples, rtc_snap.batch_count * sizeof(batch_sample_t));
+        batch.count = rtc_snap.batch_count;
+        batch.num_cells = rtc_snap.batch_cells;
+        batch.frame_shift_ms = shift_us / 1000;
+        rtc_snap_stats.restored_samples = rtc_snap.batch_count;
+    } else {
+        rtc_snap_stats.dropped_samples = rtc_snap.batch_count;
+    }
+    ESP_LOGW(TAG, "RTC snapshot restored after %s reset: downtime %s%lu ms, %lu pending samples, %lu dropped",
+             reset_reason_name(reason), timed ? "" : "unknown, ", rtc_snap_stats.downtime_ms,
+             rtc_snap_stats.restored_samples, rtc_snap_stats.dropped_samples);
 }
 
 // MQTT Event Handler
@@ -2208,13 +6259,21 @@ static void mqtt_event_handler(void* arg, esp_event_base_t event_base,
     switch ((esp_mqtt_event_id_t)event_id) {
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+        mqtt_connected = true;
+        mqtt_pub_early_clear();
+        boot_mark(&boot_marks.mqtt_connected_us);
+        fanout.resync = true;
         printf("[MQTT] Connected to broker successfully!\n");
-        // Example: Subscribe to a topic (optional)
-        // msg_id = esp_mqtt_client_subscribe(client, "/topic/qos0", 0);
-        // ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+        if (mqtt_cmd_enabled) {
+            char cmd_topic[64];
+            snprintf(cmd_topic, sizeof(cmd_topic), "%s/cmd", bms_topic);
+            int msg_id = esp_mqtt_client_subscribe(event->client, cmd_topic, 1);
+            ESP_LOGI(TAG, "Subscribed to %s, msg_id=%d", cmd_topic, msg_id);
+        }
         break;
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+        mqtt_connected = false;
         printf("[MQTT] Disconnected from broker\n");
         break;
     case MQTT_EVENT_SUBSCRIBED:
@@ -2225,12 +6284,15 @@ static void mqtt_event_handler(void* arg, esp_event_base_t event_base,
         break;
     case MQTT_EVENT_PUBLISHED:
         ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        mqtt_pub_slot_release(event->msg_id, true);
+        boot_mark(&boot_marks.first_publish_us);
         printf("[MQTT] Message published successfully!\n");
         
         // Flash the LED to indicate successful MQTT publish (heartbeat)
         blink_heartbeat();
         
         // Reset the software watchdog timer (if enabled)
+        publish_unconfirmed = false;
         if (watchdog_enabled) {
             last_successful_publish = xTaskGetTickCount(); // Update last publish time
         }
@@ -2239,6 +6301,19 @@ static void mqtt_event_handler(void* arg, esp_event_base_t event_base,
         ESP_LOGI(TAG, "MQTT_EVENT_DATA");
         printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
         printf("DATA=%.*s\r\n", event->data_len, event->data);
+        if (mqtt_cmd_enabled) {
+            char cmd_topic[64];
+            int cmd_topic_len = snprintf(cmd_topic, sizeof(cmd_topic), "%s/cmd", bms_topic);
+            // Commands are a few dozen bytes; a fragmented message is not one of ours
+            if (event->topic_len == cmd_topic_len && memcmp(event->topic, cmd_topic, cmd_topic_len) == 0 &&
+                event->current_data_offset == 0 && event->data_len == event->total_data_len) {
+                bms_cmd_submit(event->data, event->data_len);
+            }
+        }
+        break;
+    case MQTT_EVENT_DELETED: // Outbox expired a message that was never acknowledged
+        ESP_LOGW(TAG, "MQTT_EVENT_DELETED, msg_id=%d", event->msg_id);
+        mqtt_pub_slot_release(event->msg_id, false);
         break;
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -2262,91 +6337,224 @@ static void mqtt_event_handler(void* arg, esp_event_base_t event_base,
 }
 
 // MQTT Application Start
-static void mqtt_app_start(void) {
+// Creates the client without connecting, so samples can be queued while Wi-Fi comes up
+static void mqtt_app_init(void) {
     esp_mqtt_client_config_t mqtt_cfg = {
         .broker.address.uri = mqtt_broker_url,
+        .outbox.limit = (uint64_t)mqtt_outbox_kb * 1024,
     };
     // The event_handle field was removed from esp_mqtt_client_config_t in ESP-IDF v5.0.
     // Events are now registered globally for the client instance.
     // For older IDF: .event_handle = mqtt_event_handler,
 
+    out_streams_resolve();
     mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
     /* The last argument may be used to pass data to the event handler, in this example mqtt_event_handler */
     esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
-    esp_mqtt_client_start(mqtt_client);
-    ESP_LOGI(TAG, "MQTT client started.");
-}
-
-// Helper functions for processor metrics
-static int32_t get_wifi_rssi_percent(void) {
-    wifi_ap_record_t ap_info;
-    esp_err_t ret = esp_wifi_sta_get_ap_info(&ap_info);
-    if (ret == ESP_OK) {
-        int32_t rssi_dbm = ap_info.rssi;
-        // Convert RSSI from dBm to percentage
-        // Typical range: -100 dBm (0%) to -50 dBm (100%)
-        int32_t rssi_percent;
-        if (rssi_dbm >= -50) {
-            rssi_percent = 100;
-        } else if (rssi_dbm <= -100) {
-            rssi_percent = 0;
-        } else {
-            // Linear mapping: -100 dBm = 0%, -50 dBm = 100%
-            rssi_percent = 2 * (rssi_dbm + 100);
+}
+
+// Called on IP_EVENT_STA_GOT_IP. The client is only started once; after that it reconnects by itself.
+static void mqtt_app_start(void) {
+    static bool started = false;
+    if (!mqtt_client) {
+        mqtt_app_init();
+    }
+    if (!started && esp_mqtt_client_start(mqtt_client) == ESP_OK) {
+        started = true;
+        ESP_LOGI(TAG, "MQTT client started.");
+    }
+}
+
+// Helper functions for processor metrics (network items come from device_info_network())
+// On-die temperature in °C, or NAN on chips without a supported sensor (the original ESP32)
+static float get_cpu_temperature(void) {
+#if SOC_TEMP_SENSOR_SUPPORTED
+    static temperature_sensor_handle_t sensor = NULL;
+    if (!sensor) {
+        temperature_sensor_config_t config = TEMPERATURE_SENSOR_CONFIG_DEFAULT(-10, 80);
+        if (temperature_sensor_install(&config, &sensor) != ESP_OK || temperature_sensor_enable(sensor) != ESP_OK) {
+            return NAN;
         }
-        return rssi_percent;
     }
-    return 0; // Error value - 0% signal
+    float celsius;
+    if (temperature_sensor_get_celsius(sensor, &celsius) == ESP_OK) {
+        return celsius;
+    }
+#endif
+    return NAN;
 }
 
-static char* get_ip_address(void) {
-    static char ip_str[16];
-    esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
-    if (netif) {
-        esp_netif_ip_info_t ip_info;
-        esp_err_t ret = esp_netif_get_ip_info(netif, &ip_info);
-        if (ret == ESP_OK) {
-            snprintf(ip_str, sizeof(ip_str), IPSTR, IP2STR(&ip_info.ip));
-            return ip_str;
+// ============================================================
+// Resource telemetry
+// ============================================================
+// Heap and per-task figures for spotting leaks, fragmentation and tight stacks in the field.
+// They are collected every RESOURCE_SAMPLE_CYCLES poll cycles and published from that copy,
+// so the cost (one uxTaskGetSystemState() pass) is not paid on every sample.
+// Per-task CPU use is the runtime counter delta between two collections, as a share of the
+// time of all cores together; it needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS and stack
+// figures need CONFIG_FREERTOS_USE_TRACE_FACILITY. Without them only the heap and the BMS
+// loop's own stack are reported.
+// The runtime counter is 32 bits of esp_timer microseconds and wraps every ~71.6 minutes. The
+// unsigned deltas survive one wrap, so CPU shares are left out when two collections are further
+// apart than that (long sample intervals).
+// Up to RESOURCE_MAX_TASKS tasks are published. A system with more is still snapshotted in full,
+// through a buffer sized from uxTaskGetNumberOfTasks(), and flagged as truncated.
+#define RESOURCE_SAMPLE_CYCLES 10
+#define RESOURCE_MAX_TASKS 24
+
+typedef struct {
+    char name[configMAX_TASK_NAME_LEN];
+    uint32_t stack_free;                // Minimum free stack ever, bytes
+    float cpu_pct;                      // Since the previous collection, -1 if unknown
+    int8_t core;                        // -1 = not pinned
+} resource_task_t;
+
+static struct {
+    uint32_t cycles;
+    uint32_t samples;
+    int64_t sampled_us;
+    uint32_t heap_free;
+    uint32_t heap_min_free;
+    uint32_t heap_largest_block;
+    uint32_t internal_free;
+    float temperature;
+    resource_task_t tasks[RESOURCE_MAX_TASKS];
+    int task_count;
+    int task_total;                     // Tasks in the system; more than task_count if truncated
+    uint32_t collect_us;                // Time the last collection took
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+    TaskStatus_t status[RESOURCE_MAX_TASKS];
+    UBaseType_t prev_number[RESOURCE_MAX_TASKS];
+    uint32_t prev_runtime[RESOURCE_MAX_TASKS];
+    int prev_count;
+    uint32_t prev_total;
+#endif
+} resources;
+
+static void resources_sample(void) {
+    int64_t start_us = esp_timer_get_time();
+    resources.heap_free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    resources.heap_min_free = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    resources.heap_largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    resources.internal_free = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    resources.temperature = get_cpu_temperature();
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+    uint32_t total = 0;
+    // uxTaskGetSystemState() returns nothing at all if the buffer is too small. Leave room for
+    // tasks started between the count and the snapshot.
+    UBaseType_t capacity = uxTaskGetNumberOfTasks() + 2;
+    TaskStatus_t *status = resources.status;
+    if (capacity > RESOURCE_MAX_TASKS) {
+        status = malloc(capacity * sizeof(TaskStatus_t));
+    } else {
+        capacity = RESOURCE_MAX_TASKS;
+    }
+    UBaseType_t n = status ? uxTaskGetSystemState(status, capacity, &total) : 0;
+    resources.task_total = n ? (int)n : (int)uxTaskGetNumberOfTasks();
+    uint32_t total_delta = total - resources.prev_total;
+    bool runtime_valid = n > 0 && resources.samples > 0 && total_delta > 0 &&
+                         start_us - resources.sampled_us < (int64_t)UINT32_MAX;
+    if (n > RESOURCE_MAX_TASKS) {
+        n = RESOURCE_MAX_TASKS;
+    }
+    for (UBaseType_t i = 0; i < n; ++i) {
+        const TaskStatus_t *st = &status[i];
+        resource_task_t *t = &resources.tasks[i];
+        snprintf(t->name, sizeof(t->name), "%s", st->pcTaskName);
+        t->stack_free = st->usStackHighWaterMark; // Bytes on ESP-IDF (StackType_t is uint8_t)
+        t->core = st->xCoreID < portNUM_PROCESSORS ? (int8_t)st->xCoreID : -1;
+        t->cpu_pct = -1.0f;
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+        for (int j = 0; j < resources.prev_count; ++j) {
+            if (resources.prev_number[j] == st->xTaskNumber && runtime_valid) {
+                uint32_t delta = st->ulRunTimeCounter - resources.prev_runtime[j];
+                t->cpu_pct = 100.0f * delta / ((float)total_delta * portNUM_PROCESSORS);
+                break;
+            }
         }
+#endif
+    }
+    for (UBaseType_t i = 0; i < n; ++i) {
+        resources.prev_number[i] = status[i].xTaskNumber;
+        resources.prev_runtime[i] = status[i].ulRunTimeCounter;
+    }
+    if (status != resources.status) {
+        free(status);
     }
-    return "0.0.0.0";
+    resources.prev_count = n;
+    resources.prev_total = total;
+    resources.task_count = n;
+#else
+    resource_task_t *t = &resources.tasks[0];
+    snprintf(t->name, sizeof(t->name), "%s", pcTaskGetName(NULL));
+    t->stack_free = uxTaskGetStackHighWaterMark(NULL);
+    t->cpu_pct = -1.0f;
+    t->core = -1;
+    resources.task_count = 1;
+    resources.task_total = (int)uxTaskGetNumberOfTasks();
+#endif
+    resources.samples++;
+    resources.sampled_us = esp_timer_get_time();
+    resources.collect_us = (uint32_t)(resources.sampled_us - start_us);
 }
 
-static float get_cpu_temperature(void) {
-    // ESP32 temperature reading is complex and requires additional configuration
-    // For now, return a placeholder that could be enhanced later
-    // Alternative: Use ADC reading from internal temperature sensor or external sensor
-    return 25.0 + (esp_random() % 20); // Simulated temperature 25-45°C for demonstration
-}
-
-static char* get_software_version(void) {
-    static char version_str[16] = "0.0.0"; // Default fallback - indicates version file not read
-    static bool version_loaded = false;
-    
-    if (!version_loaded) {
-        ESP_LOGI(TAG, "Attempting to read version from /spiffs/version.txt");
-        FILE *version_file = fopen("/spiffs/version.txt", "r");
-        if (version_file) {
-            ESP_LOGI(TAG, "Version file opened successfully");
-            if (fgets(version_str, sizeof(version_str), version_file)) {
-                ESP_LOGI(TAG, "Read version string: '%s'", version_str);
-                // Remove trailing newline if present
-                char *newline = strchr(version_str, '\n');
-                if (newline) *newline = '\0';
-                char *carriage_return = strchr(version_str, '\r');
-                if (carriage_return) *carriage_return = '\0';
-                ESP_LOGI(TAG, "Cleaned version string: '%s'", version_str);
-            } else {
-                ESP_LOGE(TAG, "Failed to read from version file");
+// Called once per poll cycle from the BMS loop
+static void resources_tick(void) {
+    if (resources.cycles++ % RESOURCE_SAMPLE_CYCLES == 0) {
+        resources_sample();
+    }
+}
+
+static void resources_json(cJSON *processor_root) {
+    cJSON *root = cJSON_CreateObject();
+    if (!root || resources.samples == 0) {
+        cJSON_Delete(root);
+        return;
+    }
+    cJSON_AddNumberToObject(root, "sampleAgeMs", (double)((esp_timer_get_time() - resources.sampled_us) / 1000));
+    cJSON_AddNumberToObject(root, "heapFree", resources.heap_free);
+    cJSON_AddNumberToObject(root, "heapMinFree", resources.heap_min_free);
+    cJSON_AddNumberToObject(root, "heapLargestBlock", resources.heap_largest_block);
+    cJSON_AddNumberToObject(root, "heapFragPct", resources.heap_free ?
+                            roundf(1000.0f - 1000.0f * resources.heap_largest_block / resources.heap_free) / 10.0f : 0);
+    cJSON_AddNumberToObject(root, "internalFree", resources.internal_free);
+    cJSON_AddNumberToObject(root, "collectUs", resources.collect_us);
+    // Processor metadata per publish: cached read now, the direct lookups it replaced
+    cJSON *info = cJSON_CreateObject();
+    if (info) {
+        uint32_t cached_us = device_info.cached_samples ?
+                             (uint32_t)(device_info.cached_total_us / device_info.cached_samples) : 0;
+        uint32_t uncached_us = device_info.uncached_samples ?
+                               (uint32_t)(device_info.uncached_total_us / device_info.uncached_samples) : 0;
+        cJSON_AddNumberToObject(info, "cachedUs", cached_us);
+        cJSON_AddNumberToObject(info, "uncachedUs", uncached_us);
+        cJSON_AddNumberToObject(info, "savedUs", uncached_us > cached_us ? uncached_us - cached_us : 0);
+        cJSON_AddNumberToObject(info, "uncachedSamples", device_info.uncached_samples);
+        cJSON_AddItemToObject(root, "deviceInfo", info);
+    }
+    cJSON *tasks = cJSON_CreateArray();
+    if (tasks) {
+        for (int i = 0; i < resources.task_count; ++i) {
+            const resource_task_t *t = &resources.tasks[i];
+            cJSON *task = cJSON_CreateObject();
+            if (!task) {
+                continue;
             }
-            fclose(version_file);
-        } else {
-            ESP_LOGE(TAG, "Failed to open /spiffs/version.txt - file may not exist or SPIFFS not mounted");
+            cJSON_AddStringToObject(task, "name", t->name);
+            cJSON_AddNumberToObject(task, "stackFree", t->stack_free);
+            if (t->cpu_pct >= 0) {
+                cJSON_AddNumberToObject(task, "cpuPct", roundf(t->cpu_pct * 10.0f) / 10.0f);
+            }
+            if (t->core >= 0) {
+                cJSON_AddNumberToObject(task, "core", t->core);
+            }
+            cJSON_AddItemToArray(tasks, task);
         }
-        version_loaded = true;
+        cJSON_AddItemToObject(root, "tasks", tasks);
     }
-    return version_str;
+    cJSON_AddNumberToObject(root, "taskTotal", resources.task_total);
+    cJSON_AddBoolToObject(root, "tasksTruncated", resources.task_total > resources.task_count);
+    cJSON_AddItemToObject(processor_root, "resources", root);
 }
 
 // Placeholder for publishing BMS data
@@ -2369,28 +6577,112 @@ void publish_bms_data_mqtt(const bms_data_t *bms_data_ptr) {
         return;
     }
 
+    // Sample time: UTC ms at frame completion (null until SNTP has synced) and the raw uptime
+    int64_t sample_utc_ms = time_utc_ms(bms_data_ptr->sample_time_us);
+    if (sample_utc_ms) {
+        cJSON_AddNumberToObject(root, "timestamp", (double)sample_utc_ms);
+    } else {
+        cJSON_AddNullToObject(root, "timestamp");
+    }
+    cJSON_AddNumberToObject(root, "sampleUptimeMs", (double)(bms_data_ptr->sample_time_us / 1000));
+    cJSON *time_root = cJSON_CreateObject();
+    if (time_root) {
+        int64_t now_us = esp_timer_get_time();
+        taskENTER_CRITICAL(&time_sync_lock);
+        uint32_t syncs = time_sync.syncs;
+        int64_t synced_mono_us = time_sync.synced_mono_us;
+        int64_t correction_us = time_sync.last_correction_us;
+        float drift_ppm = time_sync.drift_ppm;
+        taskEXIT_CRITICAL(&time_sync_lock);
+        cJSON_AddBoolToObject(time_root, "synced", syncs > 0);
+        cJSON_AddStringToObject(time_root, "server", ntp_server);
+        cJSON_AddNumberToObject(time_root, "syncs", syncs);
+        cJSON_AddNumberToObject(time_root, "lastSyncAgeS", syncs ? (double)((now_us - synced_mono_us) / 1000000) : -1);
+        cJSON_AddNumberToObject(time_root, "lastCorrectionMs", correction_us / 1000.0);
+        cJSON_AddNumberToObject(time_root, "driftPpm", drift_ppm);
+        cJSON_AddItemToObject(root, "timeSync", time_root);
+    }
+
     // Add processor metrics data first
     cJSON *processor_root = cJSON_CreateObject();
     if (processor_root) {
-        // WiFi RSSI as percentage
-        int32_t wifi_rssi_percent = get_wifi_rssi_percent();
+        // WiFi RSSI as percentage and IP address, from the device info cache
+        int32_t wifi_rssi_percent;
+        char ip_address[16];
+        device_info_network(&wifi_rssi_percent, ip_address, sizeof(ip_address));
         cJSON_AddNumberToObject(processor_root, "WiFiRSSI", wifi_rssi_percent);
-        
-        // IP Address
-        char *ip_address = get_ip_address();
         cJSON_AddStringToObject(processor_root, "IPAddress", ip_address);
         
-        // CPU Temperature
-        float cpu_temp = get_cpu_temperature();
-        cJSON_AddNumberToObject(processor_root, "CPUTemperature", cpu_temp);
+        // CPU Temperature (null where the chip has no usable sensor)
+        if (resources.samples > 0 && !isnan(resources.temperature)) {
+            cJSON_AddNumberToObject(processor_root, "CPUTemperature", roundf(resources.temperature * 10.0f) / 10.0f);
+        } else {
+            cJSON_AddNullToObject(processor_root, "CPUTemperature");
+        }
         
         // Software Version
-        char *software_version = get_software_version();
-        cJSON_AddStringToObject(processor_root, "SoftwareVersion", software_version);
+        cJSON_AddStringToObject(processor_root, "SoftwareVersion", device_info.version);
         
         // Watchdog Restart Count
         cJSON_AddNumberToObject(processor_root, "WDTRestartCount", watchdog_reset_counter);
         
+        // Telemetry publish path (flow control towards a slow broker)
+        cJSON *outbox = cJSON_CreateObject();
+        if (outbox) {
+            cJSON_AddNumberToObject(outbox, "inFlight", mqtt_pub_in_flight());
+            cJSON_AddNumberToObject(outbox, "peakInFlight", mqtt_out_stats.peak_in_flight);
+            cJSON_AddNumberToObject(outbox, "enqueued", mqtt_out_stats.enqueued);
+            cJSON_AddNumberToObject(outbox, "acked", mqtt_out_stats.acked);
+            cJSON_AddNumberToObject(outbox, "expired", mqtt_out_stats.expired);
+            cJSON_AddNumberToObject(outbox, "droppedBusy", mqtt_out_stats.dropped_busy);
+            cJSON_AddNumberToObject(outbox, "droppedOutbox", mqtt_out_stats.dropped_outbox);
+            cJSON_AddNumberToObject(outbox, "printOverflows", mqtt_out_stats.print_overflows);
+            cJSON_AddNumberToObject(outbox, "outboxBytes", esp_mqtt_client_get_outbox_size(mqtt_client));
+            cJSON_AddNumberToObject(outbox, "outboxLimitKB", mqtt_outbox_kb);
+            cJSON_AddNumberToObject(outbox, "fanoutPublished", fanout.published);
+            cJSON_AddNumberToObject(outbox, "fanoutSuppressed", fanout.suppressed);
+            cJSON_AddNumberToObject(outbox, "discoveryConfigs", fanout.discovery_configs);
+            cJSON_AddNumberToObject(outbox, "batchesPublished", batch.published);
+            cJSON_AddNumberToObject(outbox, "batchedSamples", batch.samples_published);
+            cJSON_AddNumberToObject(outbox, "batchDroppedSamples", batch.samples_dropped);
+            cJSON_AddNumberToObject(outbox, "batchBytesEncoded", batch.bytes_encoded);
+            cJSON_AddNumberToObject(outbox, "batchBytesSent", batch.bytes_sent);
+            cJSON_AddItemToObject(processor_root, "MQTTOutbox", outbox);
+        }
+        
+        // Boot milestones (ms since reset) for measuring how much data a restart costs
+        cJSON *boot_root = cJSON_CreateObject();
+        if (boot_root) {
+            cJSON_AddStringToObject(boot_root, "resetReason", reset_reason_name(esp_reset_reason()));
+            cJSON_AddNumberToObject(boot_root, "firstSampleMs", boot_marks.first_sample_us / 1000);
+            cJSON_AddNumberToObject(boot_root, "wifiMs", boot_marks.wifi_ip_us / 1000);
+            cJSON_AddNumberToObject(boot_root, "mqttMs", boot_marks.mqtt_connected_us / 1000);
+            cJSON_AddNumberToObject(boot_root, "firstPublishMs", boot_marks.first_publish_us / 1000);
+            cJSON_AddBoolToObject(boot_root, "snapshotRestored", rtc_snap_stats.restored);
+            cJSON_AddNumberToObject(boot_root, "downtimeMs", rtc_snap_stats.downtime_ms);
+            cJSON_AddNumberToObject(boot_root, "restoredSamples", rtc_snap_stats.restored_samples);
+            cJSON_AddNumberToObject(boot_root, "lostSamples", rtc_snap_stats.dropped_samples);
+            cJSON_AddNumberToObject(boot_root, "snapshotWriteUs", rtc_snap_stats.last_write_us);
+            cJSON_AddItemToObject(processor_root, "boot", boot_root);
+        }
+        recovery_json(processor_root);
+        wifi_link_json(processor_root);
+        resources_json(processor_root);
+        
+        // Power management: awake time of the last complete cycle and the estimated draw
+        cJSON *power_root = cJSON_CreateObject();
+        if (power_root) {
+            cJSON_AddStringToObject(power_root, "mode", !power_save_enabled ? "off" : power.light_sleep ? "lightSleep" : "modemSleep");
+            cJSON_AddNumberToObject(power_root, "awakeMs", power.awake_us / 1000.0);
+            cJSON_AddNumberToObject(power_root, "cycleMs", power.period_us / 1000.0);
+            cJSON_AddNumberToObject(power_root, "awakePct", power.period_us ? 100.0 * power.awake_us / power.period_us : 100.0);
+            cJSON_AddNumberToObject(power_root, "estAvgMa", power.avg_ma);
+            cJSON_AddNumberToObject(power_root, "estEnergyMwh", power.energy_mwh);
+            cJSON_AddNumberToObject(power_root, "publishLatencyMs", power.publish_latency_us / 1000.0);
+            cJSON_AddNumberToObject(power_root, "maxPublishLatencyMs", power.max_publish_latency_us / 1000.0);
+            cJSON_AddItemToObject(processor_root, "power", power_root);
+        }
+        
         cJSON_AddItemToObject(root, "processor", processor_root);
     }
 
@@ -2410,6 +6702,13 @@ void publish_bms_data_mqtt(const bms_data_t *bms_data_ptr) {
         cJSON_AddNumberToObject(pack_root, "packMinCellV", bms_data_ptr->min_cell_voltage);
         cJSON_AddNumberToObject(pack_root, "packMaxCellV", bms_data_ptr->max_cell_voltage);
         cJSON_AddNumberToObject(pack_root, "packCellVDelta", bms_data_ptr->cell_voltage_delta);
+        cJSON_AddNumberToObject(pack_root, "packMinCellIdx", bms_data_ptr->min_cell_idx);
+        cJSON_AddNumberToObject(pack_root, "packMaxCellIdx", bms_data_ptr->max_cell_idx);
+        cJSON_AddNumberToObject(pack_root, "packCellMeanMv", bms_data_ptr->cell_mean_mv);
+        cJSON_AddNumberToObject(pack_root, "packCellStdDevMv", bms_data_ptr->cell_stddev_mv);
+        cJSON_AddNumberToObject(pack_root, "packCellMedianMv", bms_data_ptr->cell_median_mv);
+        cJSON_AddNumberToObject(pack_root, "packCellDeltaMv", bms_data_ptr->cell_delta_mv);
+        cJSON_AddNumberToObject(pack_root, "packCellsAboveBalanceThreshold", bms_data_ptr->cells_above_balance_threshold);
         
         // Add temperature sensors
         cJSON *temp_sensors = cJSON_CreateObject();
@@ -2522,13 +6821,8 @@ void publish_bms_data_mqtt(const bms_data_t *bms_data_ptr) {
         // Add expanded extra fields (comprehensive BMS system data)
         // Include ALL available extra fields to maximize data coverage
         for (int i = 0; i < extra_fields_count && i < MAX_EXTRA_FIELDS; ++i) { // Include all available fields
-            const char *field_name = NULL;
-            for (size_t j = 0; j < BMS_IDCODES_COUNT; ++j) {
-                if (bms_idcodes[j].id == extra_fields[i].id) {
-                    field_name = bms_idcodes[j].name;
-                    break;
-                }
-            }
+            const bms_idcode_t *code = bms_idcode_lookup(extra_fields[i].id);
+            const char *field_name = code ? code->name : NULL;
             if (field_name) {
                 // Include ALL BMS fields for maximum data coverage
                 uint8_t field_id = extra_fields[i].id;
@@ -2585,9 +6879,198 @@ void publish_bms_data_mqtt(const bms_data_t *bms_data_ptr) {
             }
             cJSON_AddItemToObject(pack_root, "rawExtraFields", raw_extra_fields);
         }
+
+        // Decoded 0x8B/0x8C words: names of the bits currently set (transitions go to <bms_topic>/events)
+        if (bms_data_ptr->flags_valid) {
+            cJSON *warnings = cJSON_CreateArray();
+            cJSON *status = cJSON_CreateArray();
+            if (warnings && status) {
+                for (size_t i = 0; i < BMS_WARNING_FLAGS_COUNT; ++i) {
+                    if (bms_data_ptr->warning_flags & (1u << bms_warning_flags[i].bit)) {
+                        cJSON_AddItemToArray(warnings, cJSON_CreateString(bms_warning_flags[i].name));
+                    }
+                }
+                for (size_t i = 0; i < BMS_STATUS_FLAGS_COUNT; ++i) {
+                    if (bms_data_ptr->status_flags & (1u << bms_status_flags[i].bit)) {
+                        cJSON_AddItemToArray(status, cJSON_CreateString(bms_status_flags[i].name));
+                    }
+                }
+                cJSON_AddItemToObject(pack_root, "bmsWarnings", warnings);
+                cJSON_AddItemToObject(pack_root, "bmsStatus", status);
+                cJSON_AddNumberToObject(pack_root, "cycleCount", bms_data_ptr->cycle_count);
+            } else {
+                cJSON_Delete(warnings);
+                cJSON_Delete(status);
+            }
+        }
+
+        // Summarise the anomaly detector state (transitions are published on <bms_topic>/alerts)
+        cJSON *active_alerts = cJSON_CreateArray();
+        if (active_alerts) {
+            for (int i = 0; i < ALERT_COUNT; ++i) {
+                if (alerts[i].active) {
+                    cJSON_AddItemToArray(active_alerts, cJSON_CreateString(alerts[i].name));
+                }
+            }
+            cJSON_AddItemToObject(pack_root, "activeAlerts", active_alerts);
+        }
+        
+        // Add on-device energy/throughput counters
+        cJSON *energy = cJSON_CreateObject();
+        if (energy && energy_acc.loaded) {
+            double unsaved_ah = energy_acc.totals.charge_ah + energy_acc.totals.discharge_ah - energy_acc.saved_throughput_ah;
+            double unsaved_wh = energy_acc.totals.charge_wh + energy_acc.totals.discharge_wh - energy_acc.saved_throughput_wh;
+            cJSON_AddNumberToObject(energy, "chargeAh", energy_acc.totals.charge_ah);
+            cJSON_AddNumberToObject(energy, "dischargeAh", energy_acc.totals.discharge_ah);
+            cJSON_AddNumberToObject(energy, "chargeWh", energy_acc.totals.charge_wh);
+            cJSON_AddNumberToObject(energy, "dischargeWh", energy_acc.totals.discharge_wh);
+            cJSON_AddNumberToObject(energy, "unsavedAh", unsaved_ah);
+            cJSON_AddNumberToObject(energy, "unsavedWh", unsaved_wh);
+            cJSON_AddNumberToObject(energy, "lastSaveAgeS", (double)((esp_timer_get_time() - energy_acc.last_save_us) / 1000000));
+            cJSON_AddNumberToObject(energy, "nvsWrites", energy_acc.nvs_writes);
+            cJSON_AddNumberToObject(energy, "restoreCount", energy_acc.totals.restore_count);
+            cJSON_AddNumberToObject(energy, "gapSeconds", energy_acc.totals.gap_seconds);
+            cJSON_AddItemToObject(pack_root, "energy", energy);
+        } else if (energy) {
+            cJSON_Delete(energy);
+        }
         cJSON_AddItemToObject(root, "pack", pack_root);
     }
 
+    // Add RS485 link / decoder quality counters
+    cJSON *link_root = cJSON_CreateObject();
+    if (link_root) {
+        cJSON_AddNumberToObject(link_root, "framesDecoded", decode_quality.frames);
+        cJSON_AddNumberToObject(link_root, "framesClean", decode_quality.frames_clean);
+        cJSON_AddNumberToObject(link_root, "framesUnknownId", decode_quality.frames_flagged[DECODE_UNKNOWN_ID]);
+        cJSON_AddNumberToObject(link_root, "framesTruncated", decode_quality.frames_flagged[DECODE_TRUNCATED]);
+        cJSON_AddNumberToObject(link_root, "framesFieldOverflow", decode_quality.frames_flagged[DECODE_FIELD_OVERFLOW]);
+        cJSON_AddNumberToObject(link_root, "exchanges", bms_link.frames);
+        cJSON_AddNumberToObject(link_root, "crcErrors", bms_link.crc_errors);
+        cJSON_AddNumberToObject(link_root, "malformedFrames", bms_link.malformed);
+        cJSON_AddNumberToObject(link_root, "frameErrorRate",
+                                bms_link.frames ? (double)(bms_link.crc_errors + bms_link.malformed) / bms_link.frames : 0.0);
+        cJSON_AddNumberToObject(link_root, "retries", bms_link.retries);
+        cJSON_AddNumberToObject(link_root, "recovered", bms_link.recovered);
+        cJSON_AddNumberToObject(link_root, "slotsLost", bms_link.slots_lost);
+        cJSON_AddNumberToObject(link_root, "lastRetryMs", bms_link.last_retry_ms);
+        cJSON_AddNumberToObject(link_root, "maxRetryMs", bms_link.max_retry_ms);
+        cJSON_AddNumberToObject(link_root, "avgRetryMs",
+                                bms_link.retries ? (double)bms_link.retry_ms_total / bms_link.retries : 0.0);
+        cJSON *last = cJSON_CreateObject();
+        if (last) {
+            cJSON_AddStringToObject(last, "status", decode_status_names[decode_quality.status]);
+            cJSON_AddNumberToObject(last, "fields", decode_quality.fields);
+            cJSON_AddNumberToObject(last, "duplicates", decode_quality.duplicates);
+            cJSON_AddNumberToObject(last, "bytesDecoded", decode_quality.bytes_decoded);
+            cJSON_AddNumberToObject(last, "payloadBytes", decode_quality.payload_bytes);
+            if (decode_quality.status != DECODE_OK) {
+                cJSON_AddNumberToObject(last, "stopId", decode_quality.stop_id);
+                cJSON_AddNumberToObject(last, "stopOffset", decode_quality.stop_offset);
+            }
+            cJSON_AddItemToObject(link_root, "lastFrame", last);
+        }
+        cJSON *latency = cJSON_CreateObject();
+        if (latency) {
+            char terminal_hex[9];
+            snprintf(terminal_hex, sizeof(terminal_hex), "%08lX", (unsigned long)bms_latency.terminal);
+            cJSON_AddStringToObject(latency, "terminal", terminal_hex);
+            cJSON_AddNumberToObject(latency, "firstByteMs", bms_latency.last_first_ms);
+            cJSON_AddNumberToObject(latency, "completeMs", bms_latency.last_complete_ms);
+            cJSON_AddNumberToObject(latency, "firstByteMsEwma", bms_latency.est.ewma_first_ms);
+            cJSON_AddNumberToObject(latency, "completeMsEwma", bms_latency.est.ewma_complete_ms);
+            cJSON_AddNumberToObject(latency, "completeMsP95", bms_latency.p95_ms);
+            cJSON_AddNumberToObject(latency, "deadlineMs", bms_latency.deadline_ms);
+            cJSON_AddNumberToObject(latency, "timeouts", bms_latency.timeouts);
+            cJSON_AddItemToObject(link_root, "latency", latency);
+        }
+        cJSON *wire = cJSON_CreateObject();
+        if (wire) {
+            cJSON_AddNumberToObject(wire, "baud", bms_baud_active);
+            cJSON_AddStringToObject(wire, "baudMode", bms_baud_config ? "fixed" : (bms_wire.probed ? "auto" : "autoFallback"));
+            cJSON_AddNumberToObject(wire, "txBytes", bms_wire.last_tx_bytes);
+            cJSON_AddNumberToObject(wire, "rxBytes", bms_wire.last_rx_bytes);
+            cJSON_AddNumberToObject(wire, "wireMs", bms_wire.last_wire_us / 1000.0);
+            cJSON_AddNumberToObject(wire, "exchangeMs", bms_wire.last_exchange_us / 1000.0);
+            cJSON_AddNumberToObject(wire, "cycleMs", bms_wire.last_cycle_us / 1000.0);
+            cJSON_AddNumberToObject(wire, "wireShare",
+                                    bms_wire.last_cycle_us ? (double)bms_wire.last_wire_us / bms_wire.last_cycle_us : 0.0);
+            cJSON_AddItemToObject(link_root, "wire", wire);
+        }
+        cJSON *tier = cJSON_CreateObject();
+        if (tier) {
+            cJSON_AddStringToObject(tier, "lastCycle", bms_tier.last_fast ? "fast" : "full");
+            cJSON_AddNumberToObject(tier, "fullReadMin", full_read_interval_min);
+            cJSON_AddNumberToObject(tier, "fastCycles", bms_tier.fast_cycles);
+            cJSON_AddNumberToObject(tier, "fullCycles", bms_tier.full_cycles);
+            cJSON_AddNumberToObject(tier, "fallbacks", bms_tier.fallbacks);
+            cJSON_AddNumberToObject(tier, "fastBusMs", bms_tier.fast_bus_us / 1000.0);
+            cJSON_AddNumberToObject(tier, "fullBusMs", bms_tier.full_bus_us / 1000.0);
+            cJSON_AddNumberToObject(tier, "fastBytes", bms_tier.fast_bytes);
+            cJSON_AddNumberToObject(tier, "fullBytes", bms_tier.full_bytes);
+            cJSON_AddBoolToObject(tier, "fastSuspended", bms_tier.fast_suspended);
+            cJSON_AddItemToObject(link_root, "tier", tier);
+        }
+        cJSON *bus = cJSON_CreateObject();
+        if (bus) {
+            cJSON *bounds = cJSON_CreateArray();
+            for (int b = 0; bounds && b < BMS_BUS_HIST_BUCKETS - 1; ++b) {
+                cJSON_AddItemToArray(bounds, cJSON_CreateNumber(bms_bus_hist_bounds_ms[b]));
+            }
+            cJSON_AddItemToObject(bus, "histBoundsMs", bounds);
+            for (int p = 0; p < BMS_PRIO_COUNT; ++p) {
+                cJSON *cls = cJSON_CreateObject();
+                if (!cls) {
+                    continue;
+                }
+                cJSON_AddNumberToObject(cls, "count", bms_bus[p].count);
+                cJSON_AddNumberToObject(cls, "failed", bms_bus[p].failed);
+                cJSON_AddNumberToObject(cls, "deadlineMs", bms_prio_deadline_ms[p]);
+                cJSON_AddNumberToObject(cls, "deadlineMisses", bms_bus[p].deadline_misses);
+                cJSON_AddNumberToObject(cls, "preempted", bms_bus[p].preempted);
+                cJSON_AddNumberToObject(cls, "lastMs", bms_bus[p].last_ms);
+                cJSON_AddNumberToObject(cls, "maxMs", bms_bus[p].max_ms);
+                cJSON *hist = cJSON_CreateArray();
+                for (int b = 0; hist && b < BMS_BUS_HIST_BUCKETS; ++b) {
+                    cJSON_AddItemToArray(hist, cJSON_CreateNumber(bms_bus[p].hist[b]));
+                }
+                cJSON_AddItemToObject(cls, "hist", hist);
+                cJSON_AddItemToObject(bus, bms_prio_names[p], cls);
+            }
+            cJSON_AddItemToObject(link_root, "bus", bus);
+        }
+        if (mqtt_cmd_enabled) {
+            cJSON *commands = cJSON_CreateObject();
+            if (commands) {
+                taskENTER_CRITICAL(&bms_cmd_stats_lock);
+                uint32_t accepted = bms_cmd_stats.accepted;
+                uint32_t confirmed = bms_cmd_stats.confirmed;
+                uint32_t failed = bms_cmd_stats.failed;
+                uint32_t rejected = bms_cmd_stats.rejected;
+                uint32_t rate_limited = bms_cmd_stats.rate_limited;
+                uint32_t duplicates = bms_cmd_stats.duplicates;
+                uint32_t last_latency_ms = bms_cmd_stats.last_latency_ms;
+                taskEXIT_CRITICAL(&bms_cmd_stats_lock);
+                cJSON_AddNumberToObject(commands, "accepted", accepted);
+                cJSON_AddNumberToObject(commands, "confirmed", confirmed);
+                cJSON_AddNumberToObject(commands, "failed", failed);
+                cJSON_AddNumberToObject(commands, "rejected", rejected);
+                cJSON_AddNumberToObject(commands, "rateLimited", rate_limited);
+                cJSON_AddNumberToObject(commands, "duplicates", duplicates);
+                cJSON_AddNumberToObject(commands, "lastLatencyMs", last_latency_ms);
+                cJSON_AddItemToObject(link_root, "commands", commands);
+            }
+        }
+        cJSON *echo = cJSON_CreateObject();
+        if (echo) {
+            cJSON_AddStringToObject(echo, "state", bms_echo_state_names[bms_echo.state]);
+            cJSON_AddNumberToObject(echo, "skipped", bms_echo.skipped);
+            cJSON_AddNumberToObject(echo, "unexpected", bms_echo.unexpected);
+            cJSON_AddItemToObject(link_root, "echo", echo);
+        }
+        cJSON_AddItemToObject(root, "bmsLink", link_root);
+    }
+
     // Add cells data (volts only)
     cJSON *cells_root = cJSON_CreateObject();
     if (cells_root) {
@@ -2600,19 +7083,58 @@ void publish_bms_data_mqtt(const bms_data_t *bms_data_ptr) {
         cJSON_AddItemToObject(root, "cells", cells_root);
     }
 
-    // Publish as a single topic
-    char *json_string = cJSON_PrintUnformatted(root);
+    // Publish as a single topic, printed into the static buffer. An oversized document still goes
+    // out through a one-off allocation so no sample is lost to the buffer size.
+    const out_stream_t *stream = &out_streams[OUT_TELEMETRY];
+    if (stream->encoding == OUT_ENC_OFF) {
+        cJSON_Delete(root);
+        return;
+    }
+    // QoS 0 gets no PUBACK, so it needs no in-flight slot; esp-mqtt drops it once sent
+    int slot = stream->qos > 0 ? mqtt_pub_slot_acquire(true) : MQTT_PUB_SLOTS;
+    if (slot < 0) {
+        mqtt_out_stats.dropped_busy++;
+        ESP_LOGW(TAG, "Broker has not acknowledged the last %d messages, dropping this sample", MQTT_PUB_MAX_IN_FLIGHT);
+        cJSON_Delete(root);
+        return;
+    }
+    char *json_string = mqtt_pub_buf;
+    if (!cJSON_PrintPreallocated(root, mqtt_pub_buf, sizeof(mqtt_pub_buf), false)) {
+        mqtt_out_stats.print_overflows++;
+        json_string = cJSON_PrintUnformatted(root);
+    }
     if (json_string == NULL) {
         ESP_LOGE(TAG, "Failed to print combined cJSON to string.");
+        if (slot < MQTT_PUB_SLOTS) mqtt_pub_slot_set(slot, -1);
     } else {
-        char topic[64];
-        // Use bms_topic directly without any BMS prefix
-        snprintf(topic, sizeof(topic), "%s", bms_topic);
-        if (debug_logging) printf("[DEBUG] About to publish to topic: %s\n", topic);
-        if (debug_logging) printf("[DEBUG] JSON payload length: %d\n", strlen(json_string));
-        esp_mqtt_client_publish(mqtt_client, topic, json_string, 0, 1, 0);
-        ESP_LOGI(TAG, "Published to %s (length: %d)", topic, strlen(json_string));
-        free(json_string);
+        int len = strlen(json_string);
+        if (debug_logging) printf("[DEBUG] About to publish to topic: %s\n", stream->topic);
+        if (debug_logging) printf("[DEBUG] JSON payload length: %d\n", len);
+        int msg_id = out_enqueue(OUT_TELEMETRY, NULL, json_string, len);
+        if (slot < MQTT_PUB_SLOTS) mqtt_pub_slot_set(slot, msg_id);
+        if (msg_id < 0) {
+            mqtt_out_stats.dropped_outbox++;
+            ESP_LOGW(TAG, "MQTT outbox full (%d bytes), dropping this sample", esp_mqtt_client_get_outbox_size(mqtt_client));
+        } else {
+            mqtt_out_stats.enqueued++;
+            power.publish_latency_us = (uint32_t)(esp_timer_get_time() - bms_data_ptr->sample_time_us);
+            if (power.publish_latency_us > power.max_publish_latency_us) {
+                power.max_publish_latency_us = power.publish_latency_us;
+            }
+            ESP_LOGI(TAG, "Queued to %s (length: %d)", stream->topic, len);
+            if (stream->qos == 0 && mqtt_connected) {
+                // No MQTT_EVENT_PUBLISHED will follow; count a send while connected as the heartbeat
+                boot_mark(&boot_marks.first_publish_us);
+                blink_heartbeat();
+                publish_unconfirmed = false;
+                if (watchdog_enabled) {
+                    last_successful_publish = xTaskGetTickCount();
+                }
+            }
+        }
+        if (json_string != mqtt_pub_buf) {
+            free(json_string);
+        }
     }
     cJSON_Delete(root);
 }
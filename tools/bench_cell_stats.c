@@ -0,0 +1,107 @@
+// Host benchmark and self-check for compute_cell_stats() (src/cell_stats.h).
+//
+// Build and run from the repository root:
+//   gcc -O2 -o bench_cell_stats tools/bench_cell_stats.c -lm && ./bench_cell_stats
+//
+// The kernel's results are first compared with a straightforward reference (qsort based) over
+// random packs of 1 - 32 cells, including unpopulated 0 mV taps. The timing loop then runs the
+// kernel over a fixed set of packs and prints the time per call for 16 and 32 cells.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/cell_stats.h"
+
+#define CHECK_ROUNDS 100000
+#define BENCH_ITERATIONS 1000000
+#define BENCH_PACKS 64
+
+static int cmp_u16(const void *a, const void *b) {
+    return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+static void reference_stats(const uint16_t *mv, int n, uint16_t threshold_mv, cell_stats_t *out) {
+    uint16_t vals[BMS_MAX_CELLS];
+    int valid = 0;
+    double sum = 0, sum_sq = 0;
+    memset(out, 0, sizeof(*out));
+    out->min_mv = 0xFFFF;
+    for (int i = 0; i < n; i++) {
+        if (mv[i] == 0) {
+            continue;
+        }
+        vals[valid++] = mv[i];
+        sum += mv[i];
+        sum_sq += (double)mv[i] * mv[i];
+        if (mv[i] < out->min_mv) { out->min_mv = mv[i]; out->min_idx = (uint8_t)i; }
+        if (mv[i] > out->max_mv) { out->max_mv = mv[i]; out->max_idx = (uint8_t)i; }
+    }
+    if (valid == 0) {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    qsort(vals, valid, sizeof(vals[0]), cmp_u16);
+    out->valid_cells = (uint8_t)valid;
+    out->delta_mv = out->max_mv - out->min_mv;
+    out->mean_mv = (float)(sum / valid);
+    out->stddev_mv = (float)sqrt(sum_sq / valid - (sum / valid) * (sum / valid));
+    out->median_mv = (valid & 1) ? vals[valid / 2] : (uint16_t)((vals[valid / 2 - 1] + vals[valid / 2]) / 2);
+    for (int i = 0; i < valid; i++) {
+        out->above_threshold += vals[i] > out->min_mv + threshold_mv;
+    }
+}
+
+// LiFePO4-like pack: 3300 mV +- 40, with an occasional unpopulated tap
+static void random_pack(uint16_t *mv, int n) {
+    for (int i = 0; i < n; i++) {
+        mv[i] = (rand() % 50 == 0) ? 0 : (uint16_t)(3260 + rand() % 81);
+    }
+}
+
+static int check(void) {
+    uint16_t mv[BMS_MAX_CELLS];
+    for (int round = 0; round < CHECK_ROUNDS; round++) {
+        int n = 1 + rand() % BMS_MAX_CELLS;
+        random_pack(mv, n);
+        cell_stats_t got, want;
+        compute_cell_stats(mv, n, 10, &got);
+        reference_stats(mv, n, 10, &want);
+        if (got.min_mv != want.min_mv || got.max_mv != want.max_mv || got.min_idx != want.min_idx ||
+            got.max_idx != want.max_idx || got.median_mv != want.median_mv || got.delta_mv != want.delta_mv ||
+            got.above_threshold != want.above_threshold || got.valid_cells != want.valid_cells ||
+            fabsf(got.mean_mv - want.mean_mv) > 0.01f || fabsf(got.stddev_mv - want.stddev_mv) > 0.01f) {
+            printf("Mismatch in round %d (%d cells)\n", round, n);
+            return 1;
+        }
+    }
+    printf("Self-check: %d random packs match the reference\n", CHECK_ROUNDS);
+    return 0;
+}
+
+static void bench(int n) {
+    static uint16_t packs[BENCH_PACKS][BMS_MAX_CELLS];
+    for (int p = 0; p < BENCH_PACKS; p++) {
+        random_pack(packs[p], n);
+    }
+    volatile uint32_t sink = 0;
+    cell_stats_t stats;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        compute_cell_stats(packs[i % BENCH_PACKS], n, 10, &stats);
+        sink += stats.median_mv;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("%2d cells: %.1f ns per call (%d calls, %.3f s)\n", n, ns / BENCH_ITERATIONS, BENCH_ITERATIONS, ns / 1e9);
+    (void)sink;
+}
+
+int main(void) {
+    srand(1);
+    if (check()) {
+        return 1;
+    }
+    bench(16);
+    bench(32);
+    return 0;
+}
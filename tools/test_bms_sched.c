@@ -0,0 +1,128 @@
+// Host test for the BMS bus transaction queue (src/bms_sched.h).
+//
+// Build and run from the repository root:
+//   gcc -O2 -Wall -o test_bms_sched tools/test_bms_sched.c && ./test_bms_sched
+//
+// Checks the order the firmware's dispatcher runs jobs in: priority first (safety > fast > full
+// > diag), first in first out within a priority, a safety job queued mid-cycle overtaking the
+// rest of the cycle, and a full queue making room for higher priorities only.
+#include <stdio.h>
+#include "../src/bms_sched.h"
+
+enum { KIND_READ_ID, KIND_READ_ALL, KIND_CMD, KIND_PROBE };
+
+static int failures = 0;
+
+#define EXPECT(cond, ...) do { \
+    if (!(cond)) { printf("FAIL line %d: ", __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } \
+} while (0)
+
+// Pops one job and checks its priority and argument
+static void expect_pop(bms_sched_t *s, bms_prio_t prio, uint16_t arg, int line) {
+    bms_job_t job;
+    if (!bms_sched_pop(s, &job)) {
+        printf("FAIL line %d: queue empty, expected prio %d arg %u\n", line, prio, arg);
+        failures++;
+        return;
+    }
+    if (job.prio != prio || job.arg != arg) {
+        printf("FAIL line %d: got prio %u arg %u, expected prio %d arg %u\n", line, job.prio, job.arg, prio, arg);
+        failures++;
+    }
+}
+
+static void test_priority_order(void) {
+    bms_sched_t s;
+    bms_sched_init(&s);
+    bms_sched_push(&s, BMS_PRIO_DIAG, KIND_PROBE, 0);
+    bms_sched_push(&s, BMS_PRIO_FULL, KIND_READ_ALL, 0);
+    bms_sched_push(&s, BMS_PRIO_FAST, KIND_READ_ID, 0x79);
+    bms_sched_push(&s, BMS_PRIO_FAST, KIND_READ_ID, 0x80);
+    bms_sched_push(&s, BMS_PRIO_SAFETY, KIND_CMD, 1);
+    bms_sched_push(&s, BMS_PRIO_FAST, KIND_READ_ID, 0x84);
+    expect_pop(&s, BMS_PRIO_SAFETY, 1, __LINE__);
+    expect_pop(&s, BMS_PRIO_FAST, 0x79, __LINE__);
+    expect_pop(&s, BMS_PRIO_FAST, 0x80, __LINE__);
+    expect_pop(&s, BMS_PRIO_FAST, 0x84, __LINE__);
+    expect_pop(&s, BMS_PRIO_FULL, 0, __LINE__);
+    expect_pop(&s, BMS_PRIO_DIAG, 0, __LINE__);
+    bms_job_t job;
+    EXPECT(!bms_sched_pop(&s, &job), "queue should be empty");
+}
+
+static void test_safety_overtakes_cycle(void) {
+    bms_sched_t s;
+    bms_sched_init(&s);
+    bms_sched_push(&s, BMS_PRIO_FAST, KIND_READ_ID, 0x79);
+    bms_sched_push(&s, BMS_PRIO_FAST, KIND_READ_ID, 0x83);
+    bms_sched_push(&s, BMS_PRIO_FAST, KIND_READ_ID, 0x84);
+    expect_pop(&s, BMS_PRIO_FAST, 0x79, __LINE__);
+    // Commands arriving while the cycle runs go next, in arrival order
+    bms_sched_push(&s, BMS_PRIO_SAFETY, KIND_CMD, 0);
+    bms_sched_push(&s, BMS_PRIO_SAFETY, KIND_CMD, 1);
+    EXPECT(bms_sched_pending(&s, BMS_PRIO_FAST) == 2, "two fast reads should be waiting");
+    expect_pop(&s, BMS_PRIO_SAFETY, 0, __LINE__);
+    expect_pop(&s, BMS_PRIO_SAFETY, 1, __LINE__);
+    expect_pop(&s, BMS_PRIO_FAST, 0x83, __LINE__);
+    expect_pop(&s, BMS_PRIO_FAST, 0x84, __LINE__);
+}
+
+static void test_fallback_after_cancel(void) {
+    bms_sched_t s;
+    bms_sched_init(&s);
+    bms_sched_push(&s, BMS_PRIO_FAST, KIND_READ_ID, 0x79);
+    bms_sched_push(&s, BMS_PRIO_FAST, KIND_READ_ID, 0x80);
+    bms_sched_push(&s, BMS_PRIO_FAST, KIND_READ_ID, 0x81);
+    bms_sched_push(&s, BMS_PRIO_DIAG, KIND_PROBE, 0);
+    expect_pop(&s, BMS_PRIO_FAST, 0x79, __LINE__);
+    // A failed single read drops the rest of the fast set and queues a read-all instead
+    EXPECT(bms_sched_cancel(&s, KIND_READ_ID) == 2, "two fast reads should be cancelled");
+    bms_sched_push(&s, BMS_PRIO_FULL, KIND_READ_ALL, 0);
+    expect_pop(&s, BMS_PRIO_FULL, 0, __LINE__);
+    expect_pop(&s, BMS_PRIO_DIAG, 0, __LINE__);
+}
+
+static void test_full_queue(void) {
+    bms_sched_t s;
+    bms_sched_init(&s);
+    for (int i = 0; i < BMS_SCHED_MAX_JOBS; ++i) {
+        bms_sched_push(&s, i < 2 ? BMS_PRIO_DIAG : BMS_PRIO_FULL, KIND_READ_ALL, (uint16_t)i);
+    }
+    // The newest diag job makes room for the safety job
+    EXPECT(bms_sched_push(&s, BMS_PRIO_SAFETY, KIND_CMD, 100), "safety job should be queued");
+    EXPECT(s.evicted[BMS_PRIO_DIAG] == 1, "one diag job should be evicted");
+    EXPECT(bms_sched_pending(&s, BMS_PRIO_DIAG) == 1, "the older diag job should remain");
+    expect_pop(&s, BMS_PRIO_SAFETY, 100, __LINE__);
+    // A job never displaces one of its own or a higher priority
+    EXPECT(bms_sched_push(&s, BMS_PRIO_FULL, KIND_READ_ALL, 200), "room left by the pop");
+    EXPECT(!bms_sched_push(&s, BMS_PRIO_DIAG, KIND_PROBE, 300), "diag job should be refused");
+    EXPECT(s.rejected[BMS_PRIO_DIAG] == 1, "one diag job should be refused");
+    expect_pop(&s, BMS_PRIO_FULL, 2, __LINE__);
+    expect_pop(&s, BMS_PRIO_FULL, 3, __LINE__);
+}
+
+static void test_seq_wrap(void) {
+    bms_sched_t s;
+    bms_sched_init(&s);
+    s.next_seq = UINT32_MAX - 1;
+    for (uint16_t i = 0; i < 4; ++i) {
+        bms_sched_push(&s, BMS_PRIO_FAST, KIND_READ_ID, i);
+    }
+    for (uint16_t i = 0; i < 4; ++i) {
+        expect_pop(&s, BMS_PRIO_FAST, i, __LINE__);
+    }
+}
+
+int main(void) {
+    test_priority_order();
+    test_safety_overtakes_cycle();
+    test_fallback_after_cancel();
+    test_full_queue();
+    test_seq_wrap();
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All scheduler checks passed\n");
+    return 0;
+}